@@ -1,2 +1,13 @@
-gcc server.c -I/usr/local/lib/modbus -lmodbus -o server
+gcc server.c -I. -I/usr/local/lib/modbus -lmodbus -lpthread -o server
 
+# adaptor benchmark, one binary per transport
+ADAPTOR="modbus_adaptor.c modbus_sched.c modbus_coalesce.c modbus_cache.c modbus_wcomb.c modbus_serial.c modbus_rto.c modbus_health.c modbus_stats.c modbus_pdu.c modbus_ring.c modbus_image.c"
+gcc modbus_bench.c $ADAPTOR -I. -I/usr/local/lib/modbus -lmodbus -lpthread -lrt -o modbus_bench_rtu
+gcc -DMODBUS_TCP modbus_bench.c $ADAPTOR -I. -I/usr/local/lib/modbus -lmodbus -lpthread -lrt -o modbus_bench_tcp
+
+# bus owner daemon, one binary per transport. Clients link modbus_client.c
+gcc modbus_daemon.c $ADAPTOR -I. -I/usr/local/lib/modbus -lmodbus -lpthread -lrt -o modbusd_rtu
+gcc -DMODBUS_TCP modbus_daemon.c $ADAPTOR -I. -I/usr/local/lib/modbus -lmodbus -lpthread -lrt -o modbusd_tcp
+
+# circuit breaker regression test against the simulator, RTU: ./modbus_health_test [./server]
+gcc modbus_health_test.c $ADAPTOR -I. -I/usr/local/lib/modbus -lmodbus -lpthread -lrt -o modbus_health_test
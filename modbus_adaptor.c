@@ -8,809 +8,3037 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 
 #include "tracelog.h"
 #include "sem.h"
 #include "debug.h"
 #include "modbus_adaptor.h"
+#include "modbus_coalesce.h"
+#include "modbus_cache.h"
+#include "modbus_wcomb.h"
+#include "modbus_serial.h"
+#include "modbus_rto.h"
+#include "modbus_health.h"
+#include "modbus_stats.h"
+#include "modbus_pdu.h"
+#include "modbus_ring.h"
+#include "modbus_image.h"
 
 // --------------------------------------------------------- Type Definitions
+
+#ifdef MODBUS_TCP
+// A request on the wire of a pipelined connection
+typedef struct{
+    modbusRequest_t  *req;
+    uint16_t         tid;
+    uint64_t         sentUs;
+    uint64_t         deadlineUs;
+} modbusInflight_t;
+#else
+// A serial port of its own, see modbusAddRtuBus. Opened by modbusInit
+typedef struct{
+    char             *stty;
+    int              baud;
+    sem_t            *sem;
+} modbusRtuConf_t;
+#endif
+
+// A bus is one modbus context plus the thread that owns it, nothing else
+// touches ctx. TCP: one bus per BBU connection, RTU: one bus per line.
+// Submitters only push to ring, the bus thread moves what it finds there
+// to its own head/tail list to coalesce, merge and pick from
+typedef struct{
+    modbus_t         *ctx;
+    pthread_t        thread;
+    modbusRing_t     ring;
+    int              sleeping; // bus thread waits on wakeFd, see prepareToSleep
+    int              wakeFd;   // eventfd, written when sleeping was set
+    modbusRequest_t  *head;    // bus thread only
+    modbusRequest_t  *tail;
+    int              nqueued;  // on head/tail
+    int              ndeadlines; // of those, with a deadline
+    uint64_t         quietUntilUs; // RTU: earliest start of the next frame
+#ifndef MODBUS_TCP
+    int              baud;
+    sem_t            *sem;     // line lock shared with other processes, may be NULL
+    bool             lineHeld; // sem is ours, see releaseLine
+#else
+    // pipelined connections only, see tcpPipelineThread
+    uint16_t         nextTid;
+    int              ninflight;
+    modbusInflight_t inflight[MODBUS_TCP_MAX_WINDOW];
+    int              rxHave;
+    uint8_t          rx[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+#endif
+} modbusBus_t;
+
 // ----------------------------------------------------- Forward Declarations
 static int modbusWriteHoldingRegisters( modbus_t *ctx, int addr, int count, uint16_t *src  );
+static int modbusReadHoldingRegisters ( modbus_t *ctx, int addr, int count, uint16_t *val  );
+static int modbusReadInputRegisters   ( modbus_t *ctx, int addr, int count, uint16_t *dest );
+static int modbusReadBits             ( modbus_t *ctx, int addr, int count, uint8_t  *dest );
+static int modbusReadInputBits        ( modbus_t *ctx, int addr, int count, uint8_t  *dest );
 static int modbusWriteBits            ( modbus_t *ctx, int addr, int count, uint8_t  *dest );
+static int modbusWriteAndReadRegisters( modbus_t *ctx, int writeAddr, int writeCount, uint16_t *src,
+                                        int readAddr, int readCount, uint16_t *dest );
+static int modbusFrameBytes           ( int fc, int count, int *reqBytes, int *rspBytes );
+static int submitToBus                ( modbusBus_t *bus, modbusRequest_t *req, int id, int fc, int addr,
+                                        int count, void *data, modbusCallback_t cb, void *cbArg );
 
 // ---------------------------------------------------------------- Constants
 // --------------------------------------------------------- Static Variables
 #ifdef MODBUS_TCP
-static modbus_t *ctx_arr_tcp[12];
+static modbus_t    *ctx_arr_tcp[MAX_BBUM2_COUNT];
+static modbusBus_t bus_arr[MAX_BBUM2_COUNT];  // one per connection
+static int         num_buses;
 #else
-static           modbus_t *ctx_rtu;
+static modbus_t        *ctx_rtu[MODBUS_MAX_BUSES];
+static modbusBus_t     bus_arr[MODBUS_MAX_BUSES];  // one per line
+static modbusRtuConf_t rtu_conf[MODBUS_MAX_BUSES];
+static int             num_buses = 1;              // bus 0 is modbusSystemInit's tty
+static uint8_t         rtu_route[MODBUS_MAX_SLAVE_ID + 1];  // slave id -> bus
 #endif
 static int       cbbumId = -1;
 static sem_t     *modbus_sem = NULL;
 static int       num_bbus;
+static int       baud_rate;
+static bool      read_coalescing = true;
+static bool      write_read_merging = false;
+static __thread int thread_prio = MODBUS_PRIO_DEFAULT;
+static __thread uint32_t thread_deadline_us = 0;
+
+#ifdef MODBUS_TCP
+static int             tcp_window = 1;
+static int             tcp_gateway_conns = 0;   // 0: a port per BBU
+static modbusRequest_t broadcast_req[MODBUS_TCP_MAX_UNITS];
+static sem_t           broadcast_done;
+#endif
 
 // ----------------------------------------------------------- Implementation
 
-// not production, used to fake a TCP "broadcast"
-// ----------------------------------------------------------- sendFakeTcpBroadcastWorker
-#ifdef MODBUS_TCP
-static void *sendFakeTcpBroadcastWorker
+// ----------------------------------------------------------- getBus
+static modbusBus_t *getBus
 (
-    void *worker_args
+    int id
 )
 {
-    // can't return stack variables from pthread
-    int *rc = malloc( sizeof(int) );
-
-    modbusWriteHoldingArg_t *args = ( modbusWriteHoldingArg_t* )worker_args;
-    if( args->workeType == BROADCAST_HOLDING_REGISTER )
-    {
-        *rc = modbusWriteHoldingRegisters( args->ctx, args->addr, args->count, (uint16_t*)args->src );
-    }
-    else if( args->workeType == BROADCAST_BITS )
+#ifdef MODBUS_TCP
+    if ( 0 > id || id >= num_bbus )
     {
-        *rc = modbusWriteBits( args->ctx, args->addr, args->count, (uint8_t*)args->src );
+        TLE( "No TCP context for id = %d, num_bbus = %d", id, num_bbus );
+        return NULL;
     }
-    else
+
+    // a bus per BBU, or BBUs spread over the gateway connections
+    return &bus_arr[id % num_buses];
+#else
+    // 0 is broadcast, see setModbusContext
+    if ( MODBUS_BROADCAST_ID_RTU > id || id > num_bbus )
     {
-        TLE( "Unknown worker type" );
-        *rc = -1;
+        TLE( "No RTU slave for id = %d, num_bbus = %d", id, num_bbus );
+        return NULL;
     }
 
-    return (void *)rc;
-}
+    return &bus_arr[rtu_route[id]];
 #endif
-// ----------------------------------------------------------- configureModbusContext
-static int configureModbusContext
+}
+
+// ----------------------------------------------------------- maxBbuCount
+static int maxBbuCount
 (
-    modbus_t *ctx;
 )
 {
-  // for TCP, we need to set a sensible timeout
-  // default .5 Seconds, might leave it as is, tbd
-
-  // for RTU, we need to set a sensible timeout 
-  // and set MODBUS_RTU_RS485, we need to see if
-  // the hardware has a RS482 <-> RS232 or what,
-  // TBD
-
-  return 0;
+#ifdef MODBUS_TCP
+    return ( tcp_gateway_conns > 0 ) ? MODBUS_TCP_MAX_UNITS : MAX_BBUM2_COUNT;
+#else
+    return MAX_BBUM2_COUNT;
+#endif
 }
 
-// ----------------------------------------------------------- modbusInit
-static int modbusInit
+// ----------------------------------------------------------- isRead
+static bool isRead
 (
-    const char *ip,
-    const int  bbu_2_count,
-    const char *stty,
-    const int  baud
+    int fc
 )
 {
-    int rc;
-
-    if ( 0 > bbu_2_count || bbu_2_count > MAX_BBUM2_COUNT )
-    {
-      TLE( "bbu_2_count set wrong = %d", bbu_2_count );
-      return -1;
-    }
-
-    num_bbus = bbu_2_count;
+    return fc == MODBUS_FC_READ_HOLDING_REGISTERS || fc == MODBUS_FC_READ_INPUT_REGISTERS ||
+           fc == MODBUS_FC_READ_COILS || fc == MODBUS_FC_READ_DISCRETE_INPUTS;
+}
 
+// ----------------------------------------------------------- completeRequest
+static void completeRequest
+(
+    modbusRequest_t *req,
+    int             rc
+)
+{
 #ifdef MODBUS_TCP
-    if ( ip == NULL )
+    const int cacheId = req->id;
+#else
+    const int cacheId = ( req->slave == MODBUS_BROADCAST_ID_RTU ) ? MODBUS_CACHE_ALL_IDS : req->id;
+#endif
+    const int err = errno;   // of a failed rc, before the cache calls touch it
+
+    // keep the shadow registers in line with what went over the wire
+    if ( req->fc == MODBUS_FC_WRITE_AND_READ_REGISTERS )
     {
-       TLE( "IP set wrong!" );
-       return -1;
+        // the BBU writes before it reads, so does the cache
+        if ( rc != -1 )
+        {
+            modbusCacheUpdate( cacheId, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, req->writeAddr, req->writeCount, req->writeData );
+            modbusCacheUpdate( cacheId, MODBUS_FC_READ_HOLDING_REGISTERS, req->addr, req->count, req->data );
+            modbusImageUpdate( cacheId, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, req->writeAddr, req->writeCount, req->writeData, 0 );
+        }
+        else
+        {
+            modbusCacheInvalidate( cacheId, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, req->writeAddr, req->writeCount );
+        }
+        modbusImageUpdate( cacheId, MODBUS_FC_READ_HOLDING_REGISTERS, req->addr, req->count, req->data, ( rc == -1 ) ? err : 0 );
     }
-    TLV( "Setting up TCP MODBUS with ip = %s, bbu_2_count = %d", ip, bbu_2_count);
-
-    modbus_t *tmp_ctx;
-    int i;
-
-    for ( i = 0; i < bbu_2_count ; i++ )
+    else
     {
-        tmp_ctx = modbus_new_tcp( ip, MODBUS_TCP_PORT + i );
-        if ( tmp_ctx == NULL )
+        if ( rc != -1 )
         {
-            TLE( "Unable to create the libmodbus context, error = %s, errno = %d, context = %d",
-              modbus_strerror( errno ), errno, getModbusContext() );
-            return -1;
+            modbusCacheUpdate( cacheId, req->fc, req->addr, req->count, req->data );
         }
-
-        if ( modbus_connect( tmp_ctx ) == -1 )
+        else if ( !isRead( req->fc ) )
         {
-              TLE( "Connection failed: %s, ERRNO = %d, PORT = %d", modbus_strerror( errno ), errno, MODBUS_TCP_PORT + i );
-              modbus_free( tmp_ctx );
-              return -1;
+            modbusCacheInvalidate( cacheId, req->fc, req->addr, req->count );
         }
+        modbusImageUpdate( cacheId, req->fc, req->addr, req->count, req->data, ( rc == -1 ) ? err : 0 );
+    }
 
+    req->rc  = rc;
+    req->err = ( rc == -1 ) ? err : 0;
 
-        rc = configureModbusContext();
-        if ( rc != 0 )
-        {
-            TLE( "Failed to set the properties of the modbus driver!" );
-            return -1;
-        }
+    const uint64_t nowUs = modbusMonotonicUs();
 
-        ctx_arr_tcp[i] = tmp_ctx;
-    }
-#else
-    if ( stty == NULL )
+    if ( req->deadlineUs != 0 && nowUs > req->deadlineUs && !( rc == -1 && err == MODBUS_EDEADLINE ) )
     {
-        TLE( "STTY == NULL!" );
-        ABORT_ALWAYS();
+        modbusStatsRecordMissed( req->fc, req->slave, false );
     }
+    modbusStatsRecord( req->fc, req->slave, MODBUS_HIST_TOTAL, nowUs - req->submitUs );
 
-    // Update with valid BAUD rates(tbd)
-    if ( baud != 9600 )
+    // req may be freed by the callback, don't touch it afterwards
+    if ( req->cb != NULL )
     {
-        TLE( "Baud rate not supported = %d! ", baud );
-        ABORT_ALWAYS();
+        req->cb( req, req->cbArg );
     }
+    else
+    {
+        sem_post( &req->done );
+    }
+}
+
+// Queues the chain first..last (linked by next) in consecutive ring
+// slots, nothing else gets in between. -1 with errno EAGAIN if the bus
+// has no room for all of them, none is queued then
+// ----------------------------------------------------------- queueRequests
+static int queueRequests
+(
+    modbusBus_t     *bus,
+    modbusRequest_t *first,
+    modbusRequest_t *last
+)
+{
+    void            *items[MODBUS_RING_SIZE];
+    modbusRequest_t *r;
+    int             n = 0;
 
-    ctx_rtu = modbus_new_rtu( stty, baud, 'N', 8, 1 );
-    if ( ctx_rtu == NULL )
+    last->next = NULL;
+    for ( r = first; r != NULL; r = r->next )
     {
-        TLE( "Unable to create the libmodbus context, error = %s, errno = %d, context = %d",
-            modbus_strerror( errno ), errno, getModbusContext() );
-        return -1;
+        if ( n == MODBUS_RING_SIZE )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        items[n++] = r;
     }
 
-    if ( modbus_connect( ctx_rtu ) == -1 )
+    if ( modbusRingPush( &bus->ring, items, n ) != 0 )
     {
-        TLE( "Connection failed: %s, ERRNO = %d", modbus_strerror( errno ), errno );
-        modbus_free( ctx_rtu );
+        TLV( "Bus %d queue full", (int)( bus - bus_arr ) );
         return -1;
     }
 
-    rc = configureModbusContext();
-    if ( rc != 0 )
+    // pairs with the fence in prepareToSleep, either it sees the
+    // requests or we see it sleeping
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if ( __atomic_exchange_n( &bus->sleeping, 0, __ATOMIC_RELAXED ) != 0 )
     {
-        TLE( "Failed to set the properties of the modbus driver!" );
-        return -1;
+        const uint64_t one = 1;
+
+        if ( write( bus->wakeFd, &one, sizeof( one ) ) != sizeof( one ) )
+        {
+            TLE( "Failed to wake bus thread, errno = %d", errno );
+        }
     }
-#endif
+
     return 0;
 }
 
-// ----------------------------------------------------------- modbusWriteHoldingRegisters
-static int modbusWriteHoldingRegisters
+// ----------------------------------------------------------- queueRequest
+static int queueRequest
 (
-    modbus_t  *ctx,
-    int       addr,
-    int       count,
-    uint16_t  *src
+    modbusBus_t     *bus,
+    modbusRequest_t *req
 )
 {
-    if( ctx == NULL )
-    {
-        TLE( "cxt == NULL! \n" );
-        ABORT_ALWAYS();
-    }
-
-    int rc = modbus_write_registers( ctx, addr, count, src );
-    if ( rc == -1 ) {
-        TLE ( "MODBUS ERROR ON WRITE, ERRNO HUMAN = %s ERRONO = \n, CONTEXT = %d",
-            modbus_strerror( errno ), errno, getModbusContext() );
-        return -1;
-    }
-
-    return ( 0 );
+    return queueRequests( bus, req, req );
 }
 
-// ----------------------------------------------------------- modbusReadHoldingRegisters
-static int modbusReadHoldingRegisters
+// Bus thread: moves submitted requests to head/tail, up to one ring's
+// worth so the ring bounds what is queued in total
+// ----------------------------------------------------------- drainRing
+static void drainRing
 (
-    modbus_t *ctx,
-    int addr,
-    int count,
-    uint16_t *val
+    modbusBus_t *bus
 )
 {
-    if( ctx == NULL )
-    {
-        TLE ( "cxt == NULL!\n" );
-        ABORT_ALWAYS();
-    }
+    modbusRequest_t *req;
 
-    int rc = modbus_read_registers( ctx, addr, count, val );
-    if ( rc == -1 )
+    while ( bus->nqueued < MODBUS_RING_SIZE && ( req = modbusRingPop( &bus->ring ) ) != NULL )
     {
-        TLE ( "MODBUS ERROR ON READ %s, errno = %d", modbus_strerror(errno), errno );
-        return -1;
+        req->next = NULL;
+        if ( bus->tail == NULL )
+        {
+            bus->head = req;
+        }
+        else
+        {
+            bus->tail->next = req;
+        }
+        bus->tail = req;
+        bus->nqueued++;
+        if ( req->deadlineUs != 0 )
+        {
+            bus->ndeadlines++;
+        }
     }
-
-    return( rc );
 }
 
-// ----------------------------------------------------------- modbusReadBits
-static int modbusReadBits
+// Bus thread: announces it is about to sleep on wakeFd. false if a
+// request came in meanwhile, don't sleep then
+// ----------------------------------------------------------- prepareToSleep
+static bool prepareToSleep
 (
-    modbus_t *ctx,
-    int       addr,
-    int       count,
-    uint8_t   *dest
+    modbusBus_t *bus
 )
 {
-    if( ctx == NULL )
-    {
-        TLE ( "cxt == NULL!\n" );
-        ABORT_ALWAYS();
-    }
+    __atomic_store_n( &bus->sleeping, 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
 
-    int rc = modbus_read_bits( ctx, addr, count, dest );
-    if ( rc == -1 )
+    if ( !modbusRingEmpty( &bus->ring ) )
     {
-        TLE ( "MODBUS ERROR ON READ BITS %s, errno = %d", modbus_strerror(errno), errno );
-        return -1;
+        __atomic_store_n( &bus->sleeping, 0, __ATOMIC_RELAXED );
+        return false;
     }
 
-    return( rc );
+    return true;
 }
 
-// ----------------------------------------------------------- modbusReadInputBits
-static int modbusReadInputBits
+// Bus thread: consumes the wakeups after wakeFd was readable or slept on
+// ----------------------------------------------------------- clearWakeups
+static void clearWakeups
 (
-    modbus_t *ctx,
-    int       addr,
-    int       count,
-    uint8_t   *dest
+    modbusBus_t *bus
 )
 {
-    if( ctx == NULL )
-    {
-        TLE ( "cxt == NULL!\n" );
-        ABORT_ALWAYS();
-    }
+    uint64_t wakeups;
 
-    int rc = modbus_read_input_bits( ctx, addr, count, dest );
-    if ( rc == -1 )
+    if ( read( bus->wakeFd, &wakeups, sizeof( wakeups ) ) != sizeof( wakeups ) && errno != EAGAIN )
     {
-        TLE ( "MODBUS ERROR ON READ INPUT BITS %s, errno = %d", modbus_strerror(errno), errno );
-        return -1;
+        TLE( "Failed to read wakeups, errno = %d", errno );
     }
-
-    return( rc );
 }
 
-// ----------------------------------------------------------- modbusWriteBits
-static int modbusWriteBits
+// Bus thread: takes req, queued behind prev (NULL: req is the head),
+// off head/tail
+// ----------------------------------------------------------- unlinkRequest
+static void unlinkRequest
 (
-    modbus_t *ctx,
-    int       addr,
-    int       count,
-    uint8_t   *src
+    modbusBus_t     *bus,
+    modbusRequest_t *prev,
+    modbusRequest_t *req
 )
 {
-    if( ctx == NULL )
+    if ( prev == NULL )
     {
-        TLE ( "cxt == NULL!\n" );
-        ABORT_ALWAYS();
+        bus->head = req->next;
     }
-
-    int rc = modbus_write_bits( ctx, addr, count, src );
-    if ( rc == -1 )
+    else
     {
-        TLE ( "MODBUS ERROR ON WRITE BITS %s, errno = %d", modbus_strerror(errno), errno );
-        return -1;
+        prev->next = req->next;
     }
 
-    return( rc );
+    if ( bus->tail == req )
+    {
+        bus->tail = prev;
+    }
+    bus->nqueued--;
+    if ( req->deadlineUs != 0 )
+    {
+        bus->ndeadlines--;
+    }
 }
 
-
-// -------------------------------------------------------------- modbusReadHoldingRegistersAdaptor 
-int modbusReadHoldingRegistersAdaptor
+// Bus thread: completes the queued requests that can't make their
+// deadline any more, they never go on the wire
+// ----------------------------------------------------------- dropExpired
+static void dropExpired
 (
-    int      addr,
-    int      count,
-    uint16_t *dest
+    modbusBus_t *bus
 )
 {
-    int rc;
-    const int id = getModbusContext();
-
-    if ( 0 > count || count > MODBUS_MAX_WR_READ_REGISTERS )
-    {
-        TLE ( "Register Read count incorrect = %d", count );
-        ABORT_ALWAYS();
-    }
+    modbusRequest_t *prev = NULL;
+    modbusRequest_t *next;
+    modbusRequest_t *r;
+    uint64_t        nowUs;
 
-    if( dest == NULL )
+    if ( bus->ndeadlines == 0 )
     {
-        TLE ( "dest is null!" );
-        ABORT_ALWAYS();
+        return;
     }
 
-    rc = sem_timedwait_helper( MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL );
-    if( rc != 0 )
+    nowUs = modbusMonotonicUs();
+    for ( r = bus->head; r != NULL; r = next )
     {
-        TLE ( "Failed to get mutex to write registers with id = %d", id );
-        ABORT_ALWAYS();
+        next = r->next;
+        if ( r->deadlineUs != 0 && nowUs + modbusTransactionTimeUs( r->id, r->fc, r->count ) > r->deadlineUs )
+        {
+            unlinkRequest( bus, prev, r );
+            modbusStatsRecordMissed( r->fc, r->slave, true );
+            errno = MODBUS_EDEADLINE;
+            completeRequest( r, -1 );
+            continue;
+        }
+        prev = r;
     }
+}
 
+// ----------------------------------------------------------- isBroadcast
+static bool isBroadcast
+(
+    const modbusRequest_t *req
+)
+{
 #ifdef MODBUS_TCP
-   rc =  modbusReadHoldingRegisters ( ctx_arr_tcp[id], addr, count, dest );
-   goto cleanup;
+    return false;
 #else
-    rc = modbus_set_slave( ctx_rtu, id );
-    if ( rc != 0 )
-    {
-      TLE ("Failed to set the ID for context %d", id );
-      goto cleanup_abort;
-    }
-    rc =  modbusReadHoldingRegisters ( ctx_rtu, addr, count, dest );
-    goto cleanup;
+    return req->slave == MODBUS_BROADCAST_ID_RTU;
 #endif
+}
 
-cleanup:
-   sem_post( modbus_sem );
-   return rc;
+// Class of req after waiting, MODBUS_PRIO_AGING_US counts as one class
+// up so background scans can't starve
+// ----------------------------------------------------------- effectivePriority
+static int effectivePriority
+(
+    const modbusRequest_t *req,
+    uint64_t              nowUs
+)
+{
+    const uint64_t waitedUs = ( nowUs > req->submitUs ) ? nowUs - req->submitUs : 0;
+    const uint64_t steps    = waitedUs / MODBUS_PRIO_AGING_US;
 
-#ifndef MODBUS_TCP
-cleanup_abort:
-   sem_post ( modbus_sem );
-   ABORT_ALWAYS();
-   return -1; // will not get here, to stop compiler from complaining
-#endif
+    return ( steps >= (uint64_t)req->prio ) ? MODBUS_PRIO_CONTROL : req->prio - (int)steps;
 }
 
-// -------------------------------------------------------------- modbusBroadCastHoldingRegistersAdaptor
-int modbusBroadCastHoldingRegistersAdaptor
+// Bus thread: the queued request to run next, the best effective class
+// and the first queued among equals. A request never passes an earlier
+// write to its slave, so writes of a slave stay in order and a read
+// sees every write queued before it. NULL on an empty queue
+// ----------------------------------------------------------- selectRequest
+static modbusRequest_t *selectRequest
 (
-    int       addr,
-    int       count,
-    uint16_t  *src
+    modbusBus_t     *bus,
+    modbusRequest_t **bestPrev
 )
 {
-    int rc;
-    int ret = 0;
-
-    if ( 0 > count || count > MODBUS_MAX_WR_READ_REGISTERS )
+    uint64_t        written[MODBUS_MAX_SLAVE_ID / 64 + 1] = { 0 };
+    bool            anyWrite = false;
+    bool            allWritten = false;   // behind a broadcast write
+    modbusRequest_t *best = NULL;
+    modbusRequest_t *prev = NULL;
+    modbusRequest_t *r;
+    const uint64_t  nowUs = modbusMonotonicUs();
+    int             bestPrio = MODBUS_PRIO_BACKGROUND + 1;
+    int             prio;
+
+    for ( r = bus->head; r != NULL; prev = r, r = r->next )
     {
-        TLE (" Broadcast holding register write has incorrect write count = %d", count );
-        ABORT_ALWAYS();
-    }
+        const bool passes = !allWritten && ( isBroadcast( r ) ? !anyWrite :
+                                             !( written[r->slave / 64] & ( 1ULL << ( r->slave % 64 ) ) ) );
 
-    if( src == NULL )
-    {
-        TLE ( "src is null!" );
-        ABORT_ALWAYS();
+        if ( passes )
+        {
+            prio = effectivePriority( r, nowUs );
+            if ( prio < bestPrio )
+            {
+                best      = r;
+                *bestPrev = prev;
+                bestPrio  = prio;
+                if ( prio == MODBUS_PRIO_CONTROL )
+                {
+                    break;
+                }
+            }
+        }
+
+        if ( !isRead( r->fc ) )
+        {
+            anyWrite = true;
+            if ( isBroadcast( r ) )
+            {
+                allWritten = true;
+            }
+            else
+            {
+                written[r->slave / 64] |= 1ULL << ( r->slave % 64 );
+            }
+        }
     }
 
-    rc = sem_timedwait_helper( MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL );
-    if( rc != 0 )
-    {
-        TLE ("Failed to get mutext to broadcast in modbusBroadCastHoldingRegistersAdaptor");
-        ABORT_ALWAYS();
-    }
-#ifdef MODBUS_TCP
-    //          ***IMPORTANT***
-    // TCP IS A ONE-TO-ONE PROTOCOL
-    // IT DOES NOT SUPPORT BROADCAST, THIS IS A
-    // POOR HACK TO ALLOW SOME TESTING, ONLY
-    // RTU/UDP SUPPORTS BROADCAST, WHEN A CLIENT
-    // BROADCASTS IT DOES NOT EXPECT A RESPONSE,
-    // HOWEVER WE NEED TO SIT AND WAIT FOR A
-    // RESPONSE SINCE WE ARE USING TCP, TO BETTER
-    // SERIALIZE THIS PROCESS WE WILL SEND THE
-    // BROADCAST FROM IT'S OWN THREAD
-    //
-    // For simplicity, this function does not do advanced
-    // (or in cases, any) error recovery - it's only
-    // run during simulations
+    return best;
+}
 
-    pthread_t                threads[num_bbus];
-    modbusWriteHoldingArg_t  worker_args[num_bbus];
+// Returns NULL on an empty queue unless block is set
+// ----------------------------------------------------------- dequeueRequest
+static modbusRequest_t *dequeueRequest
+(
+    modbusBus_t *bus,
+    bool        block
+)
+{
+    modbusRequest_t *prev = NULL;
+    modbusRequest_t *req;
 
-    int i;
-    for( i = 0; i < num_bbus; i++ )
+    drainRing( bus );
+    dropExpired( bus );
+    while ( bus->head == NULL )
     {
-        // Note: worker_args is not copied when pthread_create is called
-        worker_args[i].ctx       = ctx_arr_tcp[i];
-        worker_args[i].addr      = addr;
-        worker_args[i].count     = count;
-        worker_args[i].src       = src;
-        worker_args[i].workeType = BROADCAST_HOLDING_REGISTER;
-
-        rc = pthread_create( &threads[i], NULL, sendFakeTcpBroadcastWorker, (void *)&worker_args[i] );
-        if ( rc )
+        if ( !block )
         {
-            TLE( "Failed to create worker thread for broadcast");
-            goto cleanup_abort;
+            return NULL;
         }
-    }
-
-    // wait for all the threads to join
-    for ( i = 0; i < num_bbus; i++ )
-    {
-        int *returnVal = NULL;
-        pthread_join( threads[i], (void**)&returnVal );
 
-        if( returnVal == NULL )
+        if ( prepareToSleep( bus ) )
         {
-            TLE( "pthread returned NULL!" );
-            goto cleanup_abort;
+            clearWakeups( bus );
         }
+        drainRing( bus );
+        dropExpired( bus );
+    }
 
-        if( *returnVal == -1 )
-        {
-            ret = -1;
-        }
+    req = selectRequest( bus, &prev );
+    unlinkRequest( bus, prev, req );
 
-        free( returnVal );
-    }
-    goto cleanup;
-#else
-    // set the slave ID to BROADCAST
-    rc = modbus_set_slave( ctx_rtu, MODBUS_BROADCAST_ID_RTU );
-    if ( rc != 0 )
-    {
-      TLE ("Failed to set the ID for broadcast!" );
-      goto cleanup_abort;
-    }
+    return req;
+}
 
-    ret = modbusWriteHoldingRegisters(ctx_rtu, addr, count, src);
-    goto cleanup;
-#endif
+#ifndef MODBUS_TCP
+// RTU character timing per the serial line guide (V1.02, 2.5.1.1): 1.5
+// and 3.5 character times, fixed at 750/1750 us above 19200 baud where
+// the character based values get too short for the slaves' UARTs
+// ----------------------------------------------------------- rtuCharUs
+static uint32_t rtuCharUs
+(
+    int baud
+)
+{
+    return ( MODBUS_RTU_BITS_PER_CHAR * 1000000 + baud - 1 ) / baud;
+}
 
-cleanup:
-   sem_post( modbus_sem );
-   return ret;
+// ----------------------------------------------------------- rtuT15Us
+static uint32_t rtuT15Us
+(
+    int baud
+)
+{
+    return ( baud > MODBUS_RTU_FIXED_GAP_BAUD ) ? MODBUS_RTU_T15_FIXED_US : ( 3 * rtuCharUs( baud ) ) / 2;
+}
 
-cleanup_abort:
-   sem_post ( modbus_sem );
-   ABORT_ALWAYS ();
-   return -1;
+// ----------------------------------------------------------- rtuT35Us
+static uint32_t rtuT35Us
+(
+    int baud
+)
+{
+    return ( baud > MODBUS_RTU_FIXED_GAP_BAUD ) ? MODBUS_RTU_T35_FIXED_US : ( 7 * rtuCharUs( baud ) ) / 2;
 }
 
-// -------------------------------------------------------------- modbusBroadCastBitsAdaptor
-int modbusBroadCastBitsAdaptor
+// libmodbus starts the response timer once write() returned, i.e. the
+// request is still in the UART. Covers draining it, the slave's t3.5 end
+// of frame detection and the first response character, the slave's
+// turnaround comes on top (see modbusRtoTimeoutUs)
+// ----------------------------------------------------------- rtuFirstByteUs
+static uint32_t rtuFirstByteUs
 (
-    int       addr,
-    int       count,
-    uint8_t  *src
+    int baud,
+    int fc,
+    int count
 )
 {
-    int rc;
-    int ret = 0;
+    int reqBytes;
+    int rspBytes;
 
-    if ( 0 > count || count > MODBUS_MAX_WRITE_BITS )
+    if ( modbusFrameBytes( fc, count, &reqBytes, &rspBytes ) != 0 )
     {
-        TLE (" Broadcast bits write has incorrect write count = %d", count );
-        ABORT_ALWAYS();
+        reqBytes = MODBUS_RTU_MAX_ADU_LENGTH;
     }
 
-    if( src == NULL )
+    return ( reqBytes + 1 ) * rtuCharUs( baud ) + rtuT35Us( baud ) + MODBUS_RTU_OS_SLACK_US;
+}
+
+// Time a transaction spends on the wire by itself, subtracted from the
+// measured duration so the RTT estimate tracks the slave's turnaround
+// and doesn't swing with the frame size
+// ----------------------------------------------------------- rtuWireUs
+static uint32_t rtuWireUs
+(
+    int baud,
+    int fc,
+    int count
+)
+{
+    int reqBytes;
+    int rspBytes;
+
+    if ( modbusFrameBytes( fc, count, &reqBytes, &rspBytes ) != 0 )
     {
-        TLE ( "src is null!" );
-        ABORT_ALWAYS();
+        return 0;
     }
 
-    rc = sem_timedwait_helper( MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL );
-    if( rc != 0 )
+    return ( reqBytes + rspBytes ) * rtuCharUs( baud ) + rtuT35Us( baud );
+}
+
+// Keeps the line silent for t3.5 after the last frame, or for the
+// turnaround after a broadcast since no response tells us the slaves are
+// done with it. libmodbus sends as soon as it is called
+// ----------------------------------------------------------- waitInterFrameGap
+static void waitInterFrameGap
+(
+    modbusBus_t *bus
+)
+{
+    const uint64_t now = modbusMonotonicUs();
+
+    if ( now < bus->quietUntilUs )
     {
-        TLE ("Failed to get mutext to broadcast in modbusBroadCastBitsAdaptor");
-        ABORT_ALWAYS();
+        usleep( (useconds_t)( bus->quietUntilUs - now ) );
     }
-#ifdef MODBUS_TCP
-    //          ***IMPORTANT***
-    // TCP IS A ONE-TO-ONE PROTOCOL
-    // IT DOES NOT SUPPORT BROADCAST, THIS IS A
-    // POOR HACK TO ALLOW SOME TESTING, ONLY
-    // RTU/UDP SUPPORTS BROADCAST, WHEN A CLIENT
-    // BROADCASTS IT DOES NOT EXPECT A RESPONSE,
-    // HOWEVER WE NEED TO SIT AND WAIT FOR A
-    // RESPONSE SINCE WE ARE USING TCP, TO BETTER
-    // SERIALIZE THIS PROCESS WE WILL SEND THE
-    // BROADCAST FROM IT'S OWN THREAD
-    //
-    // For simplicity, this function does not do advanced
-    // (or in cases, any) error recovery - it's only
-    // run during simulations
+}
+#endif
 
-    pthread_t                threads[num_bbus];
-    modbusWriteHoldingArg_t  worker_args[num_bbus];
+// Stats, slave health and RTT estimate of a finished transaction. wireUs
+// is the part of elapsedUs spent sending/receiving the frames
+// ----------------------------------------------------------- recordTransaction
+static void recordTransaction
+(
+    modbusBus_t     *bus,
+    modbusRequest_t *req,
+    int             rc,
+    int             err,
+    uint64_t        elapsedUs,
+    uint32_t        wireUs,
+    bool            answered
+)
+{
+    int txBytes;
+    int rxBytes;
 
-    int i;
-    for( i = 0; i < num_bbus; i++ )
+    modbusFrameBytes( req->fc, req->count, &txBytes, &rxBytes );
+    if ( req->fc == MODBUS_FC_WRITE_AND_READ_REGISTERS )
     {
-        // Note: worker_args is not copied when pthread_create is called
-        worker_args[i].ctx       = ctx_arr_tcp[i];
-        worker_args[i].addr      = addr;
-        worker_args[i].count     = count;
-        worker_args[i].src       = src;
-        worker_args[i].workeType = BROADCAST_BITS;
-
-        rc = pthread_create( &threads[i], NULL, sendFakeTcpBroadcastWorker, (void *)&worker_args[i] );
-        if ( rc )
-        {
-            TLE( "Failed to create worker thread for broadcast");
-            goto cleanup_abort;
-        }
+        txBytes += 2 * req->writeCount;
     }
+#ifdef MODBUS_TCP
+    // MBAP header instead of slave id + CRC
+    txBytes += MODBUS_TCP_ADU_OVERHEAD;
+    rxBytes += MODBUS_TCP_ADU_OVERHEAD;
+#endif
+    modbusStatsRecordFrame( (int)( bus - bus_arr ), req->fc, req->slave, elapsedUs, txBytes,
+                            ( !answered || ( rc == -1 && err == ETIMEDOUT ) ) ? 0 : rxBytes, ( rc == -1 ) ? err : 0 );
 
-    // wait for all the threads to join
-    for ( i = 0; i < num_bbus; i++ )
+    if ( answered )
     {
-        int *returnVal = NULL;
-        pthread_join( threads[i], (void**)&returnVal );
+        // an exception response from the slave is an answer too, a
+        // gateway's path/target exception means the BBU behind it is not
+        modbusHealthResult( req->slave, rc != -1 || ( EMBXILFUN <= err && err <= EMBXSFAIL ) );
 
-        if( returnVal == NULL )
+        if ( rc != -1 )
         {
-            TLE( "pthread returned NULL!" );
-            goto cleanup_abort;
+            modbusRtoSample( req->slave, ( elapsedUs > wireUs ) ? (uint32_t)( elapsedUs - wireUs ) : 0 );
         }
-
-        if( *returnVal == -1 )
+        else if ( err == ETIMEDOUT )
         {
-            ret = -1;
+            modbusRtoTimedOut( req->slave );
         }
-
-        free( returnVal );
-    }
-    goto cleanup;
-#else
-    // set the slave ID to BROADCAST
-    rc = modbus_set_slave( ctx_rtu, MODBUS_BROADCAST_ID_RTU );
-    if ( rc != 0 )
-    {
-      TLE ("Failed to set the ID for broadcast!" );
-      goto cleanup_abort;
     }
-
-    ret = modbusWriteHoldingRegisters(ctx_rtu, addr, count, src);
-    goto cleanup;
-#endif
-
-cleanup:
-   sem_post( modbus_sem );
-   return ret;
-
-cleanup_abort:
-   sem_post ( modbus_sem );
-   ABORT_ALWAYS ();
-   return -1;
 }
 
-// Write coil (rw)
-// -------------------------------------------------------------- modbusWriteBitsAdaptor
-int modbusWriteBitsAdaptor
+// Runs one request on the wire, only ever called from the bus thread
+// ----------------------------------------------------------- executeRequest
+static int executeRequest
 (
-    int addr, 
-    int count,
-    uint8_t *src 
+    modbusBus_t     *bus,
+    modbusRequest_t *req
 )
 {
-    int rc;
-    const int id = getModbusContext();
+    uint32_t timeoutUs;
+    uint32_t wireUs;
+    uint64_t pickedUs;
+    uint64_t startUs;
+    int      rc;
+#ifdef MODBUS_TCP
+    const bool answered = true;
+#else
+    // a broadcast has no response to time or judge the slave by
+    const bool answered = ( req->slave != MODBUS_BROADCAST_ID_RTU );
+#endif
 
-    if ( 0 > count || count > MODBUS_MAX_WRITE_BITS )
+    // a slave that is down doesn't get bus time
+    if ( answered && !modbusHealthAdmit( req->slave ) )
     {
-        TLE ("write coil bit count incorrect = %d", count );
-        ABORT_ALWAYS();  
+        errno = MODBUS_EDOWN;
+        return -1;
     }
 
-    if( src == NULL )
+    pickedUs = modbusMonotonicUs();
+    modbusStatsRecord( req->fc, req->slave, MODBUS_HIST_QUEUE, pickedUs - req->submitUs );
+
+#ifndef MODBUS_TCP
+    // the line may be shared with other processes, whoever holds it may
+    // be waiting on a dead slave. Fail the request, not the process.
+    // Held until the bus thread is done with the step, see releaseLine
+    rc = 0;
+    if ( bus->sem != NULL && !bus->lineHeld )
     {
-        TLE ("src is null!");
-        ABORT_ALWAYS();  
+        rc = sem_timedwait_helper( MAX_MODBUS_TIMEOUT, bus->sem, TRY_TO_RECOVER_ON_FAIL );
+        bus->lineHeld = ( rc == 0 );
+    }
+    modbusStatsRecord( req->fc, req->slave, MODBUS_HIST_SEM, modbusMonotonicUs() - pickedUs );
+    if ( rc != 0 )
+    {
+        TLE( "Could not get modbus mutex, slave == %d, fc = %d", req->slave, req->fc );
+        if ( answered )
+        {
+            modbusHealthCancel( req->slave );
+        }
+        errno = EBUSY;
+        return -1;
     }
 
-    rc = sem_timedwait_helper(MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL);
+    rc = modbus_set_slave( bus->ctx, req->slave );
     if ( rc != 0 )
     {
-        TLE ("Could not get modbus mutex, context == %d for write coil", id);
+        TLE( "Failed to set the ID for slave %d", req->slave );
+        if ( answered )
+        {
+            modbusHealthCancel( req->slave );
+        }
+        if ( bus->lineHeld )
+        {
+            sem_post( bus->sem );
+        }
         ABORT_ALWAYS();
     }
 
-#ifdef MODBUS_TCP
-    rc = modbusWriteBits( ctx_arr_tcp[id], addr, count, src );
-    goto cleanup;
-#else
-    rc = modbus_set_slave( ctx_rtu, id );
-    if ( rc != 0 ) 
+    timeoutUs = rtuFirstByteUs( bus->baud, req->fc, req->count ) + modbusRtoTimeoutUs( req->slave );
+    wireUs    = rtuWireUs( bus->baud, req->fc, req->count );
+    if ( req->fc == MODBUS_FC_WRITE_AND_READ_REGISTERS )
     {
-        TLE ("Failed to set the ID for context %d", getModbusContext() );
-        goto cleanup_abort;
+        // the write half's data, both wait for it to drain
+        timeoutUs += 2 * req->writeCount * rtuCharUs( bus->baud );
+        wireUs    += 2 * req->writeCount * rtuCharUs( bus->baud );
     }
 
-    rc = modbusWriteBits ( ctx_rtu, addr, count, src );
-    goto cleanup;
+    waitInterFrameGap( bus );
+#else
+    timeoutUs = modbusRtoTimeoutUs( req->slave );
+    wireUs    = 0;
 #endif
+    modbus_set_response_timeout( bus->ctx, timeoutUs / 1000000, timeoutUs % 1000000 );
+    startUs = modbusMonotonicUs();
 
-cleanup:
-    sem_post( modbus_sem );
-    return rc;
+    switch ( req->fc )
+    {
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            rc = modbusReadHoldingRegisters( bus->ctx, req->addr, req->count, (uint16_t*)req->data );
+            break;
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            rc = modbusReadInputRegisters( bus->ctx, req->addr, req->count, (uint16_t*)req->data );
+            break;
+        case MODBUS_FC_READ_COILS:
+            rc = modbusReadBits( bus->ctx, req->addr, req->count, (uint8_t*)req->data );
+            break;
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            rc = modbusReadInputBits( bus->ctx, req->addr, req->count, (uint8_t*)req->data );
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            rc = modbusWriteHoldingRegisters( bus->ctx, req->addr, req->count, (uint16_t*)req->data );
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            rc = modbusWriteBits( bus->ctx, req->addr, req->count, (uint8_t*)req->data );
+            break;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            rc = modbusWriteAndReadRegisters( bus->ctx, req->writeAddr, req->writeCount, req->writeData,
+                                              req->addr, req->count, (uint16_t*)req->data );
+            break;
+        default:
+            TLE( "Unknown function code = %d", req->fc );
+            errno = EINVAL;
+            rc    = -1;
+            break;
+    }
+
+    const int err = errno;
+
+    recordTransaction( bus, req, rc, err, modbusMonotonicUs() - startUs, wireUs, answered );
+
+    // a late response must not be taken for the next one's
+    if ( rc == -1 && err == ETIMEDOUT )
+    {
+        modbus_flush( bus->ctx );
+    }
 
 #ifndef MODBUS_TCP
-cleanup_abort:
-    sem_post ( modbus_sem );
-    ABORT_ALWAYS ();
-    return -1;
+    bus->quietUntilUs = modbusMonotonicUs() +
+        ( ( req->slave == MODBUS_BROADCAST_ID_RTU ) ? MODBUS_RTU_TURNAROUND_US : rtuT35Us( bus->baud ) );
 #endif
+    errno = err;
+    return rc;
 }
 
-// Read input-bit (ro)
-// -------------------------------------------------------------- modbusWriteBitsAdaptor
-int modbusReadInputBitsAdaptor
+// Moves up to max queued reads of the same slave and function code as req
+// to out. Stops at the first write that may touch that slave, a read
+// must never be moved ahead of a write it could observe
+// ----------------------------------------------------------- takeMatchingReads
+static int takeMatchingReads
 (
-    int addr,
-    int count, 
-    uint8_t *dest
+    modbusBus_t     *bus,
+    modbusRequest_t *req,
+    modbusRequest_t **out,
+    int             max
 )
 {
-    int rc;
-    const int id = getModbusContext();
+    modbusRequest_t *prev = NULL;
+    modbusRequest_t *r;
+    int             n = 0;
 
-    if ( 0 > count || count > MODBUS_MAX_READ_BITS )
+    drainRing( bus );
+    r = bus->head;
+    while ( r != NULL && n < max )
     {
-        TLE ("Read input-bit count incorrect = %d", count );
-        ABORT_ALWAYS();
-    }
+        if ( !isRead( r->fc ) && ( r->slave == req->slave || r->slave == MODBUS_BROADCAST_ID_RTU ) )
+        {
+            break;
+        }
 
-    if( dest == NULL )
-    {
-        TLE ("dest is null!");
-        ABORT_ALWAYS();
-    }
+        if ( r->slave == req->slave && r->fc == req->fc )
+        {
+            unlinkRequest( bus, prev, r );
 
-    rc = sem_timedwait_helper (MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL );
-    if ( rc != 0 )
-    {
-        TLE ( "Could not get modbus mutex, context == %d for read-input-bit", id );
-        ABORT_ALWAYS();
+            out[n++] = r;
+            r = r->next;
+            continue;
+        }
+
+        prev = r;
+        r    = r->next;
     }
 
-#ifdef MODBUS_TCP
-    rc = modbusReadInputBits( ctx_arr_tcp[id], addr, count, dest );
-    goto cleanup;
-#else
-    rc = modbus_set_slave( ctx_rtu, id );
-    if ( rc != 0 ) 
+    return n;
+}
+
+// Runs reads of one slave/function code as few merged requests as
+// modbusPlanReads allows and scatters the result to every caller
+// ----------------------------------------------------------- executeReads
+static void executeReads
+(
+    modbusBus_t     *bus,
+    modbusRequest_t **reqs,
+    int             n
+)
+{
+    modbusSpan_t    spans[MODBUS_COALESCE_MAX_REQS];
+    uint16_t        regs[MODBUS_MAX_READ_REGISTERS];
+    uint8_t         bits[MODBUS_MAX_READ_BITS];
+    modbusRequest_t merged;
+    modbusRequest_t *r;
+    const int       fc     = reqs[0]->fc;
+    const int       slave  = reqs[0]->slave;
+    const bool      isBits = ( fc == MODBUS_FC_READ_COILS || fc == MODBUS_FC_READ_DISCRETE_INPUTS );
+    const int       unit   = isBits ? sizeof( uint8_t ) : sizeof( uint16_t );
+    const int       max    = isBits ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+    uint8_t         *scratch = isBits ? (uint8_t*)bits : (uint8_t*)regs;
+    uint32_t        frameCostUs;
+    uint32_t        unitCostNs;
+    int             nspans;
+    int             rc;
+    int             err;
+    int             i;
+    int             j;
+
+    // cost of one more frame vs. one more register/bit in a frame
+    frameCostUs = modbusTransactionTimeUs( slave, fc, 0 );
+    unitCostNs  = (uint32_t)( ( (uint64_t)( modbusTransactionTimeUs( slave, fc, max ) - frameCostUs ) * 1000 ) / max );
+
+    nspans = modbusPlanReads( reqs, n, frameCostUs, unitCostNs, max, spans );
+
+    for ( i = 0; i < nspans; i++ )
     {
-        TLE ("Failed to set the ID for context %d", getModbusContext() );
-        goto cleanup_abort;
-    }
+        if ( spans[i].n == 1 )
+        {
+            r = reqs[spans[i].first];
+            completeRequest( r, executeRequest( bus, r ) );
+            continue;
+        }
 
-    rc = modbusReadInputBits( ctx_rtu, addr, count, dest );
-    goto cleanup;
-#endif
+        merged       = *reqs[spans[i].first];
+        merged.addr  = spans[i].addr;
+        merged.count = spans[i].count;
+        merged.data  = scratch;
 
-cleanup:
-    sem_post( modbus_sem );
-    return rc;
+        rc  = executeRequest( bus, &merged );
+        err = errno;
 
-#ifndef MODBUS_TCP
-cleanup_abort:
-    sem_post ( modbus_sem );
-    ABORT_ALWAYS ();
-    return -1;
-#endif
+        // a hole we read through is not mapped on the BBU, do them one by one
+        if ( rc == -1 && err == EMBXILADD )
+        {
+            for ( j = spans[i].first; j < spans[i].first + spans[i].n; j++ )
+            {
+                completeRequest( reqs[j], executeRequest( bus, reqs[j] ) );
+            }
+            continue;
+        }
 
+        for ( j = spans[i].first; j < spans[i].first + spans[i].n; j++ )
+        {
+            r = reqs[j];
+            if ( rc != -1 )
+            {
+                memcpy( r->data, scratch + ( r->addr - merged.addr ) * unit, r->count * unit );
+            }
+            // the previous completion's callback may have clobbered it
+            errno = err;
+            completeRequest( r, ( rc == -1 ) ? -1 : r->count );
+        }
+    }
 }
 
-// Read coil (rw)
-// -------------------------------------------------------------- modbusReadBitsAdaptor
-int modbusReadBitsAdaptor 
+// The read of write's slave at the head of the queue, unlinked, if the
+// two fit one FC23 frame
+// ----------------------------------------------------------- takeAdjacentRead
+static modbusRequest_t *takeAdjacentRead
 (
-    int       addr,
-    int       count,
-    uint8_t   *dest
+    modbusBus_t     *bus,
+    modbusRequest_t *write
 )
 {
-    int rc;
-    const int id = getModbusContext();
-
-    if ( 0 > count || count > MODBUS_MAX_READ_BITS )
-    {
-        TLE ("Read coil bit count incorrect = %d", count );
-        ABORT_ALWAYS();  
-    }
+    modbusRequest_t *r;
 
-    if( dest == NULL )
+#ifndef MODBUS_TCP
+    if ( write->slave == MODBUS_BROADCAST_ID_RTU )
     {
-        TLE ("dest is null!");
-        ABORT_ALWAYS();  
+        return NULL;
     }
-
-    rc = sem_timedwait_helper(MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL);
-    if ( rc != 0 )
+#endif
+    if ( write->count > MODBUS_MAX_WR_WRITE_REGISTERS )
     {
-        TLE ("Could not get modbus mutex, context == %d", getModbusContext);
-        ABORT_ALWAYS();
+        return NULL;
     }
 
-#ifdef MODBUS_TCP
-    rc = modbusReadBits( ctx_arr_tcp[id], addr, count, dest );
-    goto cleanup;
-#else
-    rc = modbus_set_slave( ctx_rtu, id );
-    if ( rc != 0 )
+    drainRing( bus );
+    r = bus->head;
+    if ( r == NULL || r->fc != MODBUS_FC_READ_HOLDING_REGISTERS || r->slave != write->slave ||
+         0 >= r->count || r->count > MODBUS_MAX_WR_READ_REGISTERS )
     {
-      TLE ("Failed to set the ID for context %d", getModbusContext() );
-      goto cleanup_abort;
+        return NULL;
     }
 
-    rc = modbusReadBits ( ctx_rtu, addr, count, dest );
-    goto cleanup;
-#endif
-
-cleanup:
-    sem_post( modbus_sem );
-    return rc;
-#ifndef MODBUS_TCP
-cleanup_abort:
-    sem_post ( modbus_sem );
-    ABORT_ALWAYS ();
-    return -1;
-#endif
+    unlinkRequest( bus, NULL, r );
+    return r;
 }
 
-// -------------------------------------------------------------- modbusReadInputRegistersAdaptor 
-int modbusWriteHoldingRegistersAdaptor
+// Runs a register write and the read queued behind it as one FC23
+// round trip. The BBU writes first, the read sees the write as it would
+// have one frame later
+// ----------------------------------------------------------- executeWriteRead
+static void executeWriteRead
 (
-    int       addr,
-    int       count,
-    uint16_t  *src
+    modbusBus_t     *bus,
+    modbusRequest_t *write,
+    modbusRequest_t *read
 )
 {
-    int rc;
-    const int id = getModbusContext();
+    modbusRequest_t merged = *read;
+    int             rc;
+    int             err;
 
-    if ( 0 > count || count > MODBUS_MAX_WR_WRITE_REGISTERS )
+    merged.fc         = MODBUS_FC_WRITE_AND_READ_REGISTERS;
+    merged.writeAddr  = write->addr;
+    merged.writeCount = write->count;
+    merged.writeData  = (uint16_t*)write->data;
+
+    rc  = executeRequest( bus, &merged );
+    err = errno;
+
+    // the BBU doesn't know FC23, nothing was written
+    if ( rc == -1 && err == EMBXILFUN )
     {
-        TLE ("Register Read count incorrect = %d", count );
-        ABORT_ALWAYS();
+        completeRequest( write, executeRequest( bus, write ) );
+        completeRequest( read, executeRequest( bus, read ) );
+        return;
     }
 
-    if( src == NULL )
+    errno = err;
+    completeRequest( write, ( rc == -1 ) ? -1 : 0 );
+    // the write's callback may have clobbered it
+    errno = err;
+    completeRequest( read, rc );
+}
+
+#ifndef MODBUS_TCP
+// Gives the line back to the other processes after a bus thread step,
+// unless the request to run next belongs to the same gather
+// ----------------------------------------------------------- releaseLine
+static void releaseLine
+(
+    modbusBus_t *bus,
+    uint32_t    gather
+)
+{
+    modbusRequest_t *prev;
+    modbusRequest_t *next;
+    bool            more = false;
+
+    if ( !bus->lineHeld )
     {
-        TLE ("src is null!");
-        ABORT_ALWAYS();
+        return;
     }
 
-    rc = sem_timedwait_helper(MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL);
-    if ( rc != 0 )
+    if ( gather != 0 )
     {
-        TLE ("Could not get modbus mutex, context == %d", id);
-        ABORT_ALWAYS();
+        drainRing( bus );
+        next = selectRequest( bus, &prev );
+        more = ( next != NULL && next->gather == gather );
     }
 
-#ifdef MODBUS_TCP
-    rc = modbusWriteHoldingRegisters ( ctx_arr_tcp[id], addr, count, src);
-    goto cleanup;
-#else
-    rc = modbus_set_slave( ctx_rtu, id );
-    if ( rc != 0 ) 
+    if ( !more )
     {
-      TLE ("Failed to set the ID for context %d", id );
-      goto cleanup_abort;
+        bus->lineHeld = false;
+        sem_post( bus->sem );
     }
-
-    rc = modbusWriteHoldingRegisters ( ctx_rtu, addr, count, src );
-    goto cleanup;
+}
 #endif
 
-cleanup:
-    sem_post( modbus_sem );
+// Owns bus->ctx, runs queued requests one at a time
+// ----------------------------------------------------------- busThread
+static void *busThread
+(
+    void *arg
+)
+{
+    modbusBus_t     *bus = ( modbusBus_t* )arg;
+    modbusRequest_t *batch[MODBUS_COALESCE_MAX_REQS];
+    modbusRequest_t *req;
+    modbusRequest_t *read;
+#ifndef MODBUS_TCP
+    uint32_t        gather;
+#endif
+    int             n;
+
+    while ( 1 )
+    {
+        req = dequeueRequest( bus, true );
+#ifndef MODBUS_TCP
+        gather = req->gather;   // req may be gone once completed
+#endif
+
+        if ( write_read_merging && req->fc == MODBUS_FC_WRITE_MULTIPLE_REGISTERS &&
+             ( read = takeAdjacentRead( bus, req ) ) != NULL )
+        {
+            executeWriteRead( bus, req, read );
+        }
+        else if ( read_coalescing && isRead( req->fc ) &&
+                  ( n = 1 + takeMatchingReads( bus, req, &batch[1], MODBUS_COALESCE_MAX_REQS - 1 ) ) > 1 )
+        {
+            batch[0] = req;
+            executeReads( bus, batch, n );
+        }
+        else
+        {
+            completeRequest( req, executeRequest( bus, req ) );
+        }
+
+#ifndef MODBUS_TCP
+        releaseLine( bus, gather );
+#endif
+    }
+
+    return NULL;
+}
+
+#ifdef MODBUS_TCP
+// Pipelined TCP: requests are encoded by us and written straight to the
+// connection's socket, up to tcp_window of them before the first
+// response is back. Responses are matched by MBAP transaction id, so a
+// BBU answering out of order is fine. libmodbus only connects and keeps
+// the socket, it never sees these frames
+
+// ----------------------------------------------------------- removeInflight
+static modbusRequest_t *removeInflight
+(
+    modbusBus_t *bus,
+    int         i
+)
+{
+    modbusRequest_t *req = bus->inflight[i].req;
+
+    bus->inflight[i] = bus->inflight[--bus->ninflight];
+    return req;
+}
+
+// Fails everything in flight and reconnects, a stream we lost sync with
+// or that broke can't be trusted for the responses still outstanding
+// ----------------------------------------------------------- resetPipeline
+static void resetPipeline
+(
+    modbusBus_t *bus,
+    int         err
+)
+{
+    const uint64_t nowUs = modbusMonotonicUs();
+    modbusInflight_t f;
+
+    TLE( "Resetting connection of bus %d, %d in flight, errno = %d", (int)( bus - bus_arr ), bus->ninflight, err );
+
+    while ( bus->ninflight > 0 )
+    {
+        f = bus->inflight[0];
+        removeInflight( bus, 0 );
+
+        recordTransaction( bus, f.req, -1, err, nowUs - f.sentUs, 0, true );
+        errno = err;
+        completeRequest( f.req, -1 );
+    }
+
+    bus->rxHave = 0;
+    modbus_close( bus->ctx );
+    if ( modbus_connect( bus->ctx ) == -1 )
+    {
+        // sendPipelined() tries again with the next request
+        TLE( "Reconnect failed: %s", modbus_strerror( errno ) );
+    }
+}
+
+// ----------------------------------------------------------- sendPipelined
+static void sendPipelined
+(
+    modbusBus_t     *bus,
+    modbusRequest_t *req
+)
+{
+    uint8_t          adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    modbusInflight_t *f;
+    uint64_t         nowUs;
+    int              len;
+
+    nowUs = modbusMonotonicUs();
+    modbusStatsRecord( req->fc, req->slave, MODBUS_HIST_QUEUE, nowUs - req->submitUs );
+
+    if ( req->fc == MODBUS_FC_WRITE_AND_READ_REGISTERS )
+    {
+        len = modbusPduEncodeWriteRead( adu + MODBUS_MBAP_LENGTH, sizeof( adu ) - MODBUS_MBAP_LENGTH,
+                                        req->addr, req->count, req->writeAddr, req->writeCount, req->writeData );
+    }
+    else
+    {
+        len = modbusPduEncodeRequest( adu + MODBUS_MBAP_LENGTH, sizeof( adu ) - MODBUS_MBAP_LENGTH,
+                                      req->fc, req->addr, req->count, req->data );
+    }
+    if ( len == -1 )
+    {
+        errno = EINVAL;
+        completeRequest( req, -1 );
+        return;
+    }
+
+    // admitted once the frame is built, from here on every path reports
+    // a result and a probe can't be left PROBING
+    if ( !modbusHealthAdmit( req->slave ) )
+    {
+        errno = MODBUS_EDOWN;
+        completeRequest( req, -1 );
+        return;
+    }
+
+    len = modbusTcpEncodeHeader( adu, bus->nextTid,
+                                 ( tcp_gateway_conns > 0 ) ? req->id + 1 : MODBUS_TCP_UNIT_ID, len );
+
+    if ( modbus_get_socket( bus->ctx ) == -1 && modbus_connect( bus->ctx ) == -1 )
+    {
+        const int err = errno;
+
+        recordTransaction( bus, req, -1, err, 0, 0, true );
+        errno = err;
+        completeRequest( req, -1 );
+        return;
+    }
+
+    f             = &bus->inflight[bus->ninflight++];
+    f->req        = req;
+    f->tid        = bus->nextTid++;
+    f->sentUs     = nowUs;
+    f->deadlineUs = nowUs + modbusRtoTimeoutUs( req->slave );
+
+    // blocking socket, a short write means the connection is gone
+    if ( send( modbus_get_socket( bus->ctx ), adu, len, MSG_NOSIGNAL ) != len )
+    {
+        resetPipeline( bus, ECONNRESET );
+    }
+}
+
+// ----------------------------------------------------------- completePipelined
+static void completePipelined
+(
+    modbusBus_t   *bus,
+    const uint8_t *adu,
+    int           len
+)
+{
+    const uint16_t  tid = modbusTcpTid( adu );
+    modbusRequest_t *req;
+    uint64_t        sentUs;
+    int             rc;
+    int             i;
+
+    for ( i = 0; i < bus->ninflight; i++ )
+    {
+        if ( bus->inflight[i].tid == tid )
+        {
+            break;
+        }
+    }
+
+    // the answer to a request we already timed out
+    if ( i == bus->ninflight )
+    {
+        TLV( "Dropping response with transaction id %u on bus %d", tid, (int)( bus - bus_arr ) );
+        return;
+    }
+
+    sentUs = bus->inflight[i].sentUs;
+    req    = removeInflight( bus, i );
+
+    rc = modbusPduDecodeResponse( adu + MODBUS_MBAP_LENGTH, len - MODBUS_MBAP_LENGTH,
+                                  req->fc, req->addr, req->count, req->data );
+
+    const int err = errno;
+
+    recordTransaction( bus, req, rc, err, modbusMonotonicUs() - sentUs, 0, true );
+    errno = err;
+    completeRequest( req, rc );
+}
+
+// Reads what the socket has and completes every whole response in it,
+// -1 if the connection is closed or the stream is garbage
+// ----------------------------------------------------------- receivePipelined
+static int receivePipelined
+(
+    modbusBus_t *bus
+)
+{
+    ssize_t n;
+    int     len;
+
+    n = recv( modbus_get_socket( bus->ctx ), bus->rx + bus->rxHave, sizeof( bus->rx ) - bus->rxHave, MSG_DONTWAIT );
+    if ( n == 0 )
+    {
+        return -1;
+    }
+    if ( n < 0 )
+    {
+        return ( errno == EINTR || errno == EAGAIN ) ? 0 : -1;
+    }
+    bus->rxHave += n;
+
+    while ( ( len = modbusTcpAduLength( bus->rx, bus->rxHave ) ) > 0 && len <= bus->rxHave )
+    {
+        completePipelined( bus, bus->rx, len );
+
+        bus->rxHave -= len;
+        memmove( bus->rx, bus->rx + len, bus->rxHave );
+    }
+
+    return ( len == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- expirePipelined
+static void expirePipelined
+(
+    modbusBus_t *bus
+)
+{
+    const uint64_t   nowUs = modbusMonotonicUs();
+    modbusInflight_t f;
+    int              i = 0;
+
+    while ( i < bus->ninflight )
+    {
+        if ( bus->inflight[i].deadlineUs > nowUs )
+        {
+            i++;
+            continue;
+        }
+
+        f = bus->inflight[i];
+        removeInflight( bus, i );
+
+        recordTransaction( bus, f.req, -1, ETIMEDOUT, nowUs - f.sentUs, 0, true );
+        errno = ETIMEDOUT;
+        completeRequest( f.req, -1 );
+    }
+}
+
+// Owns bus->ctx like busThread but keeps up to tcp_window requests on the
+// wire. Sleeps in poll() on the socket and wakeFd, at most until the
+// earliest deadline in flight
+// ----------------------------------------------------------- tcpPipelineThread
+static void *tcpPipelineThread
+(
+    void *arg
+)
+{
+    modbusBus_t     *bus = ( modbusBus_t* )arg;
+    modbusRequest_t *req;
+    struct pollfd   pfd[2];
+    uint64_t        deadlineUs;
+    uint64_t        nowUs;
+    bool            waitForRequests;
+    int             timeoutMs;
+    int             i;
+
+    while ( 1 )
+    {
+        while ( bus->ninflight < tcp_window && ( req = dequeueRequest( bus, false ) ) != NULL )
+        {
+            sendPipelined( bus, req );
+        }
+
+        timeoutMs = -1;
+        if ( bus->ninflight > 0 )
+        {
+            deadlineUs = bus->inflight[0].deadlineUs;
+            for ( i = 1; i < bus->ninflight; i++ )
+            {
+                if ( bus->inflight[i].deadlineUs < deadlineUs )
+                {
+                    deadlineUs = bus->inflight[i].deadlineUs;
+                }
+            }
+
+            nowUs     = modbusMonotonicUs();
+            timeoutMs = ( deadlineUs > nowUs ) ? (int)( ( deadlineUs - nowUs + 999 ) / 1000 ) : 0;
+        }
+
+        pfd[0].fd     = modbus_get_socket( bus->ctx );
+        pfd[0].events = POLLIN;
+        pfd[1].fd      = bus->wakeFd;
+        pfd[1].events  = POLLIN;
+        pfd[1].revents = 0;
+
+        // a full window only waits for responses
+        waitForRequests = ( bus->ninflight < tcp_window );
+        if ( waitForRequests && !prepareToSleep( bus ) )
+        {
+            timeoutMs = 0;
+        }
+
+        if ( poll( pfd, waitForRequests ? 2 : 1, timeoutMs ) == -1 && errno != EINTR )
+        {
+            TLE( "poll failed, errno = %d", errno );
+        }
+        __atomic_store_n( &bus->sleeping, 0, __ATOMIC_RELAXED );
+
+        if ( pfd[1].revents & POLLIN )
+        {
+            clearWakeups( bus );
+        }
+
+        if ( pfd[0].revents & ( POLLIN | POLLERR | POLLHUP ) )
+        {
+            if ( receivePipelined( bus ) == -1 )
+            {
+                resetPipeline( bus, ECONNRESET );
+            }
+        }
+
+        expirePipelined( bus );
+    }
+
+    return NULL;
+}
+#endif
+
+// ----------------------------------------------------------- startBus
+static int startBus
+(
+    modbusBus_t *bus,
+    modbus_t    *ctx
+)
+{
+    bus->ctx          = ctx;
+    bus->head         = NULL;
+    bus->tail         = NULL;
+    bus->nqueued      = 0;
+    bus->ndeadlines   = 0;
+    bus->sleeping     = 0;
+    bus->quietUntilUs = 0;
+    modbusRingInit( &bus->ring );
+
+    bus->wakeFd = eventfd( 0, EFD_CLOEXEC );
+    if ( bus->wakeFd == -1 )
+    {
+        TLE( "Failed to create wakeup eventfd, errno = %d", errno );
+        return -1;
+    }
+
+#ifdef MODBUS_TCP
+    void *( *thread )( void * ) = busThread;
+
+    bus->nextTid   = 0;
+    bus->ninflight = 0;
+    bus->rxHave    = 0;
+
+    // a gateway connection is shared by its units, always pipelined
+    if ( tcp_window > 1 || tcp_gateway_conns > 0 )
+    {
+        thread = tcpPipelineThread;
+    }
+#else
+    void *( *thread )( void * ) = busThread;
+#endif
+
+    if ( pthread_create( &bus->thread, NULL, thread, (void *)bus ) != 0 )
+    {
+        TLE( "Failed to create bus thread" );
+        return -1;
+    }
+
+    return 0;
+}
+
+// not production, used to fake a TCP "broadcast"
+// Every bus thread gets its own preallocated request from broadcast_req,
+// completion posts broadcast_done, the broadcaster waits until every bus
+// posted it (barrier). Slots are only reused once the previous broadcast
+// completed, broadcasts are serialized by modbus_sem.
+#ifdef MODBUS_TCP
+// ----------------------------------------------------------- fakeTcpBroadcastDone
+static void fakeTcpBroadcastDone
+(
+    modbusRequest_t *req,
+    void            *arg
+)
+{
+    sem_post( &broadcast_done );
+}
+
+// Caller must hold modbus_sem
+// ----------------------------------------------------------- sendFakeTcpBroadcast
+static int sendFakeTcpBroadcast
+(
+    int  fc,
+    int  addr,
+    int  count,
+    void *src
+)
+{
+    int ret    = 0;
+    int queued = 0;
+    int i;
+
+    for ( i = 0; i < num_bbus; i++ )
+    {
+        broadcast_req[i].id         = i;
+        broadcast_req[i].slave      = i;
+        broadcast_req[i].fc         = fc;
+        broadcast_req[i].addr       = addr;
+        broadcast_req[i].count      = count;
+        broadcast_req[i].data       = src;
+        broadcast_req[i].rc         = -1;
+        broadcast_req[i].cb         = fakeTcpBroadcastDone;
+        broadcast_req[i].cbArg      = NULL;
+        broadcast_req[i].gather     = 0;
+        broadcast_req[i].prio       = MODBUS_PRIO_CONTROL;
+        broadcast_req[i].deadlineUs = 0;
+        broadcast_req[i].submitUs   = modbusMonotonicUs();
+
+        if ( queueRequest( getBus( i ), &broadcast_req[i] ) == 0 )
+        {
+            queued++;
+        }
+    }
+
+    // wait for every bus to finish
+    i = 0;
+    while ( i < queued )
+    {
+        if ( sem_wait( &broadcast_done ) == 0 )
+        {
+            i++;
+        }
+    }
+
+    for ( i = 0; i < num_bbus; i++ )
+    {
+        if ( broadcast_req[i].rc == -1 )
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+#endif
+// ----------------------------------------------------------- configureModbusContext
+static int configureModbusContext
+(
+    modbus_t *ctx,
+    int      baud
+)
+{
+  // for TCP, executeRequest() sets the response timeout per request
+  // from the slave's RTT estimate, see modbus_rto.c
+#ifndef MODBUS_TCP
+    uint32_t byteTimeoutUs;
+    uint32_t timeoutUs;
+
+    // libmodbus knows the termios constants of the standard rates only
+    if ( !modbusSerialIsStandardBaud( baud ) &&
+         modbusSerialSetCustomBaud( modbus_get_socket( ctx ), baud ) != 0 )
+    {
+        TLE( "Failed to set baud rate = %d", baud );
+        return -1;
+    }
+
+    // a gap of t1.5 already breaks a frame on the wire, our reads see
+    // the bytes in UART FIFO sized chunks though
+    byteTimeoutUs = rtuT15Us( baud ) + MODBUS_RTU_OS_SLACK_US;
+    if ( modbus_set_byte_timeout( ctx, byteTimeoutUs / 1000000, byteTimeoutUs % 1000000 ) != 0 )
+    {
+        TLE( "Failed to set byte timeout = %u us", byteTimeoutUs );
+        return -1;
+    }
+
+    // until the first request, executeRequest() sets it per request
+    timeoutUs = rtuFirstByteUs( baud, -1, 0 ) + MODBUS_RTO_DEFAULT_CEIL_US;
+    if ( modbus_set_response_timeout( ctx, timeoutUs / 1000000, timeoutUs % 1000000 ) != 0 )
+    {
+        TLE( "Failed to set response timeout = %u us", timeoutUs );
+        return -1;
+    }
+
+    TLV( "RTU at %d baud, t1.5 = %u us, t3.5 = %u us, byte timeout = %u us, initial response timeout = %u us",
+        baud, rtuT15Us( baud ), rtuT35Us( baud ), byteTimeoutUs, timeoutUs );
+
+  // and set MODBUS_RTU_RS485, we need to see if
+  // the hardware has a RS482 <-> RS232 or what,
+  // TBD
+#endif
+  return 0;
+}
+
+// ----------------------------------------------------------- modbusInit
+static int modbusInit
+(
+    const char *ip,
+    const int  bbu_2_count,
+    const char *stty,
+    const int  baud
+)
+{
+    int rc;
+
+    if ( 0 > bbu_2_count || bbu_2_count > maxBbuCount() )
+    {
+      TLE( "bbu_2_count set wrong = %d", bbu_2_count );
+      return -1;
+    }
+
+    num_bbus  = bbu_2_count;
+    baud_rate = baud;
+
+    // duty cycles are relative to this
+    modbusStatsGet();
+
+#ifdef MODBUS_TCP
+    if ( ip == NULL )
+    {
+       TLE( "IP set wrong!" );
+       return -1;
+    }
+    TLV( "Setting up TCP MODBUS with ip = %s, bbu_2_count = %d", ip, bbu_2_count);
+
+    modbus_t *tmp_ctx;
+    int i;
+    int port;
+
+    if ( sem_init( &broadcast_done, 0, 0 ) != 0 )
+    {
+        TLE( "Failed to init broadcast barrier, errno = %d", errno );
+        return -1;
+    }
+
+    // behind a gateway all BBUs share its port, see getBus()
+    num_buses = bbu_2_count;
+    if ( tcp_gateway_conns > 0 && tcp_gateway_conns < bbu_2_count )
+    {
+        num_buses = tcp_gateway_conns;
+    }
+
+    for ( i = 0; i < num_buses ; i++ )
+    {
+        port    = ( tcp_gateway_conns > 0 ) ? MODBUS_TCP_PORT : MODBUS_TCP_PORT + i;
+        tmp_ctx = modbus_new_tcp( ip, port );
+        if ( tmp_ctx == NULL )
+        {
+            TLE( "Unable to create the libmodbus context, error = %s, errno = %d, context = %d",
+              modbus_strerror( errno ), errno, cbbumId );
+            return -1;
+        }
+
+        if ( modbus_connect( tmp_ctx ) == -1 )
+        {
+              TLE( "Connection failed: %s, ERRNO = %d, PORT = %d", modbus_strerror( errno ), errno, port );
+              modbus_free( tmp_ctx );
+              return -1;
+        }
+
+
+        rc = configureModbusContext( tmp_ctx, baud );
+        if ( rc != 0 )
+        {
+            TLE( "Failed to set the properties of the modbus driver!" );
+            return -1;
+        }
+
+        ctx_arr_tcp[i] = tmp_ctx;
+
+        rc = startBus( &bus_arr[i], tmp_ctx );
+        if ( rc != 0 )
+        {
+            TLE( "Failed to start the bus thread, PORT = %d", port );
+            return -1;
+        }
+    }
+#else
+    modbus_t *tmp_ctx;
+    int i;
+
+    if ( stty == NULL )
+    {
+        TLE( "STTY == NULL!" );
+        ABORT_ALWAYS();
+    }
+
+    // bus 0, the ports of modbusAddRtuBus() follow
+    rtu_conf[0].stty = (char *)stty;
+    rtu_conf[0].baud = baud;
+    rtu_conf[0].sem  = modbus_sem;
+
+    for ( i = 0; i < num_buses; i++ )
+    {
+        if ( MODBUS_RTU_MIN_BAUD > rtu_conf[i].baud || rtu_conf[i].baud > MODBUS_RTU_MAX_BAUD )
+        {
+            TLE( "Baud rate not supported = %d! ", rtu_conf[i].baud );
+            ABORT_ALWAYS();
+        }
+
+        tmp_ctx = modbus_new_rtu( rtu_conf[i].stty, rtu_conf[i].baud, 'N', 8, 1 );
+        if ( tmp_ctx == NULL )
+        {
+            TLE( "Unable to create the libmodbus context, error = %s, errno = %d, context = %d",
+                modbus_strerror( errno ), errno, cbbumId );
+            return -1;
+        }
+
+        if ( modbus_connect( tmp_ctx ) == -1 )
+        {
+            TLE( "Connection failed: %s, ERRNO = %d, STTY = %s", modbus_strerror( errno ), errno, rtu_conf[i].stty );
+            modbus_free( tmp_ctx );
+            return -1;
+        }
+
+        rc = configureModbusContext( tmp_ctx, rtu_conf[i].baud );
+        if ( rc != 0 )
+        {
+            TLE( "Failed to set the properties of the modbus driver!" );
+            modbus_close( tmp_ctx );
+            modbus_free( tmp_ctx );
+            return -1;
+        }
+
+        ctx_rtu[i]       = tmp_ctx;
+        bus_arr[i].baud  = rtu_conf[i].baud;
+        bus_arr[i].sem   = rtu_conf[i].sem;
+
+        rc = startBus( &bus_arr[i], tmp_ctx );
+        if ( rc != 0 )
+        {
+            TLE( "Failed to start the bus thread, STTY = %s", rtu_conf[i].stty );
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusWriteHoldingRegisters
+static int modbusWriteHoldingRegisters
+(
+    modbus_t  *ctx,
+    int       addr,
+    int       count,
+    uint16_t  *src
+)
+{
+    if( ctx == NULL )
+    {
+        TLE( "cxt == NULL! \n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_write_registers( ctx, addr, count, src );
+    if ( rc == -1 ) {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON WRITE, ERRNO HUMAN = %s ERRONO = %d, SLAVE = %d",
+            modbus_strerror( errno ), errno, modbus_get_slave( ctx ) );
+        errno = err;
+        return -1;
+    }
+
+    return ( 0 );
+}
+
+// ----------------------------------------------------------- modbusReadHoldingRegisters
+static int modbusReadHoldingRegisters
+(
+    modbus_t *ctx,
+    int addr,
+    int count,
+    uint16_t *val
+)
+{
+    if( ctx == NULL )
+    {
+        TLE ( "cxt == NULL!\n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_read_registers( ctx, addr, count, val );
+    if ( rc == -1 )
+    {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON READ %s, errno = %d", modbus_strerror(errno), errno );
+        errno = err;
+        return -1;
+    }
+
+    return( rc );
+}
+
+// ----------------------------------------------------------- modbusReadInputRegisters
+static int modbusReadInputRegisters
+(
+    modbus_t *ctx,
+    int      addr,
+    int      count,
+    uint16_t *dest
+)
+{
+    if( ctx == NULL )
+    {
+        TLE ( "cxt == NULL!\n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_read_input_registers( ctx, addr, count, dest );
+    if ( rc == -1 )
+    {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON READ INPUT REGISTERS %s, errno = %d", modbus_strerror(errno), errno );
+        errno = err;
+        return -1;
+    }
+
+    return( rc );
+}
+
+// ----------------------------------------------------------- modbusReadBits
+static int modbusReadBits
+(
+    modbus_t *ctx,
+    int       addr,
+    int       count,
+    uint8_t   *dest
+)
+{
+    if( ctx == NULL )
+    {
+        TLE ( "cxt == NULL!\n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_read_bits( ctx, addr, count, dest );
+    if ( rc == -1 )
+    {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON READ BITS %s, errno = %d", modbus_strerror(errno), errno );
+        errno = err;
+        return -1;
+    }
+
+    return( rc );
+}
+
+// ----------------------------------------------------------- modbusReadInputBits
+static int modbusReadInputBits
+(
+    modbus_t *ctx,
+    int       addr,
+    int       count,
+    uint8_t   *dest
+)
+{
+    if( ctx == NULL )
+    {
+        TLE ( "cxt == NULL!\n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_read_input_bits( ctx, addr, count, dest );
+    if ( rc == -1 )
+    {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON READ INPUT BITS %s, errno = %d", modbus_strerror(errno), errno );
+        errno = err;
+        return -1;
+    }
+
+    return( rc );
+}
+
+// ----------------------------------------------------------- modbusWriteBits
+static int modbusWriteBits
+(
+    modbus_t *ctx,
+    int       addr,
+    int       count,
+    uint8_t   *src
+)
+{
+    if( ctx == NULL )
+    {
+        TLE ( "cxt == NULL!\n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_write_bits( ctx, addr, count, src );
+    if ( rc == -1 )
+    {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON WRITE BITS %s, errno = %d", modbus_strerror(errno), errno );
+        errno = err;
+        return -1;
+    }
+
+    return( rc );
+}
+
+// ----------------------------------------------------------- modbusWriteAndReadRegisters
+static int modbusWriteAndReadRegisters
+(
+    modbus_t  *ctx,
+    int       writeAddr,
+    int       writeCount,
+    uint16_t  *src,
+    int       readAddr,
+    int       readCount,
+    uint16_t  *dest
+)
+{
+    if( ctx == NULL )
+    {
+        TLE ( "cxt == NULL!\n" );
+        ABORT_ALWAYS();
+    }
+
+    int rc = modbus_write_and_read_registers( ctx, writeAddr, writeCount, src, readAddr, readCount, dest );
+    if ( rc == -1 )
+    {
+        const int err = errno;
+        TLE ( "MODBUS ERROR ON WRITE AND READ %s, errno = %d, SLAVE = %d",
+            modbus_strerror( errno ), errno, modbus_get_slave( ctx ) );
+        errno = err;
+        return -1;
+    }
+
+    return( rc );
+}
+
+
+
+// ----------------------------------------------------------- submitRequest
+static int submitRequest
+(
+    modbusRequest_t  *req,
+    int              id,
+    int              fc,
+    int              addr,
+    int              count,
+    void             *data,
+    modbusCallback_t cb,
+    void             *cbArg
+)
+{
+    modbusBus_t *bus;
+
+    if ( req == NULL || data == NULL )
+    {
+        TLE( "req or data is null!" );
+        return -1;
+    }
+
+    bus = getBus( id );
+    if ( bus == NULL )
+    {
+        return -1;
+    }
+
+    return submitToBus( bus, req, id, fc, addr, count, data, cb, cbArg );
+}
+
+// ----------------------------------------------------------- prepareRequest
+static int prepareRequest
+(
+    modbusRequest_t  *req,
+    int              id,
+    int              fc,
+    int              addr,
+    int              count,
+    void             *data,
+    modbusCallback_t cb,
+    void             *cbArg
+)
+{
+    req->id         = id;
+    req->slave      = id;
+    req->fc         = fc;
+    req->addr       = addr;
+    req->count      = count;
+    req->data       = data;
+    req->rc         = -1;
+    req->cb         = cb;
+    req->cbArg      = cbArg;
+    req->gather     = 0;
+    req->prio       = ( thread_prio != MODBUS_PRIO_DEFAULT ) ? thread_prio :
+                      ( isRead( fc ) ? MODBUS_PRIO_NORMAL : MODBUS_PRIO_CONTROL );
+    req->submitUs   = modbusMonotonicUs();
+    req->deadlineUs = ( thread_deadline_us != 0 ) ? req->submitUs + thread_deadline_us : 0;
+
+    if ( cb == NULL && sem_init( &req->done, 0, 0 ) != 0 )
+    {
+        TLE( "Failed to init request semaphore, errno = %d", errno );
+        return -1;
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------- submitToBus
+static int submitToBus
+(
+    modbusBus_t      *bus,
+    modbusRequest_t  *req,
+    int              id,
+    int              fc,
+    int              addr,
+    int              count,
+    void             *data,
+    modbusCallback_t cb,
+    void             *cbArg
+)
+{
+    if ( prepareRequest( req, id, fc, addr, count, data, cb, cbArg ) != 0 )
+    {
+        return -1;
+    }
+
+    if ( queueRequest( bus, req ) != 0 )
+    {
+        if ( cb == NULL )
+        {
+            sem_destroy( &req->done );
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+// -1 if fc isn't a read
+// -------------------------------------------------------------- maxReadCount
+static int maxReadCount
+(
+    int fc
+)
+{
+    switch ( fc )
+    {
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return MODBUS_MAX_READ_REGISTERS;
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return MODBUS_MAX_READ_BITS;
+        default:
+            return -1;
+    }
+}
+
+// -------------------------------------------------------------- modbusSubmitRead
+int modbusSubmitRead
+(
+    modbusRequest_t  *req,
+    int              id,
+    int              fc,
+    int              addr,
+    int              count,
+    void             *dest,
+    modbusCallback_t cb,
+    void             *cbArg
+)
+{
+    const int max = maxReadCount( fc );
+
+    if ( max == -1 )
+    {
+        TLE( "Not a read function code = %d", fc );
+        return -1;
+    }
+
+#ifndef MODBUS_TCP
+    if ( id == MODBUS_BROADCAST_ID_RTU )
+    {
+        TLE( "Can't read from the broadcast id" );
+        return -1;
+    }
+#endif
+
+    if ( 0 > count || count > max )
+    {
+        TLE( "Read count incorrect = %d, fc = %d", count, fc );
+        return -1;
+    }
+
+    return submitRequest( req, id, fc, addr, count, dest, cb, cbArg );
+}
+
+// -------------------------------------------------------------- modbusSubmitWrite
+int modbusSubmitWrite
+(
+    modbusRequest_t  *req,
+    int              id,
+    int              fc,
+    int              addr,
+    int              count,
+    void             *src,
+    modbusCallback_t cb,
+    void             *cbArg
+)
+{
+    int max;
+
+    switch ( fc )
+    {
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            max = MODBUS_MAX_WRITE_REGISTERS;
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            max = MODBUS_MAX_WRITE_BITS;
+            break;
+        default:
+            TLE( "Not a write function code = %d", fc );
+            return -1;
+    }
+
+    if ( 0 > count || count > max )
+    {
+        TLE( "Write count incorrect = %d, fc = %d", count, fc );
+        return -1;
+    }
+
+#ifndef MODBUS_TCP
+    if ( id == MODBUS_BROADCAST_ID_RTU && num_buses > 1 )
+    {
+        TLE( "A broadcast spans %d buses, use the broadcast adaptors", num_buses );
+        return -1;
+    }
+#endif
+
+    return submitRequest( req, id, fc, addr, count, src, cb, cbArg );
+}
+
+// -------------------------------------------------------------- modbusSubmitWriteAndRead
+int modbusSubmitWriteAndRead
+(
+    modbusRequest_t  *req,
+    int              id,
+    int              writeAddr,
+    int              writeCount,
+    uint16_t         *src,
+    int              readAddr,
+    int              readCount,
+    uint16_t         *dest,
+    modbusCallback_t cb,
+    void             *cbArg
+)
+{
+    if ( 1 > writeCount || writeCount > MODBUS_MAX_WR_WRITE_REGISTERS ||
+         1 > readCount || readCount > MODBUS_MAX_WR_READ_REGISTERS )
+    {
+        TLE( "Write and read count incorrect = %d/%d", writeCount, readCount );
+        return -1;
+    }
+
+    if ( src == NULL )
+    {
+        TLE( "src is null!" );
+        return -1;
+    }
+
+#ifndef MODBUS_TCP
+    if ( id == MODBUS_BROADCAST_ID_RTU )
+    {
+        TLE( "Can't read from the broadcast id" );
+        return -1;
+    }
+#endif
+
+    // submitRequest() leaves these alone
+    req->writeAddr  = writeAddr;
+    req->writeCount = writeCount;
+    req->writeData  = src;
+
+    return submitRequest( req, id, MODBUS_FC_WRITE_AND_READ_REGISTERS, readAddr, readCount, dest, cb, cbArg );
+}
+
+// Only valid for requests submitted without a callback
+// -------------------------------------------------------------- modbusWaitRequest
+int modbusWaitRequest
+(
+    modbusRequest_t *req
+)
+{
+    while ( sem_wait( &req->done ) != 0 )
+    {
+        if ( errno != EINTR )
+        {
+            TLE( "Failed to wait for request, errno = %d", errno );
+            ABORT_ALWAYS();
+        }
+    }
+
+    sem_destroy( &req->done );
+    if ( req->rc == -1 )
+    {
+        errno = req->err;
+    }
+    return req->rc;
+}
+
+#ifndef MODBUS_TCP
+// A broadcast goes out on every line at once, done once all sent it
+// -------------------------------------------------------------- rtuBroadcast
+static int rtuBroadcast
+(
+    int  fc,
+    int  addr,
+    int  count,
+    void *src
+)
+{
+    modbusRequest_t reqs[MODBUS_MAX_BUSES];
+    int             ret = 0;
+    int             n;
+    int             i;
+
+    for ( n = 0; n < num_buses; n++ )
+    {
+        if ( submitToBus( &bus_arr[n], &reqs[n], MODBUS_BROADCAST_ID_RTU, fc, addr, count, src, NULL, NULL ) != 0 )
+        {
+            TLE( "Failed to submit broadcast to bus %d", n );
+            ret = -1;
+            break;
+        }
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( modbusWaitRequest( &reqs[i] ) == -1 )
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+#endif
+
+// Blocking round trip used by the adaptors below
+// -------------------------------------------------------------- modbusTransact
+static int modbusTransact
+(
+    int  id,
+    int  fc,
+    int  addr,
+    int  count,
+    void *data
+)
+{
+    modbusRequest_t req;
+
+    if ( isRead( fc ) && modbusCacheRead( id, fc, addr, count, data ) == count )
+    {
+        return count;
+    }
+
+    if ( submitRequest( &req, id, fc, addr, count, data, NULL, NULL ) != 0 )
+    {
+        TLE( "Failed to submit request, id = %d, fc = %d", id, fc );
+        return -1;
+    }
+
+    return modbusWaitRequest( &req );
+}
+
+// -------------------------------------------------------------- modbusDeviceId
+int modbusDeviceId
+(
+    int bbu
+)
+{
+    if ( 0 > bbu || bbu >= num_bbus )
+    {
+        TLE( "No BBU %d, num_bbus = %d", bbu, num_bbus );
+        return -1;
+    }
+
+#ifdef MODBUS_TCP
+    return bbu;
+#else
+    // same as setModbusContext, 0 is broadcast
+    return bbu + 1;
+#endif
+}
+
+// -------------------------------------------------------------- modbusDeviceReadHoldingRegisters
+int modbusDeviceReadHoldingRegisters
+(
+    int      dev,
+    int      addr,
+    int      count,
+    uint16_t *dest
+)
+{
+    if ( 0 > count || count > MODBUS_MAX_WR_READ_REGISTERS )
+    {
+        TLE ( "Register Read count incorrect = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( dest == NULL )
+    {
+        TLE ( "dest is null!" );
+        ABORT_ALWAYS();
+    }
+
+    // a read sees the combined writes made before it
+    if ( modbusWcFlushOverlap( dev, addr, count ) != 0 )
+    {
+        TLE( "Failed to flush combined writes, dev = %d", dev );
+        return -1;
+    }
+
+    return modbusTransact( dev, MODBUS_FC_READ_HOLDING_REGISTERS, addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusReadHoldingRegistersAdaptor
+int modbusReadHoldingRegistersAdaptor
+(
+    int      addr,
+    int      count,
+    uint16_t *dest
+)
+{
+    return modbusDeviceReadHoldingRegisters( getModbusContext(), addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusDeviceReadInputRegisters
+int modbusDeviceReadInputRegisters
+(
+    int      dev,
+    int      addr,
+    int      count,
+    uint16_t *dest
+)
+{
+    if ( 0 > count || count > MODBUS_MAX_READ_REGISTERS )
+    {
+        TLE ( "Input register read count incorrect = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( dest == NULL )
+    {
+        TLE ( "dest is null!" );
+        ABORT_ALWAYS();
+    }
+
+    return modbusTransact( dev, MODBUS_FC_READ_INPUT_REGISTERS, addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusReadInputRegistersAdaptor
+int modbusReadInputRegistersAdaptor
+(
+    int      addr,
+    int      count,
+    uint16_t *dest
+)
+{
+    return modbusDeviceReadInputRegisters( getModbusContext(), addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusGatherRead
+int modbusGatherRead
+(
+    const int *devs,
+    int       ndevs,
+    int       fc,
+    int       addr,
+    int       count,
+    void      *dest,
+    int       *status
+)
+{
+    modbusRequest_t reqs[MODBUS_GATHER_MAX_DEVS];
+    modbusRequest_t *first[MODBUS_MAX_BUSES] = { NULL };
+    modbusRequest_t *last[MODBUS_MAX_BUSES];
+    static uint32_t next_gather = 0;
+    const int       max  = maxReadCount( fc );
+    const int       unit = ( fc == MODBUS_FC_READ_COILS || fc == MODBUS_FC_READ_DISCRETE_INPUTS ) ?
+                           sizeof( uint8_t ) : sizeof( uint16_t );
+    bool            queued[MODBUS_GATHER_MAX_DEVS];
+    modbusRequest_t *r;
+    modbusBus_t     *bus;
+    uint32_t        gather;
+    uint8_t         *row;
+    int             ok = 0;
+    int             b;
+    int             i;
+
+    if ( max == -1 || 0 >= count || count > max || 0 > ndevs || ndevs > MODBUS_GATHER_MAX_DEVS ||
+         devs == NULL || dest == NULL || status == NULL )
+    {
+        TLE( "Bad gather, fc = %d, count = %d, ndevs = %d", fc, count, ndevs );
+        return -1;
+    }
+
+    // shared by the requests of this call, never 0
+    do
+    {
+        gather = __atomic_add_fetch( &next_gather, 1, __ATOMIC_RELAXED );
+    } while ( gather == 0 );
+
+    for ( i = 0; i < ndevs; i++ )
+    {
+        row       = (uint8_t*)dest + (size_t)i * count * unit;
+        queued[i] = false;
+
+        if ( modbusCacheRead( devs[i], fc, addr, count, row ) == count )
+        {
+            status[i] = 0;
+            continue;
+        }
+
+        bus = getBus( devs[i] );
+#ifndef MODBUS_TCP
+        if ( devs[i] == MODBUS_BROADCAST_ID_RTU )
+        {
+            bus = NULL;
+        }
+#endif
+        if ( bus == NULL || prepareRequest( &reqs[i], devs[i], fc, addr, count, row, NULL, NULL ) != 0 )
+        {
+            status[i] = EINVAL;
+            continue;
+        }
+
+        // chained per bus, queued below in one piece
+        reqs[i].gather = gather;
+        b = (int)( bus - bus_arr );
+        if ( first[b] == NULL )
+        {
+            first[b] = &reqs[i];
+        }
+        else
+        {
+            last[b]->next = &reqs[i];
+        }
+        last[b]   = &reqs[i];
+        queued[i] = true;
+    }
+
+    for ( b = 0; b < MODBUS_MAX_BUSES; b++ )
+    {
+        if ( first[b] != NULL && queueRequests( &bus_arr[b], first[b], last[b] ) != 0 )
+        {
+            // the bus is backed up, none of its BBUs is read
+            for ( r = first[b]; r != NULL; r = r->next )
+            {
+                sem_destroy( &r->done );
+                queued[r - reqs] = false;
+                status[r - reqs] = EAGAIN;
+            }
+        }
+    }
+
+    for ( i = 0; i < ndevs; i++ )
+    {
+        if ( queued[i] )
+        {
+            status[i] = ( modbusWaitRequest( &reqs[i] ) == -1 ) ? errno : 0;
+        }
+
+        if ( status[i] == 0 )
+        {
+            ok++;
+        }
+    }
+
+    return ok;
+}
+
+// -------------------------------------------------------------- modbusBroadCastHoldingRegistersAdaptor
+int modbusBroadCastHoldingRegistersAdaptor
+(
+    int       addr,
+    int       count,
+    uint16_t  *src
+)
+{
+    int rc;
+    int ret = 0;
+
+    if ( 0 > count || count > MODBUS_MAX_WR_READ_REGISTERS )
+    {
+        TLE (" Broadcast holding register write has incorrect write count = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( src == NULL )
+    {
+        TLE ( "src is null!" );
+        ABORT_ALWAYS();
+    }
+
+#ifdef MODBUS_TCP
+    //          ***IMPORTANT***
+    // TCP IS A ONE-TO-ONE PROTOCOL
+    // IT DOES NOT SUPPORT BROADCAST, THIS IS A
+    // POOR HACK TO ALLOW SOME TESTING, ONLY
+    // RTU/UDP SUPPORTS BROADCAST, WHEN A CLIENT
+    // BROADCASTS IT DOES NOT EXPECT A RESPONSE,
+    // HOWEVER WE NEED TO SIT AND WAIT FOR A
+    // RESPONSE SINCE WE ARE USING TCP, TO BETTER
+    // SERIALIZE THIS PROCESS WE WILL SEND THE
+    // BROADCAST FROM EVERY BUS THREAD
+    //
+    // For simplicity, this function does not do advanced
+    // (or in cases, any) error recovery - it's only
+    // run during simulations
+    rc = sem_timedwait_helper( MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL );
+    if( rc != 0 )
+    {
+        TLE ("Failed to get mutext to broadcast in modbusBroadCastHoldingRegistersAdaptor");
+        errno = EBUSY;
+        return -1;
+    }
+
+    ret = sendFakeTcpBroadcast( MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, count, src );
+
+    sem_post( modbus_sem );
+#else
+    // the bus threads take their line's semaphore
+    rc  = rtuBroadcast( MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, count, src );
+    ret = ( rc == -1 ) ? -1 : 0;
+#endif
+    return ret;
+}
+
+// -------------------------------------------------------------- modbusBroadCastBitsAdaptor
+int modbusBroadCastBitsAdaptor
+(
+    int       addr,
+    int       count,
+    uint8_t  *src
+)
+{
+    int rc;
+    int ret = 0;
+
+    if ( 0 > count || count > MODBUS_MAX_WRITE_BITS )
+    {
+        TLE (" Broadcast bits write has incorrect write count = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( src == NULL )
+    {
+        TLE ( "src is null!" );
+        ABORT_ALWAYS();
+    }
+
+#ifdef MODBUS_TCP
+    // See modbusBroadCastHoldingRegistersAdaptor, TCP has no broadcast
+    rc = sem_timedwait_helper( MAX_MODBUS_TIMEOUT, modbus_sem, TRY_TO_RECOVER_ON_FAIL );
+    if( rc != 0 )
+    {
+        TLE ("Failed to get mutext to broadcast in modbusBroadCastBitsAdaptor");
+        errno = EBUSY;
+        return -1;
+    }
+
+    ret = sendFakeTcpBroadcast( MODBUS_FC_WRITE_MULTIPLE_COILS, addr, count, src );
+
+    sem_post( modbus_sem );
+#else
+    // the bus threads take their line's semaphore
+    rc  = rtuBroadcast( MODBUS_FC_WRITE_MULTIPLE_COILS, addr, count, src );
+    ret = ( rc == -1 ) ? -1 : 0;
+#endif
+    return ret;
+}
+
+// Write coil (rw)
+// -------------------------------------------------------------- modbusDeviceWriteBits
+int modbusDeviceWriteBits
+(
+    int dev,
+    int addr,
+    int count,
+    uint8_t *src
+)
+{
+    if ( 0 > count || count > MODBUS_MAX_WRITE_BITS )
+    {
+        TLE ("write coil bit count incorrect = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( src == NULL )
+    {
+        TLE ("src is null!");
+        ABORT_ALWAYS();
+    }
+
+    return modbusTransact( dev, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, count, src );
+}
+
+// -------------------------------------------------------------- modbusWriteBitsAdaptor
+int modbusWriteBitsAdaptor
+(
+    int addr,
+    int count,
+    uint8_t *src
+)
+{
+    return modbusDeviceWriteBits( getModbusContext(), addr, count, src );
+}
+
+// Read input-bit (ro)
+// -------------------------------------------------------------- modbusDeviceReadInputBits
+int modbusDeviceReadInputBits
+(
+    int dev,
+    int addr,
+    int count,
+    uint8_t *dest
+)
+{
+    if ( 0 > count || count > MODBUS_MAX_READ_BITS )
+    {
+        TLE ("Read input-bit count incorrect = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( dest == NULL )
+    {
+        TLE ("dest is null!");
+        ABORT_ALWAYS();
+    }
+
+    return modbusTransact( dev, MODBUS_FC_READ_DISCRETE_INPUTS, addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusReadInputBitsAdaptor
+int modbusReadInputBitsAdaptor
+(
+    int addr,
+    int count,
+    uint8_t *dest
+)
+{
+    return modbusDeviceReadInputBits( getModbusContext(), addr, count, dest );
+}
+
+// Read coil (rw)
+// -------------------------------------------------------------- modbusDeviceReadBits
+int modbusDeviceReadBits
+(
+    int       dev,
+    int       addr,
+    int       count,
+    uint8_t   *dest
+)
+{
+    if ( 0 > count || count > MODBUS_MAX_READ_BITS )
+    {
+        TLE ("Read coil bit count incorrect = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( dest == NULL )
+    {
+        TLE ("dest is null!");
+        ABORT_ALWAYS();
+    }
+
+    return modbusTransact( dev, MODBUS_FC_READ_COILS, addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusReadBitsAdaptor
+int modbusReadBitsAdaptor
+(
+    int       addr,
+    int       count,
+    uint8_t   *dest
+)
+{
+    return modbusDeviceReadBits( getModbusContext(), addr, count, dest );
+}
+
+// -------------------------------------------------------------- modbusDeviceWriteHoldingRegisters
+int modbusDeviceWriteHoldingRegisters
+(
+    int       dev,
+    int       addr,
+    int       count,
+    uint16_t  *src
+)
+{
+    int       rc;
+
+    if ( 0 > count || count > MODBUS_MAX_WR_WRITE_REGISTERS )
+    {
+        TLE ("Register Read count incorrect = %d", count );
+        ABORT_ALWAYS();
+    }
+
+    if( src == NULL )
+    {
+        TLE ("src is null!");
+        ABORT_ALWAYS();
+    }
+
+    if ( modbusWcWrite( dev, addr, count, src, &rc ) )
+    {
+        return rc;
+    }
+
+    // older combined changes under this write must not land after it
+    if ( modbusWcFlushOverlap( dev, addr, count ) != 0 )
+    {
+        TLE( "Failed to flush combined writes, dev = %d", dev );
+        return -1;
+    }
+
+    rc = modbusTransact( dev, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, count, src );
+    modbusWcWritten( dev, addr, count, src, rc != -1 );
+
+    return rc;
+}
+
+// -------------------------------------------------------------- modbusWriteHoldingRegistersAdaptor
+int modbusWriteHoldingRegistersAdaptor
+(
+    int       addr,
+    int       count,
+    uint16_t  *src
+)
+{
+    return modbusDeviceWriteHoldingRegisters( getModbusContext(), addr, count, src );
+}
+
+// -------------------------------------------------------------- modbusDeviceWriteAndReadRegisters
+int modbusDeviceWriteAndReadRegisters
+(
+    int       dev,
+    int       writeAddr,
+    int       writeCount,
+    uint16_t  *src,
+    int       readAddr,
+    int       readCount,
+    uint16_t  *dest
+)
+{
+    modbusRequest_t req;
+    int             rc;
+
+    if ( 0 >= writeCount || writeCount > MODBUS_MAX_WR_WRITE_REGISTERS )
+    {
+        TLE ("Register Write count incorrect = %d", writeCount );
+        ABORT_ALWAYS();
+    }
+
+    if ( 0 >= readCount || readCount > MODBUS_MAX_WR_READ_REGISTERS )
+    {
+        TLE ("Register Read count incorrect = %d", readCount );
+        ABORT_ALWAYS();
+    }
+
+    if( src == NULL || dest == NULL )
+    {
+        TLE ("src or dest is null!");
+        ABORT_ALWAYS();
+    }
+
+    // combined writes still pending were made first, they go first
+    if ( modbusWcFlush( dev ) != 0 )
+    {
+        TLE( "Failed to flush combined writes, dev = %d", dev );
+        return -1;
+    }
+
+    if ( modbusSubmitWriteAndRead( &req, dev, writeAddr, writeCount, src, readAddr, readCount, dest, NULL, NULL ) != 0 )
+    {
+        TLE( "Failed to submit write and read, dev = %d", dev );
+        return -1;
+    }
+
+    rc = modbusWaitRequest( &req );
+
+    // written behind the combiner's back, what it last sent may be stale
+    modbusWcInvalidate( dev );
+
     return rc;
+}
+
+// -------------------------------------------------------------- modbusWriteAndReadRegistersAdaptor
+int modbusWriteAndReadRegistersAdaptor
+(
+    int       writeAddr,
+    int       writeCount,
+    uint16_t  *src,
+    int       readAddr,
+    int       readCount,
+    uint16_t  *dest
+)
+{
+    return modbusDeviceWriteAndReadRegisters( getModbusContext(), writeAddr, writeCount, src,
+                                              readAddr, readCount, dest );
+}
+
+// Reads of the same BBU and function code waiting on a bus are merged,
+// on by default
+// -------------------------------------------------------------- modbusSetReadCoalescing
+void modbusSetReadCoalescing
+(
+    bool enable
+)
+{
+    read_coalescing = enable;
+}
+
+// -------------------------------------------------------------- modbusSetThreadPriority
+int modbusSetThreadPriority
+(
+    int prio
+)
+{
+    if ( prio != MODBUS_PRIO_DEFAULT && ( MODBUS_PRIO_CONTROL > prio || prio > MODBUS_PRIO_BACKGROUND ) )
+    {
+        TLE( "Bad priority = %d", prio );
+        errno = EINVAL;
+        return -1;
+    }
+
+    thread_prio = prio;
+    return 0;
+}
+
+// -------------------------------------------------------------- modbusSetThreadDeadline
+void modbusSetThreadDeadline
+(
+    uint32_t timeoutUs
+)
+{
+    thread_deadline_us = timeoutUs;
+}
+
+// A register write followed in the queue by a holding register read of
+// the same BBU go out as one FC23, off by default. Pipelined TCP
+// connections don't wait for the write anyway and never merge
+// -------------------------------------------------------------- modbusSetWriteReadMerging
+void modbusSetWriteReadMerging
+(
+    bool enable
+)
+{
+    write_read_merging = enable;
+}
+
+// -------------------------------------------------------------- modbusSetTcpWindow
+int modbusSetTcpWindow
+(
+    int window
+)
+{
+#ifdef MODBUS_TCP
+    if ( 1 > window || window > MODBUS_TCP_MAX_WINDOW || bus_arr[0].ctx != NULL )
+    {
+        TLE( "Can't set TCP window = %d, max = %d, only before modbusSystemInit", window, MODBUS_TCP_MAX_WINDOW );
+        errno = EINVAL;
+        return -1;
+    }
+
+    tcp_window = window;
+    return 0;
+#else
+    TLE( "Pipelining is TCP only" );
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// -------------------------------------------------------------- modbusAddRtuBus
+int modbusAddRtuBus
+(
+    const char *stty,
+    int        baud,
+    sem_t      *sem,
+    int        firstBbu,
+    int        count
+)
+{
 #ifndef MODBUS_TCP
-cleanup_abort:
-    sem_post ( modbus_sem );
-    ABORT_ALWAYS ();
+    int slave;
+
+    if ( stty == NULL || bus_arr[0].ctx != NULL || num_buses == MODBUS_MAX_BUSES ||
+         0 > firstBbu || 0 >= count || firstBbu + count > MAX_BBUM2_COUNT )
+    {
+        TLE( "Can't add RTU bus %s for BBUs %d..%d, %d buses, only before modbusSystemInit",
+            stty ? stty : "(null)", firstBbu, firstBbu + count - 1, num_buses );
+        errno = EINVAL;
+        return -1;
+    }
+
+    // slave ids are BBU + 1, see setModbusContext
+    for ( slave = firstBbu + 1; slave <= firstBbu + count; slave++ )
+    {
+        if ( rtu_route[slave] != 0 )
+        {
+            TLE( "BBU %d is already on bus %d", slave - 1, rtu_route[slave] );
+            errno = EEXIST;
+            return -1;
+        }
+    }
+
+    rtu_conf[num_buses].stty = strdup( stty );
+    rtu_conf[num_buses].baud = ( baud == 0 ) ? MODBUS_RTU_DEFAULT_BAUD : baud;
+    rtu_conf[num_buses].sem  = sem;
+
+    for ( slave = firstBbu + 1; slave <= firstBbu + count; slave++ )
+    {
+        rtu_route[slave] = (uint8_t)num_buses;
+    }
+
+    TLV( "RTU bus %d on %s at %d baud, BBUs %d..%d", num_buses, stty, rtu_conf[num_buses].baud,
+        firstBbu, firstBbu + count - 1 );
+
+    return num_buses++;
+#else
+    TLE( "Serial buses are RTU only" );
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// -------------------------------------------------------------- modbusSetTcpGateway
+int modbusSetTcpGateway
+(
+    int connections
+)
+{
+#ifdef MODBUS_TCP
+    if ( 1 > connections || connections > MODBUS_MAX_BUSES || bus_arr[0].ctx != NULL )
+    {
+        TLE( "Can't set gateway connections = %d, max = %d, only before modbusSystemInit",
+            connections, MODBUS_MAX_BUSES );
+        errno = EINVAL;
+        return -1;
+    }
+
+    tcp_gateway_conns = connections;
+    return 0;
+#else
+    TLE( "Gateways are TCP only" );
+    errno = ENOTSUP;
     return -1;
 #endif
 }
 
+// -------------------------------------------------------------- modbusMonotonicUs
+uint64_t modbusMonotonicUs
+(
+)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Buses are numbered 0..n-1, requests to BBUs on different buses can
+// be on the wire at the same time
+// -------------------------------------------------------------- modbusGetBusId
+int modbusGetBusId
+(
+    int id
+)
+{
+    modbusBus_t *bus = getBus( id );
+
+    if ( bus == NULL )
+    {
+        return -1;
+    }
+
+    return (int)( bus - bus_arr );
+}
+
+// The line of modbusSystemInit, see modbusAddRtuBus for the others
+// -------------------------------------------------------------- modbusGetBaudRate
+int modbusGetBaudRate
+(
+)
+{
+    return baud_rate;
+}
+
+// Size of the RTU ADUs (slave id + PDU + CRC) of a request/response pair
+// -------------------------------------------------------------- modbusFrameBytes
+static int modbusFrameBytes
+(
+    int fc,
+    int count,
+    int *reqBytes,
+    int *rspBytes
+)
+{
+    switch ( fc )
+    {
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            *reqBytes = 8;
+            *rspBytes = 5 + 2 * count;
+            break;
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            *reqBytes = 8;
+            *rspBytes = 5 + ( count + 7 ) / 8;
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            *reqBytes = 9 + 2 * count;
+            *rspBytes = 8;
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            *reqBytes = 9 + ( count + 7 ) / 8;
+            *rspBytes = 8;
+            break;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            // count is the read, the caller adds 2 bytes per register written
+            *reqBytes = 13;
+            *rspBytes = 5 + 2 * count;
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+// Estimated bus time of one transaction, used for scheduling.
+// RTU: both frames on the wire, the t3.5 gaps and the slave turnaround,
+// TCP: a nominal round trip, the link is not the bottleneck
+// -------------------------------------------------------------- modbusTransactionTimeUs
+uint32_t modbusTransactionTimeUs
+(
+    int id,
+    int fc,
+    int count
+)
+{
+    int reqBytes;
+    int rspBytes;
+
+    if ( modbusFrameBytes( fc, count, &reqBytes, &rspBytes ) != 0 )
+    {
+        TLE( "Unknown function code = %d", fc );
+        return 0;
+    }
+
+#ifdef MODBUS_TCP
+    return MODBUS_TCP_NOMINAL_RTT_US;
+#else
+    const modbusBus_t *bus  = getBus( id );
+    const int         baud = ( bus != NULL && bus->baud != 0 ) ? bus->baud : baud_rate;
+
+    if ( id == MODBUS_BROADCAST_ID_RTU )
+    {
+        // nobody answers, the line stays quiet for the turnaround instead
+        return reqBytes * rtuCharUs( baud ) + rtuT35Us( baud ) + MODBUS_RTU_TURNAROUND_US;
+    }
+
+    return ( reqBytes + rspBytes ) * rtuCharUs( baud ) + 2 * rtuT35Us( baud ) + MODBUS_RTU_TURNAROUND_US;
+#endif
+}
+
 void setModbusContext
 (
     int    id
 )
 {
     TLV( "Set modbus context to %d", id);
-    if ( 0 > id || id > MAX_BBUM2_COUNT )
+    if ( 0 > id || id > maxBbuCount() )
     {
         ABORT_ALWAYS();
     }
@@ -845,7 +3073,8 @@ int modbusSystemInit
     sem_t *sem,
     const int bbu2Count,
     uint32_t ip,
-    char *stty
+    char *stty,
+    const int baud
 )
 {
     static int init = - 1;
@@ -878,7 +3107,7 @@ int modbusSystemInit
     }
 #endif
 
-    if ( 0 > bbu2Count || bbu2Count > MAX_BBUM2_COUNT )
+    if ( 0 > bbu2Count || bbu2Count > maxBbuCount() )
     {
         TLE ( "bbu2Count set wrong" );
         ABORT_ALWAYS();
@@ -895,6 +3124,6 @@ int modbusSystemInit
 #ifdef MODBUS_TCP
     return modbusInit( ip_str, bbu2Count, NULL, 0 );
 #else
-    return modbusInit( NULL, bbu2Count, stty , 9600 );
+    return modbusInit( NULL, bbu2Count, stty , ( baud == 0 ) ? MODBUS_RTU_DEFAULT_BAUD : baud );
 #endif
 }
@@ -12,31 +12,83 @@
 #include <modbus.h>
 #include <semaphore.h>
 #include <stdbool.h>
+#include <errno.h>
 
 
 //#define MODBUS_TCP 
 #define MODBUS_BROADCAST_ID_RTU ( 0 )
 #define MAX_BBUM2_COUNT ( 12 ) //TODO: don't hardcode
 #define MODBUS_TCP_PORT (1501)
+#define MODBUS_MAX_BUSES ( MAX_BBUM2_COUNT ) // TCP has one per BBU, RTU one per port
+#define MODBUS_MAX_SLAVE_ID ( 247 )             // RTU, per slave state is sized for it
 
 // ------------------------------------------------------------------ Includes
 // ------------------------------------------------------------------ Definitions
 #define MAX_IP4_LEN ( 16 ) //need 1 extra for null
 #define MAX_MODBUS_TIMEOUT (1)
-#define BROADCAST_BITS (0)
-#define BROADCAST_HOLDING_REGISTER (1)
+#define MODBUS_RTU_BITS_PER_CHAR  ( 10 )     // 8N1 + start bit
+#define MODBUS_RTU_TURNAROUND_US  ( 5000 )   // time a BBU takes to answer, tbd
+#define MODBUS_RTU_DEFAULT_BAUD   ( 9600 )
+#define MODBUS_RTU_MIN_BAUD       ( 1200 )
+#define MODBUS_RTU_MAX_BAUD       ( 921600 )
+#define MODBUS_RTU_FIXED_GAP_BAUD ( 19200 )  // above this t1.5/t3.5 are fixed, see below
+#define MODBUS_RTU_T15_FIXED_US   ( 750 )
+#define MODBUS_RTU_T35_FIXED_US   ( 1750 )
+#define MODBUS_RTU_OS_SLACK_US    ( 2000 )   // UART FIFO + scheduling latency on our side
+#define MODBUS_TCP_NOMINAL_RTT_US ( 1000 )
+#define MODBUS_TCP_ADU_OVERHEAD   ( 4 )      // MBAP (7) vs. slave id + CRC (3)
+#define MODBUS_TCP_MAX_WINDOW     ( 32 )     // requests in flight per connection
+#define MODBUS_TCP_MAX_UNITS      ( MODBUS_MAX_SLAVE_ID ) // BBUs behind a gateway
+#define MODBUS_GATHER_MAX_DEVS    ( MODBUS_MAX_SLAVE_ID ) // per modbusGatherRead
+
+// Request classes, see modbusSetThreadPriority
+#define MODBUS_PRIO_DEFAULT       ( -1 )     // writes control, reads normal
+#define MODBUS_PRIO_CONTROL       ( 0 )      // setpoints, next frame boundary
+#define MODBUS_PRIO_NORMAL        ( 1 )
+#define MODBUS_PRIO_BACKGROUND    ( 2 )      // bulk scans
+#define MODBUS_PRIO_AGING_US      ( 500000 ) // waiting this long is one class up
+
+// errno of a request dropped unsent because it couldn't make its
+// deadline, see modbusSetThreadDeadline
+#define MODBUS_EDEADLINE          ( ETIME )
+// errno of a request failed fast because its slave is down, see
+// modbus_health.h. A gateway's own EMBXGPATH/EMBXGTAR stay as they are
+#define MODBUS_EDOWN              ( EHOSTDOWN )
 // ------------------------------------------------------------------ Type Definitions
-typedef struct{
-    modbus_t  *ctx;
-    int       addr;
-    int       count;
-    void      *src;
-    int       workeType;
-} modbusWriteHoldingArg_t;
+typedef struct modbusRequest modbusRequest_t;
+
+// Called from the bus thread once a request completed, must not block
+typedef void ( *modbusCallback_t )( modbusRequest_t *req, void *arg );
+
+// Owned by the caller and must stay valid until completion
+struct modbusRequest{
+    int              id;       // BBU id, same numbering as getModbusContext()
+    int              fc;       // MODBUS_FC_*
+    int              addr;
+    int              count;
+    void             *data;    // dest for reads, src for writes
+    int              rc;       // result, valid once completed
+    int              err;      // errno if rc is -1
+    modbusCallback_t cb;       // may be NULL, then use modbusWaitRequest
+    void             *cbArg;
+    int              writeAddr;  // FC23 only, the write half. The above is the read
+    int              writeCount;
+    uint16_t         *writeData;
+
+    // set by the adaptor
+    int              slave;
+    uint32_t         gather;   // != 0: part of a modbusGatherRead, see releaseLine
+    int              prio;     // MODBUS_PRIO_*
+    uint64_t         deadlineUs; // modbusMonotonicUs(), 0: none
+    uint64_t         submitUs;
+    sem_t            done;
+    modbusRequest_t  *next;
+};
 
 // ------------------------------------------------------------------ Function Prototypes
 
-int      modbusSystemInit( sem_t * sem, const int bbu2Count, uint32_t ip, char *stty );
+// baud is RTU only, 0 selects MODBUS_RTU_DEFAULT_BAUD
+int      modbusSystemInit( sem_t * sem, const int bbu2Count, uint32_t ip, char *stty, const int baud );
 void     setModbusContext( int id );
 int      getModbusContext( );
 
@@ -50,7 +102,92 @@ int modbusReadBitsAdaptor             ( int addr, int count, uint8_t *dest  );
 int modbusWriteBitsAdaptor            ( int addr, int count, uint8_t *src   );
 int modbusReadInputBitsAdaptor        ( int addr, int count, uint8_t *dest  );
 
+// FC23, writes then reads holding registers in one round trip. Returns
+// readCount or -1, the BBU may not implement it (errno EMBXILFUN)
+int modbusWriteAndReadRegistersAdaptor( int writeAddr, int writeCount, uint16_t *src,
+                                        int readAddr, int readCount, uint16_t *dest );
+
+// Same as the adaptors above, for an explicit BBU instead of the process
+// wide context. Safe from any number of threads, BBUs on different buses
+// are served in parallel. dev is from modbusDeviceId(), -1 if bbu (as
+// passed to setModbusContext) doesn't exist
+int modbusDeviceId                   ( int bbu );
+int modbusDeviceWriteHoldingRegisters( int dev, int addr, int count, uint16_t *src  );
+int modbusDeviceReadHoldingRegisters ( int dev, int addr, int count, uint16_t *dest );
+int modbusDeviceReadInputRegisters   ( int dev, int addr, int count, uint16_t *dest );
+int modbusDeviceReadBits             ( int dev, int addr, int count, uint8_t *dest  );
+int modbusDeviceWriteBits            ( int dev, int addr, int count, uint8_t *src   );
+int modbusDeviceReadInputBits        ( int dev, int addr, int count, uint8_t *dest  );
+int modbusDeviceWriteAndReadRegisters( int dev, int writeAddr, int writeCount, uint16_t *src,
+                                       int readAddr, int readCount, uint16_t *dest );
+
+// Reads the same block from every dev in devs (from modbusDeviceId) into
+// dest, laid out as [ndevs][count] of uint16_t (registers) or uint8_t
+// (bits). status[i] is 0 or the errno of dev i, a failed BBU leaves its
+// row undefined and the others intact. TCP connections are read in
+// parallel, an RTU line goes through its BBUs back to back under one
+// acquisition of its semaphore. Returns the number of BBUs read, -1 on
+// bad arguments
+int modbusGatherRead( const int *devs, int ndevs, int fc, int addr, int count, void *dest, int *status );
+
 // Broadcast Adaptor
 int modbusBroadCastHoldingRegistersAdaptor ( int addr, int count, uint16_t *src);
 int modbusBroadCastBitsAdaptor             ( int addr, int count, uint8_t *src );
 
+// Asynchronous requests, queued to the thread owning the BBU's bus.
+// The adaptors above are blocking wrappers around these. Queueing is
+// lock free and bounded (MODBUS_RING_SIZE per bus), a backed up bus
+// fails the submit with errno EAGAIN instead of blocking
+int modbusSubmitRead ( modbusRequest_t *req, int id, int fc, int addr, int count, void *dest,
+                       modbusCallback_t cb, void *cbArg );
+int modbusSubmitWrite( modbusRequest_t *req, int id, int fc, int addr, int count, void *src,
+                       modbusCallback_t cb, void *cbArg );
+int modbusSubmitWriteAndRead( modbusRequest_t *req, int id, int writeAddr, int writeCount, uint16_t *src,
+                              int readAddr, int readCount, uint16_t *dest, modbusCallback_t cb, void *cbArg );
+int modbusWaitRequest( modbusRequest_t *req );
+void modbusSetReadCoalescing( bool enable );
+
+// Class of the requests the calling thread submits from now on, adaptors
+// included. A bus runs the best class first, waiting ages a request one
+// class up per MODBUS_PRIO_AGING_US. A request never passes an earlier
+// queued write to the same BBU. MODBUS_PRIO_DEFAULT restores the default
+int  modbusSetThreadPriority( int prio );
+
+// Requests the calling thread submits from now on, adaptors included,
+// must complete within timeoutUs, 0 (default) for no deadline. One that
+// can't make it any more by modbusTransactionTimeUs() is dropped from
+// the queue unsent with errno MODBUS_EDEADLINE. Dropped and late
+// requests are counted per slave, see modbusStatsBlock_t
+void modbusSetThreadDeadline( uint32_t timeoutUs );
+
+// Queued FC16 + FC03 of one BBU become a single FC23, only for BBUs that
+// implement it. Off by default
+void modbusSetWriteReadMerging( bool enable );
+
+// TCP only, before modbusSystemInit. A window > 1 keeps that many requests
+// in flight per connection, matched to their responses by MBAP
+// transaction id, so the BBU must read requests while still answering
+// earlier ones. Default is 1, libmodbus' one request at a time
+int  modbusSetTcpWindow( int window );
+
+// RTU only, before modbusSystemInit. BBUs [firstBbu, firstBbu + count),
+// numbered as for setModbusContext, are on their own serial port with
+// its own bus thread, the stty of modbusSystemInit keeps the rest.
+// Broadcasts go out on every port. sem guards the port against other
+// processes, may be NULL. baud 0 selects MODBUS_RTU_DEFAULT_BAUD.
+// Returns the bus id, see modbusGetBusId
+int  modbusAddRtuBus( const char *stty, int baud, sem_t *sem, int firstBbu, int count );
+
+// TCP only, before modbusSystemInit. Reach every BBU through a gateway on
+// MODBUS_TCP_PORT over that many connections instead of a port per BBU.
+// BBU id i is MBAP unit id i + 1 on connection i % connections, up to
+// MODBUS_TCP_MAX_UNITS BBUs. With a window > 1 requests of different
+// units interleave on a connection
+int  modbusSetTcpGateway( int connections );
+
+// Bus topology / timing
+uint64_t modbusMonotonicUs( );
+int      modbusGetBusId( int id );
+int      modbusGetBaudRate( );
+uint32_t modbusTransactionTimeUs( int id, int fc, int count );
+
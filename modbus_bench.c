@@ -0,0 +1,625 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Throughput/latency benchmark of the adaptor layer against the
+ * simulator (server.c). Build once per transport, see compile.sh. Every
+ * case (adaptor x count x threads) prints one JSON line:
+ *
+ *   {"transport":"rtu","gateway":0,"window":1,"op":"read_holding","count":16,"threads":4,"bbus":1,"lines":1,
+ *    "tx":..., "errors":..., "seconds":..., "tx_per_s":...,
+ *    "p50_us":..., "p99_us":..., "p999_us":..., "max_us":...,
+ *    "cpu_us_per_tx":...}
+ *
+ * CPU is this process only (callers + bus threads), not the simulator.
+ * Cases go through the device API, all threads of a case talk to BBU 0
+ * unless -u spreads them over the BBUs. Broadcasts address every BBU
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "modbus_adaptor.h"
+#include "modbus_stats.h"
+
+// ------------------------------------------------------------------ Definitions
+#define BENCH_MAX_LIST        ( 16 )
+#define BENCH_MAX_THREADS     ( 64 )
+#define BENCH_DEFAULT_SECONDS ( 5 )
+#define BENCH_SIM_WAIT_MS     ( 3000 )
+#define BENCH_MAX_LINES       ( MODBUS_MAX_BUSES )
+
+#ifdef MODBUS_TCP
+#define BENCH_TRANSPORT "tcp"
+#else
+#define BENCH_TRANSPORT "rtu"
+#endif
+
+// ------------------------------------------------------------------ Type Definitions
+typedef int ( *benchOp_t )( int dev, int count, uint16_t *regs, uint8_t *bits );
+
+typedef struct{
+    const char *name;
+    benchOp_t  op;
+    int        maxCount;
+} benchCase_t;
+
+typedef struct{
+    const benchCase_t *bc;
+    int               dev;
+    int               count;
+    uint64_t          stopUs;
+    uint64_t          tx;
+    uint64_t          errors;
+    modbusHist_t      hist;
+} benchThread_t;
+
+// ------------------------------------------------------------------ Static Variables
+static sem_t bench_sem;
+static int   bench_window = 1;   // TCP requests in flight per connection
+static int   bench_gateway = 0;  // TCP connections to a gateway, 0: a port per BBU
+static int   bench_devices = 1;  // BBUs the threads are spread over
+static int   bench_lines = 1;    // RTU serial lines the BBUs are split over
+
+// ------------------------------------------------------------------ Implementation
+
+// ----------------------------------------------------------- opReadHolding
+static int opReadHolding
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    return ( modbusDeviceReadHoldingRegisters( dev, 0, count, regs ) == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- opWriteHolding
+static int opWriteHolding
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    regs[0]++;
+    return ( modbusDeviceWriteHoldingRegisters( dev, 0, count, regs ) == -1 ) ? -1 : 0;
+}
+
+// Control loop step, the read back lands in the buffer just written
+// ----------------------------------------------------------- opWriteReadHolding
+static int opWriteReadHolding
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    regs[0]++;
+    return ( modbusDeviceWriteAndReadRegisters( dev, 0, count, regs, 0, count, regs ) == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- opReadBits
+static int opReadBits
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    return ( modbusDeviceReadBits( dev, 0, count, bits ) == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- opWriteBits
+static int opWriteBits
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    bits[0] ^= 1;
+    return ( modbusDeviceWriteBits( dev, 0, count, bits ) == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- opReadInputBits
+static int opReadInputBits
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    return ( modbusDeviceReadInputBits( dev, 0, count, bits ) == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- opBroadcastHolding
+static int opBroadcastHolding
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    regs[0]++;
+    return ( modbusBroadCastHoldingRegistersAdaptor( 0, count, regs ) == -1 ) ? -1 : 0;
+}
+
+// ----------------------------------------------------------- opBroadcastBits
+static int opBroadcastBits
+(
+    int      dev,
+    int      count,
+    uint16_t *regs,
+    uint8_t  *bits
+)
+{
+    bits[0] ^= 1;
+    return ( modbusBroadCastBitsAdaptor( 0, count, bits ) == -1 ) ? -1 : 0;
+}
+
+static const benchCase_t bench_cases[] = {
+    { "read_holding",       opReadHolding,      MODBUS_MAX_READ_REGISTERS     },
+    { "write_holding",      opWriteHolding,     MODBUS_MAX_WRITE_REGISTERS    },
+    { "write_read_holding", opWriteReadHolding, MODBUS_MAX_WR_WRITE_REGISTERS },
+    { "read_bits",          opReadBits,         MODBUS_MAX_READ_BITS          },
+    { "write_bits",         opWriteBits,        MODBUS_MAX_WRITE_BITS         },
+    { "read_input_bits",    opReadInputBits,    MODBUS_MAX_READ_BITS          },
+    { "broadcast_holding",  opBroadcastHolding, MODBUS_MAX_WRITE_REGISTERS    },
+    { "broadcast_bits",     opBroadcastBits,    MODBUS_MAX_WRITE_BITS         },
+};
+
+// ----------------------------------------------------------- usage
+static void usage
+(
+    const char *prog
+)
+{
+    fprintf( stderr,
+        "usage: %s [options]\n"
+        "  -S path        simulator binary (default ./server)\n"
+        "  -x             use a simulator that is already running\n"
+#ifdef MODBUS_TCP
+        "  -a ip          simulator address (default 127.0.0.1)\n"
+        "  -w window      requests in flight per connection (default 1)\n"
+        "  -g conns       BBUs by unit id over conns connections to one port\n"
+#else
+        "  -s tty         simulator tty (default: start one on a pty linked here)\n"
+        "  -B baud        line rate (default 9600), the simulator emulates it\n"
+        "  -b lines       split the BBUs over that many lines, tty.1.. for the extra ones\n"
+#endif
+        "  -n bbus        BBUs in the simulator (default %d)\n"
+        "  -c list        register/bit counts, e.g. 1,16,64,125 (default)\n"
+        "  -T list        thread counts, e.g. 1,4,12 (default 1,4)\n"
+        "  -o list        comma separated adaptors to run (default all), names as in the output\n"
+        "  -d seconds     per case (default %d)\n"
+        "  -C             disable read coalescing\n"
+        "  -u             thread i drives BBU i %% bbus (default all BBU 0)\n",
+        prog, MAX_BBUM2_COUNT, BENCH_DEFAULT_SECONDS );
+    exit( 1 );
+}
+
+// ----------------------------------------------------------- parseList
+static int parseList
+(
+    const char *arg,
+    int        *list
+)
+{
+    char *copy = strdup( arg );
+    char *save = NULL;
+    char *tok;
+    int  n = 0;
+
+    for ( tok = strtok_r( copy, ",", &save ); tok != NULL && n < BENCH_MAX_LIST; tok = strtok_r( NULL, ",", &save ) )
+    {
+        list[n++] = atoi( tok );
+    }
+
+    free( copy );
+    return n;
+}
+
+// True if name is one of the comma separated names in ops, NULL selects all
+// ----------------------------------------------------------- selected
+static bool selected
+(
+    const char *ops,
+    const char *name
+)
+{
+    char *copy;
+    char *save = NULL;
+    char *tok;
+    bool found = false;
+
+    if ( ops == NULL )
+    {
+        return true;
+    }
+
+    copy = strdup( ops );
+    for ( tok = strtok_r( copy, ",", &save ); tok != NULL && !found; tok = strtok_r( NULL, ",", &save ) )
+    {
+        found = ( strcmp( tok, name ) == 0 );
+    }
+
+    free( copy );
+    return found;
+}
+
+// ----------------------------------------------------------- cpuUs
+static uint64_t cpuUs
+(
+)
+{
+    struct rusage ru;
+
+    getrusage( RUSAGE_SELF, &ru );
+    return (uint64_t)( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// ----------------------------------------------------------- benchThread
+static void *benchThread
+(
+    void *arg
+)
+{
+    benchThread_t *t = (benchThread_t *)arg;
+    uint16_t      regs[MODBUS_MAX_READ_REGISTERS];
+    uint8_t       bits[MODBUS_MAX_READ_BITS];
+    uint64_t      start;
+    uint64_t      end;
+
+    memset( regs, 0, sizeof( regs ) );
+    memset( bits, 0, sizeof( bits ) );
+
+    do
+    {
+        start = modbusMonotonicUs();
+        if ( t->bc->op( t->dev, t->count, regs, bits ) != 0 )
+        {
+            t->errors++;
+        }
+        end = modbusMonotonicUs();
+
+        modbusHistAdd( &t->hist, end - start );
+        t->tx++;
+    } while ( end < t->stopUs );
+
+    return NULL;
+}
+
+// ----------------------------------------------------------- runCase
+static void runCase
+(
+    const benchCase_t *bc,
+    int               count,
+    int               threads,
+    int               seconds
+)
+{
+    static benchThread_t t[BENCH_MAX_THREADS];
+    pthread_t            tid[BENCH_MAX_THREADS];
+    modbusHist_t         *all = calloc( 1, sizeof( modbusHist_t ) );
+    uint64_t             tx = 0;
+    uint64_t             errors = 0;
+    uint64_t             startUs;
+    uint64_t             elapsedUs;
+    uint64_t             cpu;
+    int                  i;
+    int                  j;
+
+    memset( t, 0, sizeof( t ) );
+
+    cpu     = cpuUs();
+    startUs = modbusMonotonicUs();
+    for ( i = 0; i < threads; i++ )
+    {
+        t[i].bc     = bc;
+        t[i].dev    = modbusDeviceId( i % bench_devices );
+        t[i].count  = count;
+        t[i].stopUs = startUs + (uint64_t)seconds * 1000000;
+        pthread_create( &tid[i], NULL, benchThread, &t[i] );
+    }
+
+    for ( i = 0; i < threads; i++ )
+    {
+        pthread_join( tid[i], NULL );
+
+        tx     += t[i].tx;
+        errors += t[i].errors;
+        all->count += t[i].hist.count;
+        all->sumUs += t[i].hist.sumUs;
+        all->maxUs  = ( t[i].hist.maxUs > all->maxUs ) ? t[i].hist.maxUs : all->maxUs;
+        for ( j = 0; j < MODBUS_HIST_BUCKETS; j++ )
+        {
+            all->buckets[j] += t[i].hist.buckets[j];
+        }
+    }
+    elapsedUs = modbusMonotonicUs() - startUs;
+    cpu       = cpuUs() - cpu;
+
+    printf( "{\"transport\":\"%s\",\"gateway\":%d,\"window\":%d,\"op\":\"%s\",\"count\":%d,\"threads\":%d,\"bbus\":%d,\"lines\":%d,"
+            "\"tx\":%llu,\"errors\":%llu,\"seconds\":%.3f,\"tx_per_s\":%.1f,"
+            "\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,"
+            "\"cpu_us_per_tx\":%.1f}\n",
+            BENCH_TRANSPORT, bench_gateway, bench_window, bc->name, count, threads,
+            ( threads < bench_devices ) ? threads : bench_devices, bench_lines,
+            (unsigned long long)tx, (unsigned long long)errors, elapsedUs / 1e6, tx * 1e6 / elapsedUs,
+            (unsigned long long)modbusHistPercentileUs( all, 0.5 ),
+            (unsigned long long)modbusHistPercentileUs( all, 0.99 ),
+            (unsigned long long)modbusHistPercentileUs( all, 0.999 ),
+            (unsigned long long)all->maxUs,
+            tx ? (double)cpu / tx : 0.0 );
+    fflush( stdout );
+
+    free( all );
+}
+
+// Runs the simulator in the background and waits until it's reachable
+// ----------------------------------------------------------- startSimulator
+static pid_t startSimulator
+(
+    const char *path,
+    int        bbus,
+    int        first,
+    const char *link,
+    int        baud
+)
+{
+    char  nbuf[16];
+    char  fbuf[16];
+    char  bbuf[16];
+    pid_t pid;
+    int   waited;
+
+    snprintf( nbuf, sizeof( nbuf ), "%d", bbus );
+    snprintf( fbuf, sizeof( fbuf ), "%d", first );
+    snprintf( bbuf, sizeof( bbuf ), "%d", baud );
+
+    pid = fork();
+    if ( pid == 0 )
+    {
+        // simulator chatter must not end up in the results
+        if ( freopen( "/dev/null", "w", stdout ) == NULL )
+        {
+            _exit( 1 );
+        }
+#ifdef MODBUS_TCP
+        if ( bench_gateway > 0 )
+        {
+            execl( path, path, "-t", "-e", "-n", nbuf, (char *)NULL );
+        }
+        else
+        {
+            execl( path, path, "-t", "-n", nbuf, (char *)NULL );
+        }
+#else
+        execl( path, path, "-n", nbuf, "-f", fbuf, "-L", link, "-B", bbuf, (char *)NULL );
+#endif
+        fprintf( stderr, "Failed to start %s: %s\n", path, strerror( errno ) );
+        _exit( 1 );
+    }
+
+    // TCP listeners are up as soon as the process runs, give it the same
+    for ( waited = 0; waited < BENCH_SIM_WAIT_MS; waited += 10 )
+    {
+        if ( waitpid( pid, NULL, WNOHANG ) == pid )
+        {
+            return -1;
+        }
+#ifndef MODBUS_TCP
+        struct stat st;
+
+        if ( lstat( link, &st ) == 0 )
+        {
+            break;
+        }
+#else
+        if ( waited >= 200 )
+        {
+            break;
+        }
+#endif
+        usleep( 10000 );
+    }
+
+    return pid;
+}
+
+// ----------------------------------------------------------- stopSimulators
+static void stopSimulators
+(
+    const pid_t *pid,
+    int         n
+)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( pid[i] != -1 )
+        {
+            kill( pid[i], SIGTERM );
+            waitpid( pid[i], NULL, 0 );
+        }
+    }
+}
+
+// ----------------------------------------------------------- main
+int main
+(
+    int  argc,
+    char **argv
+)
+{
+    const char *sim      = "./server";
+    const char *ip       = "127.0.0.1";
+    const char *ops      = NULL;
+    char       stty[BENCH_MAX_LINES][64];
+    int        counts[BENCH_MAX_LIST] = { 1, 16, 64, 125 };
+    int        threads[BENCH_MAX_LIST] = { 1, 4 };
+    int        ncounts   = 4;
+    int        nthreads  = 2;
+    int        bbus      = MAX_BBUM2_COUNT;
+    int        seconds   = BENCH_DEFAULT_SECONDS;
+    int        baud      = MODBUS_RTU_DEFAULT_BAUD;
+    bool       external  = false;
+    bool       coalesce  = true;
+    bool       spread    = false;
+    pid_t      pid[BENCH_MAX_LINES];
+    int        first;
+    int        n;
+    unsigned   c;
+    int        opt;
+    int        i;
+    int        j;
+
+    snprintf( stty[0], sizeof( stty[0] ), "/tmp/modbus_bench_tty.%d", (int)getpid() );
+
+    while ( ( opt = getopt( argc, argv, "S:xa:w:g:s:B:b:n:c:T:o:d:Cu" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 'S': sim      = optarg;                         break;
+            case 'x': external = true;                           break;
+            case 'a': ip       = optarg;                         break;
+            case 'w': bench_window = atoi( optarg );             break;
+            case 'g': bench_gateway = atoi( optarg );            break;
+            case 's':
+                if ( snprintf( stty[0], sizeof( stty[0] ), "%s", optarg ) >= (int)sizeof( stty[0] ) )
+                {
+                    usage( argv[0] );
+                }
+                external = true;
+                break;
+            case 'B': baud     = atoi( optarg );                 break;
+            case 'b': bench_lines = atoi( optarg );              break;
+            case 'n': bbus     = atoi( optarg );                 break;
+            case 'c': ncounts  = parseList( optarg, counts );    break;
+            case 'T': nthreads = parseList( optarg, threads );   break;
+            case 'o': ops      = optarg;                         break;
+            case 'd': seconds  = atoi( optarg );                 break;
+            case 'C': coalesce = false;                          break;
+            case 'u': spread   = true;                           break;
+            default:
+                usage( argv[0] );
+        }
+    }
+
+    if ( 0 >= bbus || bbus > ( bench_gateway ? MODBUS_TCP_MAX_UNITS : MAX_BBUM2_COUNT ) || 0 >= seconds ||
+         0 >= bench_lines || bench_lines > BENCH_MAX_LINES || bench_lines > bbus )
+    {
+        usage( argv[0] );
+    }
+
+    for ( i = 0; i < nthreads; i++ )
+    {
+        if ( 0 >= threads[i] || threads[i] > BENCH_MAX_THREADS )
+        {
+            usage( argv[0] );
+        }
+    }
+
+#ifdef MODBUS_TCP
+    if ( modbusSetTcpWindow( bench_window ) != 0 ||
+         ( bench_gateway > 0 && modbusSetTcpGateway( bench_gateway ) != 0 ) )
+    {
+        usage( argv[0] );
+    }
+#else
+    // line l has BBUs [l * bbus / lines, ( l + 1 ) * bbus / lines)
+    for ( i = 1; i < bench_lines; i++ )
+    {
+        // a cut off suffix would open some other tty
+        if ( snprintf( stty[i], sizeof( stty[i] ), "%s.%d", stty[0], i ) >= (int)sizeof( stty[i] ) )
+        {
+            usage( argv[0] );
+        }
+        first = i * bbus / bench_lines;
+        if ( modbusAddRtuBus( stty[i], baud, NULL, first, ( i + 1 ) * bbus / bench_lines - first ) == -1 )
+        {
+            usage( argv[0] );
+        }
+    }
+#endif
+
+    signal( SIGPIPE, SIG_IGN );
+
+    for ( i = 0; i < bench_lines; i++ )
+    {
+        pid[i] = -1;
+        if ( external )
+        {
+            continue;
+        }
+
+        first  = i * bbus / bench_lines;
+        n      = ( i + 1 ) * bbus / bench_lines - first;
+        pid[i] = startSimulator( sim, n, first + 1, stty[i], baud );
+        if ( pid[i] == -1 )
+        {
+            fprintf( stderr, "Simulator %s did not come up\n", sim );
+            stopSimulators( pid, i );
+            return 1;
+        }
+    }
+
+    sem_init( &bench_sem, 0, 1 );
+    if ( modbusSystemInit( &bench_sem, bbus, inet_addr( ip ), stty[0], baud ) != 0 )
+    {
+        fprintf( stderr, "modbusSystemInit failed\n" );
+        stopSimulators( pid, bench_lines );
+        return 1;
+    }
+
+    modbusSetReadCoalescing( coalesce );
+    bench_devices = spread ? bbus : 1;
+    setModbusContext( 0 );
+
+    for ( c = 0; c < sizeof( bench_cases ) / sizeof( bench_cases[0] ); c++ )
+    {
+        if ( !selected( ops, bench_cases[c].name ) )
+        {
+            continue;
+        }
+
+        for ( i = 0; i < ncounts; i++ )
+        {
+            if ( 0 >= counts[i] || counts[i] > bench_cases[c].maxCount )
+            {
+                continue;
+            }
+
+            for ( j = 0; j < nthreads; j++ )
+            {
+                runCase( &bench_cases[c], counts[i], threads[j], seconds );
+            }
+        }
+    }
+
+    stopSimulators( pid, bench_lines );
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_cache.h"
+
+// --------------------------------------------------------- Type Definitions
+typedef struct{
+    int                id;
+    int                fc;        // read function code
+    int                addr;
+    int                count;
+    int                unit;      // bytes per register/bit in data
+    uint64_t           ttlUs;
+    uint8_t            *data;
+    uint64_t           *stampUs;  // per register/bit, 0 == never read
+    modbusCacheStats_t stats;
+} cacheRange_t;
+
+// --------------------------------------------------------- Static Variables
+static cacheRange_t    ranges[MODBUS_CACHE_MAX_RANGES];
+static int             num_ranges = 0;     // ranges are never removed, written under cache_lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ----------------------------------------------------------- Implementation
+
+// Writes land in the image read by the matching read function code
+// ----------------------------------------------------------- cachedFc
+static int cachedFc
+(
+    int fc
+)
+{
+    switch ( fc )
+    {
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return MODBUS_FC_READ_HOLDING_REGISTERS;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            return MODBUS_FC_READ_COILS;
+        default:
+            return fc;
+    }
+}
+
+// Overlap of [addr, addr + count) with r, false if none
+// ----------------------------------------------------------- overlap
+static bool overlap
+(
+    const cacheRange_t *r,
+    int                addr,
+    int                count,
+    int                *from,
+    int                *to
+)
+{
+    *from = ( addr > r->addr ) ? addr : r->addr;
+    *to   = ( addr + count < r->addr + r->count ) ? addr + count : r->addr + r->count;
+
+    return *from < *to;
+}
+
+// ----------------------------------------------------------- modbusCacheAddRange
+int modbusCacheAddRange
+(
+    int      id,
+    int      fc,
+    int      addr,
+    int      count,
+    uint32_t ttlMs
+)
+{
+    cacheRange_t *r;
+    int          handle;
+
+    if ( fc != MODBUS_FC_READ_HOLDING_REGISTERS && fc != MODBUS_FC_READ_INPUT_REGISTERS &&
+         fc != MODBUS_FC_READ_COILS && fc != MODBUS_FC_READ_DISCRETE_INPUTS )
+    {
+        TLE( "Can only cache read function codes, fc = %d", fc );
+        return -1;
+    }
+
+    if ( 0 >= count || 0 > addr || addr + count > 0x10000 )
+    {
+        TLE( "Bad cache range, addr = %d, count = %d", addr, count );
+        return -1;
+    }
+
+    pthread_mutex_lock( &cache_lock );
+
+    if ( num_ranges == MODBUS_CACHE_MAX_RANGES )
+    {
+        pthread_mutex_unlock( &cache_lock );
+        TLE( "Out of cache ranges, max = %d", MODBUS_CACHE_MAX_RANGES );
+        return -1;
+    }
+
+    r = &ranges[num_ranges];
+    memset( r, 0, sizeof( *r ) );
+
+    r->id      = id;
+    r->fc      = fc;
+    r->addr    = addr;
+    r->count   = count;
+    r->unit    = ( fc == MODBUS_FC_READ_COILS || fc == MODBUS_FC_READ_DISCRETE_INPUTS ) ? sizeof( uint8_t ) : sizeof( uint16_t );
+    r->ttlUs   = (uint64_t)ttlMs * 1000;
+    r->data    = calloc( count, r->unit );
+    r->stampUs = calloc( count, sizeof( uint64_t ) );
+
+    if ( r->data == NULL || r->stampUs == NULL )
+    {
+        free( r->data );
+        free( r->stampUs );
+        pthread_mutex_unlock( &cache_lock );
+        TLE( "Failed to allocate cache range, count = %d", count );
+        return -1;
+    }
+
+    handle = num_ranges;
+    __atomic_store_n( &num_ranges, num_ranges + 1, __ATOMIC_RELEASE );
+
+    pthread_mutex_unlock( &cache_lock );
+
+    TLV( "Cache range %d: id = %d, fc = %d, addr = %d, count = %d, ttl = %u ms", handle, id, fc, addr, count, ttlMs );
+    return handle;
+}
+
+// Serves the read from memory if a single range holds all of it and
+// every entry is younger than the TTL. Returns count on a hit, -1 otherwise
+// ----------------------------------------------------------- modbusCacheRead
+int modbusCacheRead
+(
+    int  id,
+    int  fc,
+    int  addr,
+    int  count,
+    void *dest
+)
+{
+    const uint64_t now = modbusMonotonicUs();
+    cacheRange_t   *r;
+    int            rc = -1;
+    int            i;
+    int            j;
+
+    // nothing configured, don't take the lock
+    if ( __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock( &cache_lock );
+    for ( i = 0; i < num_ranges; i++ )
+    {
+        r = &ranges[i];
+        if ( r->id != id || r->fc != fc || addr < r->addr || addr + count > r->addr + r->count )
+        {
+            continue;
+        }
+
+        for ( j = addr - r->addr; j < addr - r->addr + count; j++ )
+        {
+            if ( r->stampUs[j] == 0 || now - r->stampUs[j] > r->ttlUs )
+            {
+                break;
+            }
+        }
+
+        if ( j < addr - r->addr + count )
+        {
+            r->stats.misses++;
+            break;
+        }
+
+        memcpy( dest, r->data + ( addr - r->addr ) * r->unit, count * r->unit );
+        r->stats.hits++;
+        rc = count;
+        break;
+    }
+    pthread_mutex_unlock( &cache_lock );
+
+    return rc;
+}
+
+// Refreshes every cached entry in [addr, addr + count) with src, called
+// after a successful read or write (fc may be either)
+// ----------------------------------------------------------- modbusCacheUpdate
+void modbusCacheUpdate
+(
+    int        id,
+    int        fc,
+    int        addr,
+    int        count,
+    const void *src
+)
+{
+    const uint64_t now = modbusMonotonicUs();
+    const int      rfc = cachedFc( fc );
+    cacheRange_t   *r;
+    int            from;
+    int            to;
+    int            i;
+    int            j;
+
+    if ( __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &cache_lock );
+    for ( i = 0; i < num_ranges; i++ )
+    {
+        r = &ranges[i];
+        if ( ( id != MODBUS_CACHE_ALL_IDS && r->id != id ) || r->fc != rfc || !overlap( r, addr, count, &from, &to ) )
+        {
+            continue;
+        }
+
+        memcpy( r->data + ( from - r->addr ) * r->unit, (const uint8_t*)src + ( from - addr ) * r->unit, ( to - from ) * r->unit );
+        for ( j = from; j < to; j++ )
+        {
+            r->stampUs[j - r->addr] = now;
+        }
+        r->stats.updates++;
+    }
+    pthread_mutex_unlock( &cache_lock );
+}
+
+// The BBU's values are unknown, e.g. after a failed write
+// ----------------------------------------------------------- modbusCacheInvalidate
+void modbusCacheInvalidate
+(
+    int id,
+    int fc,
+    int addr,
+    int count
+)
+{
+    const int    rfc = cachedFc( fc );
+    cacheRange_t *r;
+    int          from;
+    int          to;
+    int          i;
+
+    if ( __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &cache_lock );
+    for ( i = 0; i < num_ranges; i++ )
+    {
+        r = &ranges[i];
+        if ( ( id != MODBUS_CACHE_ALL_IDS && r->id != id ) || r->fc != rfc || !overlap( r, addr, count, &from, &to ) )
+        {
+            continue;
+        }
+
+        memset( &r->stampUs[from - r->addr], 0, ( to - from ) * sizeof( uint64_t ) );
+        r->stats.invalidations++;
+    }
+    pthread_mutex_unlock( &cache_lock );
+}
+
+// ----------------------------------------------------------- modbusCacheGetStats
+int modbusCacheGetStats
+(
+    int                range,
+    modbusCacheStats_t *stats
+)
+{
+    int i;
+
+    if ( stats == NULL )
+    {
+        return -1;
+    }
+
+    memset( stats, 0, sizeof( *stats ) );
+
+    pthread_mutex_lock( &cache_lock );
+    if ( range == MODBUS_CACHE_TOTALS )
+    {
+        for ( i = 0; i < num_ranges; i++ )
+        {
+            stats->hits          += ranges[i].stats.hits;
+            stats->misses        += ranges[i].stats.misses;
+            stats->updates       += ranges[i].stats.updates;
+            stats->invalidations += ranges[i].stats.invalidations;
+        }
+    }
+    else if ( 0 <= range && range < num_ranges )
+    {
+        *stats = ranges[range].stats;
+    }
+    else
+    {
+        pthread_mutex_unlock( &cache_lock );
+        TLE( "Bad cache range = %d", range );
+        return -1;
+    }
+    pthread_mutex_unlock( &cache_lock );
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Shadow register cache, per BBU images of configured register/bit
+ * ranges with a freshness TTL per range
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_CACHE_MAX_RANGES ( 64 )
+#define MODBUS_CACHE_ALL_IDS    ( -1 )   // RTU broadcast, applies to every BBU
+#define MODBUS_CACHE_TOTALS     ( -1 )   // modbusCacheGetStats over all ranges
+
+// ------------------------------------------------------------------ Type Definitions
+typedef struct{
+    uint64_t hits;
+    uint64_t misses;        // in a range but stale/never read
+    uint64_t updates;       // reads/writes that refreshed entries
+    uint64_t invalidations; // failed writes
+} modbusCacheStats_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// Caches fc (a read function code) of id in [addr, addr + count). Reads
+// completely inside the range and younger than ttlMs are served from
+// memory by the blocking adaptors. Returns the range handle
+int  modbusCacheAddRange  ( int id, int fc, int addr, int count, uint32_t ttlMs );
+int  modbusCacheGetStats  ( int range, modbusCacheStats_t *stats );
+
+// Used by the adaptor
+int  modbusCacheRead      ( int id, int fc, int addr, int count, void *dest );
+void modbusCacheUpdate    ( int id, int fc, int addr, int count, const void *src );
+void modbusCacheInvalidate( int id, int fc, int addr, int count );
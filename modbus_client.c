@@ -0,0 +1,580 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Client side of modbusd. A batch of ops is laid out in one message,
+ * sent over the daemon's UNIX socket and answered in one reply, see
+ * modbus_daemon.h for the wire format. A client reconnects once when
+ * the daemon went away between batches, and gives up on a reply that
+ * doesn't come by the batch's deadline
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tracelog.h"
+#include "modbus_client.h"
+
+// ------------------------------------------------------------------ Definitions
+// past the batch deadline, for a transaction already on the line
+#define CLIENT_REPLY_MARGIN_US  ( 2 * MAX_MODBUS_TIMEOUT * 1000000ULL )
+// batches without a deadline
+#define CLIENT_REPLY_TIMEOUT_US ( 30 * 1000000ULL )
+
+// --------------------------------------------------------- Type Definitions
+struct modbusClient{
+    char            path[sizeof( ( (struct sockaddr_un *)0 )->sun_path )];
+    int             fd;       // -1 until (re)connected
+    int             prio;
+    uint32_t        deadlineUs;
+    uint32_t        tag;
+    pthread_mutex_t lock;     // one batch at a time
+    uint8_t         *buf;     // MODBUS_DAEMON_MAX_MESSAGE
+};
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- connectDaemon
+static int connectDaemon
+(
+    modbusClient_t *client
+)
+{
+    struct sockaddr_un addr;
+    int                fd;
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, client->path );
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 )
+    {
+        return -1;
+    }
+
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 )
+    {
+        TLE( "Can't reach modbusd on %s, errno = %d", client->path, errno );
+        close( fd );
+        return -1;
+    }
+
+    client->fd = fd;
+    return 0;
+}
+
+// ----------------------------------------------------------- dropDaemon
+static void dropDaemon
+(
+    modbusClient_t *client
+)
+{
+    const int err = errno;
+
+    if ( client->fd != -1 )
+    {
+        close( client->fd );
+        client->fd = -1;
+    }
+    errno = err;
+}
+
+// ----------------------------------------------------------- sendAll
+static int sendAll
+(
+    int           fd,
+    const uint8_t *buf,
+    size_t        len
+)
+{
+    ssize_t n;
+
+    while ( len > 0 )
+    {
+        n = send( fd, buf, len, MSG_NOSIGNAL );
+        if ( n == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( n <= 0 )
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------- monotonicUs
+static uint64_t monotonicUs
+(
+)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Fails with ETIMEDOUT if buf isn't filled by untilUs (monotonicUs)
+// ----------------------------------------------------------- recvAll
+static int recvAll
+(
+    int      fd,
+    uint8_t  *buf,
+    size_t   len,
+    uint64_t untilUs
+)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t      nowUs;
+    ssize_t       n;
+    int           rc;
+
+    while ( len > 0 )
+    {
+        nowUs = monotonicUs();
+        if ( nowUs >= untilUs )
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        // rounded up, poll must not return just short of untilUs
+        rc = poll( &pfd, 1, (int)( ( untilUs - nowUs + 999 ) / 1000 ) );
+        if ( rc == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( rc == -1 )
+        {
+            return -1;
+        }
+        if ( rc == 0 )
+        {
+            continue;
+        }
+
+        n = recv( fd, buf, len, 0 );
+        if ( n == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( n <= 0 )
+        {
+            if ( n == 0 )
+            {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusClientOpen
+modbusClient_t *modbusClientOpen
+(
+    const char *path
+)
+{
+    modbusClient_t *client;
+
+    if ( path == NULL )
+    {
+        path = MODBUS_DAEMON_SOCKET;
+    }
+
+    if ( strlen( path ) >= sizeof( client->path ) )
+    {
+        TLE( "Socket path too long: %s", path );
+        errno = EINVAL;
+        return NULL;
+    }
+
+    client = calloc( 1, sizeof( *client ) );
+    if ( client == NULL )
+    {
+        return NULL;
+    }
+
+    client->buf = malloc( MODBUS_DAEMON_MAX_MESSAGE );
+    if ( client->buf == NULL )
+    {
+        free( client );
+        return NULL;
+    }
+
+    strcpy( client->path, path );
+    client->fd   = -1;
+    client->prio = MODBUS_PRIO_DEFAULT;
+    pthread_mutex_init( &client->lock, NULL );
+
+    if ( connectDaemon( client ) != 0 )
+    {
+        modbusClientClose( client );
+        return NULL;
+    }
+
+    return client;
+}
+
+// ----------------------------------------------------------- modbusClientClose
+void modbusClientClose
+(
+    modbusClient_t *client
+)
+{
+    if ( client == NULL )
+    {
+        return;
+    }
+
+    dropDaemon( client );
+    pthread_mutex_destroy( &client->lock );
+    free( client->buf );
+    free( client );
+}
+
+// ----------------------------------------------------------- modbusClientSetPriority
+int modbusClientSetPriority
+(
+    modbusClient_t *client,
+    int            prio
+)
+{
+    if ( prio != MODBUS_PRIO_DEFAULT && ( MODBUS_PRIO_CONTROL > prio || prio > MODBUS_PRIO_BACKGROUND ) )
+    {
+        TLE( "No request class %d", prio );
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock( &client->lock );
+    client->prio = prio;
+    pthread_mutex_unlock( &client->lock );
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusClientSetDeadline
+void modbusClientSetDeadline
+(
+    modbusClient_t *client,
+    uint32_t       timeoutUs
+)
+{
+    pthread_mutex_lock( &client->lock );
+    client->deadlineUs = timeoutUs;
+    pthread_mutex_unlock( &client->lock );
+}
+
+// Lays the batch out in client->buf, -1 if an op can't go on the wire
+// ----------------------------------------------------------- encodeBatch
+static int encodeBatch
+(
+    modbusClient_t         *client,
+    const modbusClientOp_t *ops,
+    int                    nops
+)
+{
+    modbusDaemonHeader_t hdr;
+    modbusDaemonOp_t     op;
+    uint8_t              *pos = client->buf + sizeof( hdr );
+    int                  i;
+
+    for ( i = 0; i < nops; i++ )
+    {
+        op.bbu        = ops[i].bbu;
+        op.fc         = ops[i].fc;
+        op.addr       = ops[i].addr;
+        op.count      = ops[i].count;
+        op.writeAddr  = ops[i].writeAddr;
+        op.writeCount = ops[i].writeCount;
+
+        if ( 0 >= op.count || op.count > MODBUS_DAEMON_MAX_COUNT( op.fc ) ||
+             ( op.fc == MODBUS_FC_WRITE_AND_READ_REGISTERS &&
+               ( 1 > op.writeCount || op.writeCount > MODBUS_MAX_WR_WRITE_REGISTERS || ops[i].writeData == NULL ) ) ||
+             ops[i].data == NULL )
+        {
+            TLE( "Bad op %d, fc = %d, count = %d", i, op.fc, op.count );
+            return -1;
+        }
+
+        memcpy( pos, &op, sizeof( op ) );
+        pos += sizeof( op );
+        memcpy( pos, ( op.fc == MODBUS_FC_WRITE_AND_READ_REGISTERS ) ? (void *)ops[i].writeData : ops[i].data,
+                MODBUS_DAEMON_TX_BYTES( &op ) );
+        pos += MODBUS_DAEMON_TX_BYTES( &op );
+    }
+
+    hdr.magic      = MODBUS_DAEMON_MAGIC;
+    hdr.length     = pos - client->buf - sizeof( hdr );
+    hdr.tag        = ++client->tag;
+    hdr.nops       = nops;
+    hdr.prio       = client->prio;
+    hdr.deadlineUs = client->deadlineUs;
+    memcpy( client->buf, &hdr, sizeof( hdr ) );
+
+    return pos - client->buf;
+}
+
+// ----------------------------------------------------------- decodeReply
+static int decodeReply
+(
+    modbusClient_t   *client,
+    modbusClientOp_t *ops,
+    int              nops
+)
+{
+    modbusDaemonReply_t  reply;
+    modbusDaemonResult_t result;
+    const uint8_t        *pos;
+    size_t               need = 0;
+    uint64_t             untilUs;
+    int                  i;
+
+    // the daemon drops what can't make the deadline, so the reply is
+    // due soon after it
+    untilUs = monotonicUs() +
+              ( ( client->deadlineUs != 0 ) ? client->deadlineUs + CLIENT_REPLY_MARGIN_US : CLIENT_REPLY_TIMEOUT_US );
+
+    if ( recvAll( client->fd, (uint8_t *)&reply, sizeof( reply ), untilUs ) != 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < nops; i++ )
+    {
+        need += sizeof( result ) + MODBUS_DAEMON_RX_BYTES( &ops[i] );
+    }
+
+    if ( reply.magic != MODBUS_DAEMON_REPLY_MAGIC || reply.tag != client->tag ||
+         reply.nops != nops || reply.length != need )
+    {
+        TLE( "Reply out of step with batch %u", client->tag );
+        errno = EPROTO;
+        return -1;
+    }
+
+    if ( recvAll( client->fd, client->buf, need, untilUs ) != 0 )
+    {
+        return -1;
+    }
+
+    pos = client->buf;
+    for ( i = 0; i < nops; i++ )
+    {
+        memcpy( &result, pos, sizeof( result ) );
+        pos += sizeof( result );
+
+        ops[i].rc  = result.rc;
+        ops[i].err = result.err;
+        if ( result.rc != -1 )
+        {
+            memcpy( ops[i].data, pos, MODBUS_DAEMON_RX_BYTES( &ops[i] ) );
+        }
+        pos += MODBUS_DAEMON_RX_BYTES( &ops[i] );
+    }
+
+    return reply.nok;
+}
+
+// ----------------------------------------------------------- modbusClientExecute
+int modbusClientExecute
+(
+    modbusClient_t   *client,
+    modbusClientOp_t *ops,
+    int              nops
+)
+{
+    int len;
+    int rc;
+
+    if ( client == NULL || ops == NULL || 1 > nops || nops > MODBUS_DAEMON_MAX_OPS )
+    {
+        TLE( "Bad batch, nops = %d", nops );
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock( &client->lock );
+
+    len = encodeBatch( client, ops, nops );
+    if ( len == -1 )
+    {
+        pthread_mutex_unlock( &client->lock );
+        errno = EINVAL;
+        return -1;
+    }
+
+    // a daemon restarted since the last batch costs one reconnect
+    if ( ( client->fd == -1 && connectDaemon( client ) != 0 ) ||
+         sendAll( client->fd, client->buf, len ) != 0 )
+    {
+        dropDaemon( client );
+        if ( connectDaemon( client ) != 0 || sendAll( client->fd, client->buf, len ) != 0 )
+        {
+            dropDaemon( client );
+            pthread_mutex_unlock( &client->lock );
+            return -1;
+        }
+    }
+
+    rc = decodeReply( client, ops, nops );
+    if ( rc == -1 )
+    {
+        // the reply stream is out of step, or a late reply would put it
+        // out of step, start over on the next batch
+        if ( errno == ETIMEDOUT )
+        {
+            TLE( "No reply to batch %u from modbusd", client->tag );
+        }
+        dropDaemon( client );
+    }
+
+    pthread_mutex_unlock( &client->lock );
+    return rc;
+}
+
+// ----------------------------------------------------------- executeOne
+static int executeOne
+(
+    modbusClient_t   *client,
+    modbusClientOp_t *op
+)
+{
+    if ( modbusClientExecute( client, op, 1 ) == -1 )
+    {
+        return -1;
+    }
+
+    if ( op->rc == -1 )
+    {
+        errno = op->err;
+    }
+    return op->rc;
+}
+
+// ----------------------------------------------------------- modbusClientReadHoldingRegisters
+int modbusClientReadHoldingRegisters
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            addr,
+    int            count,
+    uint16_t       *dest
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_READ_HOLDING_REGISTERS, .addr = addr, .count = count, .data = dest };
+
+    return executeOne( client, &op );
+}
+
+// ----------------------------------------------------------- modbusClientReadInputRegisters
+int modbusClientReadInputRegisters
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            addr,
+    int            count,
+    uint16_t       *dest
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_READ_INPUT_REGISTERS, .addr = addr, .count = count, .data = dest };
+
+    return executeOne( client, &op );
+}
+
+// ----------------------------------------------------------- modbusClientReadBits
+int modbusClientReadBits
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            addr,
+    int            count,
+    uint8_t        *dest
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_READ_COILS, .addr = addr, .count = count, .data = dest };
+
+    return executeOne( client, &op );
+}
+
+// ----------------------------------------------------------- modbusClientReadInputBits
+int modbusClientReadInputBits
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            addr,
+    int            count,
+    uint8_t        *dest
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_READ_DISCRETE_INPUTS, .addr = addr, .count = count, .data = dest };
+
+    return executeOne( client, &op );
+}
+
+// ----------------------------------------------------------- modbusClientWriteHoldingRegisters
+int modbusClientWriteHoldingRegisters
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            addr,
+    int            count,
+    uint16_t       *src
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_WRITE_MULTIPLE_REGISTERS, .addr = addr, .count = count, .data = src };
+
+    return executeOne( client, &op );
+}
+
+// ----------------------------------------------------------- modbusClientWriteBits
+int modbusClientWriteBits
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            addr,
+    int            count,
+    uint8_t        *src
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_WRITE_MULTIPLE_COILS, .addr = addr, .count = count, .data = src };
+
+    return executeOne( client, &op );
+}
+
+// ----------------------------------------------------------- modbusClientWriteAndReadRegisters
+int modbusClientWriteAndReadRegisters
+(
+    modbusClient_t *client,
+    int            bbu,
+    int            writeAddr,
+    int            writeCount,
+    uint16_t       *src,
+    int            readAddr,
+    int            readCount,
+    uint16_t       *dest
+)
+{
+    modbusClientOp_t op = { .bbu = bbu, .fc = MODBUS_FC_WRITE_AND_READ_REGISTERS, .addr = readAddr, .count = readCount,
+                            .data = dest, .writeAddr = writeAddr, .writeCount = writeCount, .writeData = src };
+
+    return executeOne( client, &op );
+}
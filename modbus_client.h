@@ -0,0 +1,65 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Client side of modbusd (modbus_daemon.c). Processes that share the
+ * buses talk to the daemon owning them instead of calling
+ * modbusSystemInit themselves. Needs neither libmodbus contexts nor
+ * modbus_sem, only the socket
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include "modbus_adaptor.h"   // MODBUS_PRIO_*
+#include "modbus_daemon.h"
+
+// ------------------------------------------------------------------ Type Definitions
+typedef struct modbusClient modbusClient_t;
+
+// One operation of a batch, owned by the caller
+typedef struct{
+    int      bbu;         // as setModbusContext, MODBUS_DAEMON_BROADCAST for a write to all
+    int      fc;          // MODBUS_FC_*
+    int      addr;
+    int      count;
+    void     *data;       // dest for reads, src for writes
+    int      writeAddr;   // FC23 only, the write half. The above is the read
+    int      writeCount;
+    uint16_t *writeData;
+    int      rc;          // result, as the adaptor
+    int      err;         // errno if rc is -1
+} modbusClientOp_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// path NULL selects MODBUS_DAEMON_SOCKET. A client may be shared by
+// threads, their batches go one at a time. A lost daemon is reconnected
+// on the next batch
+modbusClient_t *modbusClientOpen ( const char *path );
+void            modbusClientClose( modbusClient_t *client );
+
+// Class and deadline of the client's batches from now on, see
+// modbusSetThreadPriority and modbusSetThreadDeadline
+int  modbusClientSetPriority( modbusClient_t *client, int prio );
+void modbusClientSetDeadline( modbusClient_t *client, uint32_t timeoutUs );
+
+// Runs ops[0..nops) as one batch, the daemon queues them together with
+// every other client's and answers once all completed. Fills rc/err of
+// every op, returns the number that succeeded. -1 with errno if the
+// batch couldn't be sent or answered, then the ops' results are unset.
+// ETIMEDOUT if no reply came shortly after the deadline, or within 30s
+// without one, the connection is then dropped and remade on the next batch
+// An op failing with EAGAIN found its bus backed up
+int  modbusClientExecute( modbusClient_t *client, modbusClientOp_t *ops, int nops );
+
+// Single op batches, same arguments and results as the device API
+int modbusClientReadHoldingRegisters ( modbusClient_t *client, int bbu, int addr, int count, uint16_t *dest );
+int modbusClientReadInputRegisters   ( modbusClient_t *client, int bbu, int addr, int count, uint16_t *dest );
+int modbusClientReadBits             ( modbusClient_t *client, int bbu, int addr, int count, uint8_t *dest  );
+int modbusClientReadInputBits        ( modbusClient_t *client, int bbu, int addr, int count, uint8_t *dest  );
+int modbusClientWriteHoldingRegisters( modbusClient_t *client, int bbu, int addr, int count, uint16_t *src  );
+int modbusClientWriteBits            ( modbusClient_t *client, int bbu, int addr, int count, uint8_t *src   );
+int modbusClientWriteAndReadRegisters( modbusClient_t *client, int bbu, int writeAddr, int writeCount, uint16_t *src,
+                                       int readAddr, int readCount, uint16_t *dest );
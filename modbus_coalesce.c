@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_coalesce.h"
+
+// ----------------------------------------------------------- Implementation
+
+// n is at most MODBUS_COALESCE_MAX_REQS, insertion sort is fine and stable
+// ----------------------------------------------------------- sortByAddr
+static void sortByAddr
+(
+    modbusRequest_t **reqs,
+    int             n
+)
+{
+    modbusRequest_t *tmp;
+    int             i;
+    int             j;
+
+    for ( i = 1; i < n; i++ )
+    {
+        tmp = reqs[i];
+        for ( j = i; j > 0 && reqs[j - 1]->addr > tmp->addr; j-- )
+        {
+            reqs[j] = reqs[j - 1];
+        }
+        reqs[j] = tmp;
+    }
+}
+
+// ----------------------------------------------------------- modbusPlanReads
+int modbusPlanReads
+(
+    modbusRequest_t **reqs,
+    int             n,
+    uint32_t        frameCostUs,
+    uint32_t        unitCostNs,
+    int             maxCount,
+    modbusSpan_t    *spans
+)
+{
+    modbusSpan_t *cur = NULL;
+    int          nspans = 0;
+    int          end;
+    int          newEnd;
+    int          gap;
+    int          i;
+
+    if ( reqs == NULL || spans == NULL || n <= 0 )
+    {
+        return 0;
+    }
+
+    sortByAddr( reqs, n );
+
+    for ( i = 0; i < n; i++ )
+    {
+        const int addr  = reqs[i]->addr;
+        const int count = reqs[i]->count;
+
+        if ( cur != NULL )
+        {
+            end    = cur->addr + cur->count;
+            newEnd = ( addr + count > end ) ? addr + count : end;
+            gap    = addr - end;
+
+            // overlapping/adjacent always merge, holes only if reading
+            // through them is cheaper than a frame of its own
+            if ( newEnd - cur->addr <= maxCount &&
+                 ( gap <= 0 || (uint64_t)gap * unitCostNs < (uint64_t)frameCostUs * 1000 ) )
+            {
+                cur->count = newEnd - cur->addr;
+                cur->n++;
+                continue;
+            }
+        }
+
+        cur        = &spans[nspans++];
+        cur->addr  = addr;
+        cur->count = count;
+        cur->first = i;
+        cur->n     = 1;
+    }
+
+    return nspans;
+}
@@ -0,0 +1,35 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Read coalescing planner, merges reads of the same slave and
+ * function code into as few requests as the gap-cost model allows
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_COALESCE_MAX_REQS ( 32 )  // reads considered per plan
+
+// ------------------------------------------------------------------ Type Definitions
+
+// One request on the wire, covers reqs[first] .. reqs[first + n - 1]
+// of the (sorted) array passed to modbusPlanReads
+typedef struct{
+    int addr;
+    int count;
+    int first;
+    int n;
+} modbusSpan_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// Sorts reqs by address and fills spans, returns the number of spans.
+// A hole of g units is read through when g * unitCostNs is cheaper than
+// another frame (frameCostUs), spans never exceed maxCount units
+int modbusPlanReads( modbusRequest_t **reqs, int n, uint32_t frameCostUs, uint32_t unitCostNs,
+                     int maxCount, modbusSpan_t *spans );
@@ -0,0 +1,868 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * modbusd, the one process owning the serial lines / BBU connections.
+ * Other processes send it batches of adaptor operations over a UNIX
+ * socket (modbus_daemon.h, modbus_client.h) instead of each opening its
+ * own contexts and contending for a shared modbus_sem.
+ *
+ * Every op of every client goes to the queue of its BBU's bus thread
+ * right away, so the bus threads see the whole system's demand: reads of
+ * the same BBU coalesce (-C to disable), FC16 + FC03 pairs merge (-M),
+ * and the batch's priority and deadline order the queue across clients.
+ *
+ * One thread serves all clients with epoll. Bus threads complete ops in
+ * place and hand a finished batch back through an eventfd. Broadcasts go
+ * through the blocking broadcast adaptors on a short-lived thread each.
+ * Build once per transport, see compile.sh
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "tracelog.h"
+#include "modbus_adaptor.h"
+#include "modbus_cache.h"
+#include "modbus_stats.h"
+#include "modbus_daemon.h"
+
+// ------------------------------------------------------------------ Definitions
+#define DAEMON_MAX_CLIENTS  ( 64 )
+#define DAEMON_EPOLL_EVENTS ( 64 )
+#define DAEMON_ALIGN( n )   ( ( ( n ) + 7 ) & ~(size_t)7 )   // payloads are handed out as uint16_t
+
+// ------------------------------------------------------------------ Type Definitions
+
+// A client. Closing it only drops the socket, the slot is reaped once
+// the bus threads handed back its last batch
+typedef struct{
+    int      fd;
+    bool     used;
+    bool     closed;
+    bool     wantOut;     // EPOLLOUT armed
+    int      batches;     // in flight
+    int      have;
+    uint8_t  *in;         // MODBUS_DAEMON_MAX_MESSAGE
+    uint8_t  *out;
+    size_t   outLen;
+    size_t   outOff;
+    size_t   outSize;
+} daemonConn_t;
+
+typedef struct daemonBatch{
+    daemonConn_t        *conn;
+    uint32_t            tag;
+    int                 nops;
+    int                 pending;   // ops not completed + 1 while submitting
+    modbusDaemonOp_t    ops[MODBUS_DAEMON_MAX_OPS];
+    modbusRequest_t     reqs[MODBUS_DAEMON_MAX_OPS];
+    uint8_t             *tx[MODBUS_DAEMON_MAX_OPS];
+    uint8_t             *rx[MODBUS_DAEMON_MAX_OPS];
+    struct daemonBatch  *next;
+    uint8_t             data[];
+} daemonBatch_t;
+
+// --------------------------------------------------------- Static Variables
+static daemonConn_t          daemon_conns[DAEMON_MAX_CLIENTS];
+static daemonBatch_t         *daemon_done = NULL;   // pushed by bus threads, taken whole by the loop
+static int                   daemon_event_fd = -1;
+static int                   daemon_epoll_fd = -1;
+static volatile sig_atomic_t daemon_stop = 0;
+static sem_t                 daemon_sem;            // nobody else is on the buses
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- usage
+static void usage
+(
+    const char *prog
+)
+{
+    fprintf( stderr,
+        "usage: %s [options]\n"
+        "  -l path        socket (default %s)\n"
+#ifdef MODBUS_TCP
+        "  -a ip          BBU address (default 127.0.0.1)\n"
+        "  -w window      requests in flight per connection (default 1)\n"
+        "  -g conns       BBUs by unit id over conns connections to one port\n"
+#else
+        "  -s tty         serial port (default /dev/ttyS0)\n"
+        "  -B baud        line rate (default %d)\n"
+#endif
+        "  -n bbus        BBUs (default %d)\n"
+        "  -C             disable read coalescing\n"
+        "  -M             merge queued write + read pairs into FC23\n"
+        "  -e             export bus statistics to %s\n",
+        prog, MODBUS_DAEMON_SOCKET,
+#ifndef MODBUS_TCP
+        MODBUS_RTU_DEFAULT_BAUD,
+#endif
+        MAX_BBUM2_COUNT, MODBUS_STATS_SHM_NAME );
+    exit( 1 );
+}
+
+// ----------------------------------------------------------- onSignal
+static void onSignal
+(
+    int sig
+)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// Bus threads and broadcast threads, must not block
+// ----------------------------------------------------------- batchDone
+static void batchDone
+(
+    daemonBatch_t *b
+)
+{
+    const uint64_t one = 1;
+
+    if ( __atomic_sub_fetch( &b->pending, 1, __ATOMIC_ACQ_REL ) != 0 )
+    {
+        return;
+    }
+
+    b->next = __atomic_load_n( &daemon_done, __ATOMIC_RELAXED );
+    while ( !__atomic_compare_exchange_n( &daemon_done, &b->next, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+    {
+    }
+
+    if ( write( daemon_event_fd, &one, sizeof( one ) ) != sizeof( one ) )
+    {
+        TLE( "eventfd write failed, errno = %d", errno );
+    }
+}
+
+// ----------------------------------------------------------- requestDone
+static void requestDone
+(
+    modbusRequest_t *req,
+    void            *arg
+)
+{
+    (void)req;
+    batchDone( arg );
+}
+
+// ----------------------------------------------------------- failOp
+static void failOp
+(
+    daemonBatch_t *b,
+    int           i,
+    int           err
+)
+{
+    b->reqs[i].rc  = -1;
+    b->reqs[i].err = err;
+    batchDone( b );
+}
+
+// ----------------------------------------------------------- broadcastThread
+static void *broadcastThread
+(
+    void *arg
+)
+{
+    modbusRequest_t        *req = arg;
+    daemonBatch_t          *b   = req->cbArg;
+    const modbusDaemonOp_t *op  = &b->ops[req - b->reqs];
+
+    if ( op->fc == MODBUS_FC_WRITE_MULTIPLE_REGISTERS )
+    {
+        req->rc = modbusBroadCastHoldingRegistersAdaptor( op->addr, op->count, (uint16_t *)b->tx[req - b->reqs] );
+    }
+    else
+    {
+        req->rc = modbusBroadCastBitsAdaptor( op->addr, op->count, b->tx[req - b->reqs] );
+    }
+    req->err = ( req->rc == -1 ) ? errno : 0;
+
+    batchDone( b );
+    return NULL;
+}
+
+// ----------------------------------------------------------- submitOp
+static void submitOp
+(
+    daemonBatch_t *b,
+    int           i
+)
+{
+    const modbusDaemonOp_t *op  = &b->ops[i];
+    modbusRequest_t        *req = &b->reqs[i];
+    pthread_attr_t         attr;
+    pthread_t              tid;
+    int                    dev;
+    int                    rc;
+
+    req->cbArg = b;
+
+    if ( op->bbu == MODBUS_DAEMON_BROADCAST )
+    {
+        if ( op->fc != MODBUS_FC_WRITE_MULTIPLE_REGISTERS && op->fc != MODBUS_FC_WRITE_MULTIPLE_COILS )
+        {
+            failOp( b, i, EINVAL );
+            return;
+        }
+
+        pthread_attr_init( &attr );
+        pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+        rc = pthread_create( &tid, &attr, broadcastThread, req );
+        pthread_attr_destroy( &attr );
+        if ( rc != 0 )
+        {
+            TLE( "Broadcast thread failed, rc = %d", rc );
+            failOp( b, i, rc );
+        }
+        return;
+    }
+
+    dev = modbusDeviceId( op->bbu );
+    if ( dev == -1 )
+    {
+        failOp( b, i, ENODEV );
+        return;
+    }
+
+    // served like the device API, a fresh shadow copy never hits the bus
+    if ( MODBUS_DAEMON_TX_BYTES( op ) == 0 && modbusCacheRead( dev, op->fc, op->addr, op->count, b->rx[i] ) == op->count )
+    {
+        req->rc  = op->count;
+        req->err = 0;
+        batchDone( b );
+        return;
+    }
+
+    errno = 0;
+    switch ( op->fc )
+    {
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            rc = modbusSubmitWrite( req, dev, op->fc, op->addr, op->count, b->tx[i], requestDone, b );
+            break;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            rc = modbusSubmitWriteAndRead( req, dev, op->writeAddr, op->writeCount, (uint16_t *)b->tx[i],
+                                           op->addr, op->count, (uint16_t *)b->rx[i], requestDone, b );
+            break;
+        default:
+            rc = modbusSubmitRead( req, dev, op->fc, op->addr, op->count, b->rx[i], requestDone, b );
+            break;
+    }
+
+    if ( rc == -1 )
+    {
+        // EAGAIN: the bus is backed up, the client decides whether to retry
+        failOp( b, i, ( errno != 0 ) ? errno : EINVAL );
+    }
+}
+
+// Validates and queues one message. -1 for a malformed one, the
+// client is out of step and gets dropped
+// ----------------------------------------------------------- startBatch
+static int startBatch
+(
+    daemonConn_t  *conn,
+    const uint8_t *msg
+)
+{
+    modbusDaemonHeader_t hdr;
+    modbusDaemonOp_t     op;
+    daemonBatch_t        *b;
+    const uint8_t        *pos;
+    const uint8_t        *end;
+    size_t               size = 0;
+    size_t               off  = 0;
+    int                  i;
+
+    memcpy( &hdr, msg, sizeof( hdr ) );
+    pos = msg + sizeof( hdr );
+    end = pos + hdr.length;
+
+    // sizes first, nothing is queued for a message that is cut short
+    for ( i = 0; i < hdr.nops; i++ )
+    {
+        if ( end - pos < (ptrdiff_t)sizeof( op ) )
+        {
+            return -1;
+        }
+        memcpy( &op, pos, sizeof( op ) );
+        pos += sizeof( op );
+
+        if ( 0 >= op.count || op.count > MODBUS_DAEMON_MAX_COUNT( op.fc ) ||
+             ( op.fc == MODBUS_FC_WRITE_AND_READ_REGISTERS &&
+               ( 1 > op.writeCount || op.writeCount > MODBUS_MAX_WR_WRITE_REGISTERS ) ) )
+        {
+            TLE( "Bad op from client %d, fc = %d, count = %d", conn->fd, op.fc, op.count );
+            return -1;
+        }
+
+        if ( end - pos < (ptrdiff_t)MODBUS_DAEMON_TX_BYTES( &op ) )
+        {
+            return -1;
+        }
+        pos  += MODBUS_DAEMON_TX_BYTES( &op );
+        size += DAEMON_ALIGN( MODBUS_DAEMON_TX_BYTES( &op ) ) + DAEMON_ALIGN( MODBUS_DAEMON_RX_BYTES( &op ) );
+    }
+
+    if ( pos != end )
+    {
+        return -1;
+    }
+
+    b = calloc( 1, sizeof( *b ) + size );
+    if ( b == NULL )
+    {
+        TLE( "Out of memory for a batch of %d", hdr.nops );
+        return -1;
+    }
+
+    b->conn    = conn;
+    b->tag     = hdr.tag;
+    b->nops    = hdr.nops;
+    b->pending = hdr.nops + 1;
+
+    pos = msg + sizeof( hdr );
+    for ( i = 0; i < hdr.nops; i++ )
+    {
+        memcpy( &b->ops[i], pos, sizeof( b->ops[i] ) );
+        pos += sizeof( b->ops[i] );
+
+        b->tx[i] = b->data + off;
+        memcpy( b->tx[i], pos, MODBUS_DAEMON_TX_BYTES( &b->ops[i] ) );
+        pos += MODBUS_DAEMON_TX_BYTES( &b->ops[i] );
+        off += DAEMON_ALIGN( MODBUS_DAEMON_TX_BYTES( &b->ops[i] ) );
+
+        b->rx[i] = b->data + off;
+        off += DAEMON_ALIGN( MODBUS_DAEMON_RX_BYTES( &b->ops[i] ) );
+    }
+
+    conn->batches++;
+
+    // the batch's class and deadline hold for every op it queues
+    if ( modbusSetThreadPriority( hdr.prio ) != 0 )
+    {
+        for ( i = 0; i < b->nops; i++ )
+        {
+            failOp( b, i, EINVAL );
+        }
+    }
+    else
+    {
+        modbusSetThreadDeadline( hdr.deadlineUs );
+        for ( i = 0; i < b->nops; i++ )
+        {
+            submitOp( b, i );
+        }
+    }
+
+    batchDone( b );
+    return 0;
+}
+
+// ----------------------------------------------------------- closeConn
+static void closeConn
+(
+    daemonConn_t *conn
+)
+{
+    if ( conn->closed )
+    {
+        return;
+    }
+
+    epoll_ctl( daemon_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL );
+    close( conn->fd );
+    conn->closed = true;
+}
+
+// Frees closed clients without batches in flight, only between event
+// rounds so no pending event points at a freed slot
+// ----------------------------------------------------------- reapConns
+static void reapConns
+(
+)
+{
+    daemonConn_t *conn;
+    int          i;
+
+    for ( i = 0; i < DAEMON_MAX_CLIENTS; i++ )
+    {
+        conn = &daemon_conns[i];
+        if ( conn->used && conn->closed && conn->batches == 0 )
+        {
+            free( conn->in );
+            free( conn->out );
+            memset( conn, 0, sizeof( *conn ) );
+        }
+    }
+}
+
+// ----------------------------------------------------------- armOut
+static void armOut
+(
+    daemonConn_t *conn,
+    bool         out
+)
+{
+    struct epoll_event ev;
+
+    if ( conn->wantOut == out )
+    {
+        return;
+    }
+
+    ev.events   = EPOLLIN | ( out ? EPOLLOUT : 0 );
+    ev.data.ptr = conn;
+    epoll_ctl( daemon_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev );
+    conn->wantOut = out;
+}
+
+// ----------------------------------------------------------- flushConn
+static void flushConn
+(
+    daemonConn_t *conn
+)
+{
+    ssize_t n;
+
+    while ( conn->outOff < conn->outLen )
+    {
+        n = send( conn->fd, conn->out + conn->outOff, conn->outLen - conn->outOff, MSG_NOSIGNAL );
+        if ( n > 0 )
+        {
+            conn->outOff += n;
+        }
+        else if ( n == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        else if ( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            armOut( conn, true );
+            return;
+        }
+        else
+        {
+            closeConn( conn );
+            return;
+        }
+    }
+
+    conn->outOff = 0;
+    conn->outLen = 0;
+    armOut( conn, false );
+}
+
+// ----------------------------------------------------------- finishBatch
+static void finishBatch
+(
+    daemonBatch_t *b
+)
+{
+    daemonConn_t         *conn = b->conn;
+    modbusDaemonReply_t  reply;
+    modbusDaemonResult_t result;
+    size_t               need = sizeof( reply );
+    uint8_t              *pos;
+    uint8_t              *grown;
+    int                  i;
+
+    conn->batches--;
+    if ( conn->closed )
+    {
+        free( b );
+        return;
+    }
+
+    for ( i = 0; i < b->nops; i++ )
+    {
+        need += sizeof( result ) + MODBUS_DAEMON_RX_BYTES( &b->ops[i] );
+    }
+
+    if ( conn->outLen + need > conn->outSize )
+    {
+        grown = realloc( conn->out, conn->outLen + need );
+        if ( grown == NULL )
+        {
+            TLE( "Out of memory for a reply to client %d", conn->fd );
+            free( b );
+            closeConn( conn );
+            return;
+        }
+        conn->out     = grown;
+        conn->outSize = conn->outLen + need;
+    }
+
+    reply.magic  = MODBUS_DAEMON_REPLY_MAGIC;
+    reply.length = need - sizeof( reply );
+    reply.tag    = b->tag;
+    reply.nops   = b->nops;
+    reply.nok    = 0;
+
+    pos = conn->out + conn->outLen + sizeof( reply );
+    for ( i = 0; i < b->nops; i++ )
+    {
+        result.rc  = b->reqs[i].rc;
+        result.err = b->reqs[i].err;
+        if ( result.rc != -1 )
+        {
+            reply.nok++;
+        }
+
+        memcpy( pos, &result, sizeof( result ) );
+        pos += sizeof( result );
+        memcpy( pos, b->rx[i], MODBUS_DAEMON_RX_BYTES( &b->ops[i] ) );
+        pos += MODBUS_DAEMON_RX_BYTES( &b->ops[i] );
+    }
+    memcpy( conn->out + conn->outLen, &reply, sizeof( reply ) );
+    conn->outLen += need;
+
+    free( b );
+    flushConn( conn );
+}
+
+// ----------------------------------------------------------- drainDone
+static void drainDone
+(
+)
+{
+    daemonBatch_t *list;
+    daemonBatch_t *prev = NULL;
+    daemonBatch_t *next;
+    uint64_t      count;
+
+    if ( read( daemon_event_fd, &count, sizeof( count ) ) != sizeof( count ) && errno != EAGAIN )
+    {
+        TLE( "eventfd read failed, errno = %d", errno );
+    }
+
+    // pushed newest first, reply in completion order
+    list = __atomic_exchange_n( &daemon_done, NULL, __ATOMIC_ACQUIRE );
+    while ( list != NULL )
+    {
+        next       = list->next;
+        list->next = prev;
+        prev       = list;
+        list       = next;
+    }
+
+    for ( list = prev; list != NULL; list = next )
+    {
+        next = list->next;
+        finishBatch( list );
+    }
+}
+
+// ----------------------------------------------------------- readConn
+static void readConn
+(
+    daemonConn_t *conn
+)
+{
+    modbusDaemonHeader_t hdr;
+    ssize_t              n;
+    size_t               used;
+
+    while ( !conn->closed )
+    {
+        n = recv( conn->fd, conn->in + conn->have, MODBUS_DAEMON_MAX_MESSAGE - conn->have, 0 );
+        if ( n == -1 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            return;
+        }
+        if ( n <= 0 )
+        {
+            closeConn( conn );
+            return;
+        }
+        conn->have += n;
+
+        // every complete message becomes a batch
+        used = 0;
+        while ( conn->have - used >= sizeof( hdr ) )
+        {
+            memcpy( &hdr, conn->in + used, sizeof( hdr ) );
+            if ( hdr.magic != MODBUS_DAEMON_MAGIC || hdr.length > MODBUS_DAEMON_MAX_MESSAGE - sizeof( hdr ) ||
+                 1 > hdr.nops || hdr.nops > MODBUS_DAEMON_MAX_OPS )
+            {
+                TLE( "Bad message from client %d, dropping it", conn->fd );
+                closeConn( conn );
+                return;
+            }
+
+            if ( conn->have - used < sizeof( hdr ) + hdr.length )
+            {
+                break;
+            }
+
+            if ( startBatch( conn, conn->in + used ) != 0 )
+            {
+                TLE( "Bad batch from client %d, dropping it", conn->fd );
+                closeConn( conn );
+                return;
+            }
+            used += sizeof( hdr ) + hdr.length;
+        }
+
+        memmove( conn->in, conn->in + used, conn->have - used );
+        conn->have -= used;
+    }
+}
+
+// ----------------------------------------------------------- acceptConns
+static void acceptConns
+(
+    int listenFd
+)
+{
+    struct epoll_event ev;
+    daemonConn_t       *conn;
+    int                fd;
+    int                i;
+
+    while ( ( fd = accept4( listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) != -1 )
+    {
+        conn = NULL;
+        for ( i = 0; i < DAEMON_MAX_CLIENTS && conn == NULL; i++ )
+        {
+            if ( !daemon_conns[i].used )
+            {
+                conn = &daemon_conns[i];
+            }
+        }
+
+        if ( conn == NULL )
+        {
+            TLE( "Out of client slots, max = %d", DAEMON_MAX_CLIENTS );
+            close( fd );
+            continue;
+        }
+
+        conn->in = malloc( MODBUS_DAEMON_MAX_MESSAGE );
+        if ( conn->in == NULL )
+        {
+            TLE( "Out of memory for a client" );
+            close( fd );
+            continue;
+        }
+        conn->fd   = fd;
+        conn->used = true;
+
+        ev.events   = EPOLLIN;
+        ev.data.ptr = conn;
+        if ( epoll_ctl( daemon_epoll_fd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+        {
+            TLE( "epoll_ctl failed, errno = %d", errno );
+            conn->closed = true;
+            close( fd );
+        }
+    }
+}
+
+// ----------------------------------------------------------- openSocket
+static int openSocket
+(
+    const char *path
+)
+{
+    struct sockaddr_un addr;
+    int                fd;
+
+    if ( strlen( path ) >= sizeof( addr.sun_path ) )
+    {
+        fprintf( stderr, "Socket path too long: %s\n", path );
+        return -1;
+    }
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+
+    // a previous daemon's socket, nobody is listening on it any more
+    unlink( path );
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 || bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 || listen( fd, SOMAXCONN ) != 0 )
+    {
+        fprintf( stderr, "Can't listen on %s, errno = %d\n", path, errno );
+        if ( fd != -1 )
+        {
+            close( fd );
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+// ----------------------------------------------------------- main
+int main
+(
+    int  argc,
+    char **argv
+)
+{
+    struct epoll_event ev;
+    struct epoll_event events[DAEMON_EPOLL_EVENTS];
+    struct sigaction   sa;
+    const char         *path     = MODBUS_DAEMON_SOCKET;
+    const char         *ip       = "127.0.0.1";
+    char               *stty     = "/dev/ttyS0";
+    int                bbus      = MAX_BBUM2_COUNT;
+    int                baud      = MODBUS_RTU_DEFAULT_BAUD;
+    int                window    = 1;
+    int                gateway   = 0;
+    bool               coalesce  = true;
+    bool               merge     = false;
+    bool               stats     = false;
+    int                listenFd;
+    int                n;
+    int                opt;
+    int                i;
+
+    while ( ( opt = getopt( argc, argv, "l:a:w:g:s:B:n:CMe" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 'l': path     = optarg;          break;
+            case 'a': ip       = optarg;          break;
+            case 'w': window   = atoi( optarg );  break;
+            case 'g': gateway  = atoi( optarg );  break;
+            case 's': stty     = optarg;          break;
+            case 'B': baud     = atoi( optarg );  break;
+            case 'n': bbus     = atoi( optarg );  break;
+            case 'C': coalesce = false;           break;
+            case 'M': merge    = true;            break;
+            case 'e': stats    = true;            break;
+            default:
+                usage( argv[0] );
+        }
+    }
+
+    if ( 0 >= bbus || bbus > ( gateway ? MODBUS_TCP_MAX_UNITS : MAX_BBUM2_COUNT ) )
+    {
+        usage( argv[0] );
+    }
+
+#ifdef MODBUS_TCP
+    if ( modbusSetTcpWindow( window ) != 0 || ( gateway > 0 && modbusSetTcpGateway( gateway ) != 0 ) )
+    {
+        usage( argv[0] );
+    }
+#else
+    (void)window;
+#endif
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_handler = onSignal;
+    sigaction( SIGINT, &sa, NULL );
+    sigaction( SIGTERM, &sa, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    sem_init( &daemon_sem, 0, 1 );
+    if ( modbusSystemInit( &daemon_sem, bbus, inet_addr( ip ), stty, baud ) != 0 )
+    {
+        fprintf( stderr, "modbusSystemInit failed\n" );
+        return 1;
+    }
+
+    modbusSetReadCoalescing( coalesce );
+    modbusSetWriteReadMerging( merge );
+    if ( stats && modbusStatsExport( MODBUS_STATS_SHM_NAME ) != 0 )
+    {
+        fprintf( stderr, "Can't export statistics to %s\n", MODBUS_STATS_SHM_NAME );
+        return 1;
+    }
+
+    listenFd        = openSocket( path );
+    daemon_event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    daemon_epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if ( listenFd == -1 || daemon_event_fd == -1 || daemon_epoll_fd == -1 )
+    {
+        return 1;
+    }
+
+    // data.ptr: NULL is the listener, &daemon_event_fd the bus threads
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl( daemon_epoll_fd, EPOLL_CTL_ADD, listenFd, &ev );
+    ev.data.ptr = &daemon_event_fd;
+    epoll_ctl( daemon_epoll_fd, EPOLL_CTL_ADD, daemon_event_fd, &ev );
+
+    TLV( "modbusd serving %d BBUs on %s", bbus, path );
+
+    while ( !daemon_stop )
+    {
+        n = epoll_wait( daemon_epoll_fd, events, DAEMON_EPOLL_EVENTS, -1 );
+        if ( n == -1 )
+        {
+            if ( errno != EINTR )
+            {
+                TLE( "epoll_wait failed, errno = %d", errno );
+                break;
+            }
+            continue;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            daemonConn_t *conn = events[i].data.ptr;
+
+            if ( conn == NULL )
+            {
+                acceptConns( listenFd );
+            }
+            else if ( events[i].data.ptr == &daemon_event_fd )
+            {
+                drainDone();
+            }
+            else if ( !conn->closed )
+            {
+                if ( events[i].events & ( EPOLLERR | EPOLLHUP ) )
+                {
+                    // read what is left, recv reports the end
+                    readConn( conn );
+                    closeConn( conn );
+                    continue;
+                }
+                if ( events[i].events & EPOLLOUT )
+                {
+                    flushConn( conn );
+                }
+                if ( events[i].events & EPOLLIN )
+                {
+                    readConn( conn );
+                }
+            }
+        }
+
+        reapConns();
+    }
+
+    // in flight requests still point into batches, leave them to exit()
+    close( listenFd );
+    unlink( path );
+    return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Wire format between modbusd, the process owning the buses, and its
+ * clients (modbus_client.h) over a UNIX stream socket. Host byte order.
+ *
+ * A client sends batches, a header then nops ops, every op followed by
+ * its write payload. The daemon queues all ops of a batch at once, next
+ * to every other client's, and sends one reply per batch once the last
+ * op completed: a header then a result per op, every result followed by
+ * its read payload. Replies carry the batch's tag and may come out of
+ * order when a client has several batches in flight.
+ *
+ * Payloads are count registers as uint16_t or count bits as uint8_t,
+ * as for the adaptors. FC23 sends writeCount registers and gets count
+ * registers back. A read payload is undefined if its op failed
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include <modbus.h>
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_DAEMON_SOCKET      "/tmp/modbusd.sock"
+#define MODBUS_DAEMON_MAGIC       ( 0x4d424454 )    // "MBDT"
+#define MODBUS_DAEMON_REPLY_MAGIC ( 0x4d424452 )    // "MBDR"
+#define MODBUS_DAEMON_MAX_OPS     ( 128 )
+#define MODBUS_DAEMON_BROADCAST   ( -1 )            // bbu of a write to every BBU
+
+// No payload is larger than a read of MODBUS_MAX_READ_BITS
+#define MODBUS_DAEMON_MAX_MESSAGE ( sizeof( modbusDaemonHeader_t ) + \
+                                    MODBUS_DAEMON_MAX_OPS * ( sizeof( modbusDaemonOp_t ) + MODBUS_MAX_READ_BITS ) )
+
+#define MODBUS_DAEMON_BIT_FC( fc ) ( ( fc ) == MODBUS_FC_READ_COILS || ( fc ) == MODBUS_FC_READ_DISCRETE_INPUTS || \
+                                     ( fc ) == MODBUS_FC_WRITE_MULTIPLE_COILS )
+#define MODBUS_DAEMON_UNIT( fc )   ( MODBUS_DAEMON_BIT_FC( fc ) ? sizeof( uint8_t ) : sizeof( uint16_t ) )
+
+// count limit per fc, 0: not an fc the daemon serves
+#define MODBUS_DAEMON_MAX_COUNT( fc ) \
+    ( ( fc ) == MODBUS_FC_READ_HOLDING_REGISTERS || ( fc ) == MODBUS_FC_READ_INPUT_REGISTERS ? MODBUS_MAX_READ_REGISTERS : \
+      ( fc ) == MODBUS_FC_READ_COILS || ( fc ) == MODBUS_FC_READ_DISCRETE_INPUTS ? MODBUS_MAX_READ_BITS : \
+      ( fc ) == MODBUS_FC_WRITE_MULTIPLE_REGISTERS ? MODBUS_MAX_WRITE_REGISTERS : \
+      ( fc ) == MODBUS_FC_WRITE_MULTIPLE_COILS ? MODBUS_MAX_WRITE_BITS : \
+      ( fc ) == MODBUS_FC_WRITE_AND_READ_REGISTERS ? MODBUS_MAX_WR_READ_REGISTERS : 0 )
+
+// Payload bytes of an op, client to daemon and back
+#define MODBUS_DAEMON_TX_BYTES( op ) \
+    ( ( op )->fc == MODBUS_FC_WRITE_AND_READ_REGISTERS ? ( op )->writeCount * sizeof( uint16_t ) : \
+      ( op )->fc == MODBUS_FC_WRITE_MULTIPLE_REGISTERS || ( op )->fc == MODBUS_FC_WRITE_MULTIPLE_COILS ? \
+      ( op )->count * MODBUS_DAEMON_UNIT( ( op )->fc ) : 0 )
+#define MODBUS_DAEMON_RX_BYTES( op ) \
+    ( ( op )->fc == MODBUS_FC_WRITE_MULTIPLE_REGISTERS || ( op )->fc == MODBUS_FC_WRITE_MULTIPLE_COILS ? \
+      0 : ( op )->count * MODBUS_DAEMON_UNIT( ( op )->fc ) )
+
+// ------------------------------------------------------------------ Type Definitions
+typedef struct{
+    uint32_t magic;       // MODBUS_DAEMON_MAGIC
+    uint32_t length;      // bytes after the header
+    uint32_t tag;         // echoed in the reply
+    int32_t  nops;        // 1..MODBUS_DAEMON_MAX_OPS
+    int32_t  prio;        // MODBUS_PRIO_* of every op, see modbusSetThreadPriority
+    uint32_t deadlineUs;  // 0: none, see modbusSetThreadDeadline
+} modbusDaemonHeader_t;
+
+typedef struct{
+    int32_t  bbu;         // as setModbusContext, or MODBUS_DAEMON_BROADCAST
+    int32_t  fc;          // MODBUS_FC_* as in modbus_adaptor.h
+    int32_t  addr;
+    int32_t  count;
+    int32_t  writeAddr;   // FC23 only, the write half
+    int32_t  writeCount;
+} modbusDaemonOp_t;
+
+typedef struct{
+    uint32_t magic;       // MODBUS_DAEMON_REPLY_MAGIC
+    uint32_t length;      // bytes after the header
+    uint32_t tag;
+    int32_t  nops;
+    int32_t  nok;         // ops that succeeded
+} modbusDaemonReply_t;
+
+typedef struct{
+    int32_t  rc;          // as the adaptor
+    int32_t  err;         // errno if rc is -1
+} modbusDaemonResult_t;
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_health.h"
+
+// --------------------------------------------------------- Type Definitions
+typedef struct{
+    modbusHealthStats_t stats;
+    uint64_t            nextProbeUs;
+    bool                probeQueued;   // probe_req[slave] is in flight
+} slaveHealth_t;
+
+// --------------------------------------------------------- Static Variables
+static slaveHealth_t   slaves[MODBUS_HEALTH_MAX_SLAVES];
+static modbusRequest_t probe_req[MODBUS_HEALTH_MAX_SLAVES];
+static uint16_t        probe_reg[MODBUS_HEALTH_MAX_SLAVES];
+static uint32_t        trip_threshold = MODBUS_HEALTH_DEFAULT_THRESHOLD;
+static uint64_t        probe_us  = (uint64_t)MODBUS_HEALTH_DEFAULT_PROBE_MS * 1000;
+static int             num_down  = 0;     // fast path, read without the lock
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  health_cond;
+static pthread_once_t  health_once = PTHREAD_ONCE_INIT;
+static pthread_t       probe_thread;
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- validSlave
+static bool validSlave
+(
+    int slave
+)
+{
+    return 0 <= slave && slave < MODBUS_HEALTH_MAX_SLAVES;
+}
+
+// Runs on the bus thread, modbusHealthResult already recorded the outcome
+// ----------------------------------------------------------- probeDone
+static void probeDone
+(
+    modbusRequest_t *req,
+    void            *arg
+)
+{
+    pthread_mutex_lock( &health_lock );
+    slaves[req->id].probeQueued = false;
+    pthread_cond_signal( &health_cond );
+    pthread_mutex_unlock( &health_lock );
+}
+
+// Queues a probe read to every slave that is due, so a slave nobody
+// polls any more still comes back
+// ----------------------------------------------------------- probeThread
+static void *probeThread
+(
+    void *arg
+)
+{
+    struct timespec ts;
+    uint64_t        next;
+    uint64_t        now;
+    int             i;
+
+    pthread_mutex_lock( &health_lock );
+    while ( 1 )
+    {
+        now  = modbusMonotonicUs();
+        next = 0;
+
+        for ( i = 0; i < MODBUS_HEALTH_MAX_SLAVES; i++ )
+        {
+            slaveHealth_t *s = &slaves[i];
+
+            if ( s->stats.state != MODBUS_HEALTH_DOWN || s->probeQueued )
+            {
+                continue;
+            }
+
+            if ( s->nextProbeUs > now )
+            {
+                next = ( next == 0 || s->nextProbeUs < next ) ? s->nextProbeUs : next;
+                continue;
+            }
+
+            // the bus thread admits it as the probe, unless real traffic
+            // got there first
+            s->probeQueued = true;
+            pthread_mutex_unlock( &health_lock );
+
+            if ( modbusSubmitRead( &probe_req[i], i, MODBUS_FC_READ_HOLDING_REGISTERS,
+                                   MODBUS_HEALTH_PROBE_ADDR, 1, &probe_reg[i], probeDone, NULL ) != 0 )
+            {
+                TLE( "Failed to queue probe, slave = %d", i );
+                pthread_mutex_lock( &health_lock );
+                s->probeQueued = false;
+                s->nextProbeUs = now + probe_us;
+                continue;
+            }
+
+            pthread_mutex_lock( &health_lock );
+        }
+
+        if ( next == 0 )
+        {
+            pthread_cond_wait( &health_cond, &health_lock );
+        }
+        else
+        {
+            ts.tv_sec  = next / 1000000;
+            ts.tv_nsec = ( next % 1000000 ) * 1000;
+            pthread_cond_timedwait( &health_cond, &health_lock, &ts );
+        }
+    }
+
+    pthread_mutex_unlock( &health_lock );
+    return NULL;
+}
+
+// health_cond waits on CLOCK_MONOTONIC, the probe thread only exists
+// once a slave went down
+// ----------------------------------------------------------- healthInitOnce
+static void healthInitOnce
+(
+)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &health_cond, &attr );
+    pthread_condattr_destroy( &attr );
+
+    if ( pthread_create( &probe_thread, NULL, probeThread, NULL ) != 0 )
+    {
+        // requests still get through as probes when due
+        TLE( "Failed to create probe thread, errno = %d", errno );
+    }
+}
+
+// ----------------------------------------------------------- modbusHealthConfigure
+int modbusHealthConfigure
+(
+    uint32_t threshold,
+    uint32_t probeMs
+)
+{
+    pthread_mutex_lock( &health_lock );
+    if ( threshold != 0 )
+    {
+        trip_threshold = threshold;
+    }
+    if ( probeMs != 0 )
+    {
+        probe_us = (uint64_t)probeMs * 1000;
+    }
+    pthread_mutex_unlock( &health_lock );
+
+    TLV( "Circuit breaker: threshold = %u, probe every %u ms", trip_threshold, (uint32_t)( probe_us / 1000 ) );
+    return 0;
+}
+
+// DOWN slaves fail fast, except for one request per probe interval
+// ----------------------------------------------------------- modbusHealthAdmit
+bool modbusHealthAdmit
+(
+    int slave
+)
+{
+    slaveHealth_t *s;
+    bool          admit = true;
+
+    if ( __atomic_load_n( &num_down, __ATOMIC_ACQUIRE ) == 0 || !validSlave( slave ) )
+    {
+        return true;
+    }
+
+    pthread_mutex_lock( &health_lock );
+    s = &slaves[slave];
+    switch ( s->stats.state )
+    {
+        case MODBUS_HEALTH_UP:
+            break;
+        case MODBUS_HEALTH_DOWN:
+            if ( modbusMonotonicUs() >= s->nextProbeUs )
+            {
+                s->stats.state = MODBUS_HEALTH_PROBING;
+                s->stats.probes++;
+                break;
+            }
+            admit = false;
+            s->stats.fastFails++;
+            break;
+        case MODBUS_HEALTH_PROBING:
+            admit = false;
+            s->stats.fastFails++;
+            break;
+    }
+    pthread_mutex_unlock( &health_lock );
+
+    return admit;
+}
+
+// answered: any response from the slave, an exception one included
+// ----------------------------------------------------------- modbusHealthResult
+void modbusHealthResult
+(
+    int  slave,
+    bool answered
+)
+{
+    slaveHealth_t *s;
+
+    if ( !validSlave( slave ) )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &health_lock );
+    s = &slaves[slave];
+
+    if ( answered )
+    {
+        s->stats.consecutiveFailures = 0;
+        if ( s->stats.state != MODBUS_HEALTH_UP )
+        {
+            s->stats.state = MODBUS_HEALTH_UP;
+            __atomic_sub_fetch( &num_down, 1, __ATOMIC_RELEASE );
+            pthread_mutex_unlock( &health_lock );
+            TLV( "Slave %d is back", slave );
+            return;
+        }
+        pthread_mutex_unlock( &health_lock );
+        return;
+    }
+
+    s->stats.failures++;
+    s->stats.consecutiveFailures++;
+
+    if ( s->stats.state == MODBUS_HEALTH_PROBING )
+    {
+        s->stats.state = MODBUS_HEALTH_DOWN;
+        s->nextProbeUs = modbusMonotonicUs() + probe_us;
+        pthread_cond_signal( &health_cond );
+        pthread_mutex_unlock( &health_lock );
+        return;
+    }
+
+    if ( s->stats.state == MODBUS_HEALTH_UP && s->stats.consecutiveFailures >= trip_threshold )
+    {
+        s->stats.state = MODBUS_HEALTH_DOWN;
+        s->stats.trips++;
+        s->nextProbeUs = modbusMonotonicUs() + probe_us;
+        __atomic_add_fetch( &num_down, 1, __ATOMIC_RELEASE );
+        pthread_mutex_unlock( &health_lock );
+
+        TLE( "Slave %d down after %u consecutive failures, probing every %u ms",
+            slave, trip_threshold, (uint32_t)( probe_us / 1000 ) );
+
+        pthread_once( &health_once, healthInitOnce );
+        pthread_mutex_lock( &health_lock );
+        pthread_cond_signal( &health_cond );
+        pthread_mutex_unlock( &health_lock );
+        return;
+    }
+
+    pthread_mutex_unlock( &health_lock );
+}
+
+// The probe didn't get sent, e.g. the line was busy. Nothing was learnt
+// about the slave, it is DOWN until the next probe
+// ----------------------------------------------------------- modbusHealthCancel
+void modbusHealthCancel
+(
+    int slave
+)
+{
+    slaveHealth_t *s;
+
+    if ( !validSlave( slave ) )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &health_lock );
+    s = &slaves[slave];
+    if ( s->stats.state == MODBUS_HEALTH_PROBING )
+    {
+        s->stats.state = MODBUS_HEALTH_DOWN;
+        s->stats.cancelled++;
+        s->nextProbeUs = modbusMonotonicUs() + probe_us;
+        pthread_cond_signal( &health_cond );
+    }
+    pthread_mutex_unlock( &health_lock );
+}
+
+// ----------------------------------------------------------- modbusHealthGetStats
+int modbusHealthGetStats
+(
+    int                 slave,
+    modbusHealthStats_t *stats
+)
+{
+    if ( stats == NULL || !validSlave( slave ) )
+    {
+        TLE( "Bad health stats request, slave = %d", slave );
+        return -1;
+    }
+
+    pthread_mutex_lock( &health_lock );
+    *stats = slaves[slave].stats;
+    pthread_mutex_unlock( &health_lock );
+
+    return 0;
+}
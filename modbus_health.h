@@ -0,0 +1,50 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Per slave circuit breaker, a slave that stopped answering is taken off
+ * the bus and re-probed in the background until it answers again
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_HEALTH_MAX_SLAVES         ( MODBUS_MAX_SLAVE_ID + 1 )
+#define MODBUS_HEALTH_DEFAULT_THRESHOLD  ( 3 )      // consecutive failures
+#define MODBUS_HEALTH_DEFAULT_PROBE_MS   ( 5000 )
+#define MODBUS_HEALTH_PROBE_ADDR         ( 0 )      // FC03, an exception answer will do
+
+// ------------------------------------------------------------------ Type Definitions
+typedef enum{
+    MODBUS_HEALTH_UP = 0,
+    MODBUS_HEALTH_DOWN,       // requests fail fast with MODBUS_EDOWN
+    MODBUS_HEALTH_PROBING     // one request on the wire decides
+} modbusHealthState_t;
+
+typedef struct{
+    modbusHealthState_t state;
+    uint32_t            consecutiveFailures;
+    uint64_t            failures;
+    uint64_t            trips;        // UP -> DOWN
+    uint64_t            fastFails;    // requests failed without the wire
+    uint64_t            probes;
+    uint64_t            cancelled;    // probes that never got to the wire
+} modbusHealthStats_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// 0 keeps the current value
+int  modbusHealthConfigure( uint32_t threshold, uint32_t probeMs );
+int  modbusHealthGetStats ( int slave, modbusHealthStats_t *stats );
+
+// Used by the bus threads. Admit false: fail the request without sending.
+// Every admitted request ends in Result, or in Cancel if it never got
+// to the wire, otherwise a probing slave would stay PROBING
+bool modbusHealthAdmit    ( int slave );
+void modbusHealthResult   ( int slave, bool answered );
+void modbusHealthCancel   ( int slave );
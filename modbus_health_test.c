@@ -0,0 +1,167 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Circuit breaker regression test against the simulator (server.c), RTU
+ * only. A slave that is due for a probe is admitted as PROBING before
+ * its request goes to the line. If the line's semaphore can't be had the
+ * request fails with EBUSY without reaching the wire, and the slave must
+ * fall back to DOWN rather than stay PROBING and fail fast forever.
+ *
+ * BBU 1 of two is dead (100% drop), the test holds the line's semaphore
+ * while it is due for a probe, then checks that probing resumes once
+ * the line is free. Exit status 0 on pass
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "modbus_adaptor.h"
+#include "modbus_health.h"
+
+// ------------------------------------------------------------------ Definitions
+#define TEST_PROBE_MS    ( 100 )
+#define TEST_SIM_WAIT_MS ( 3000 )
+#define TEST_DEAD_BBU    ( 1 )
+
+// --------------------------------------------------------- Static Variables
+static sem_t test_sem;
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- startSimulator
+static pid_t startSimulator
+(
+    const char *path,
+    const char *link
+)
+{
+    pid_t pid;
+    int   waited;
+
+    pid = fork();
+    if ( pid == 0 )
+    {
+        if ( freopen( "/dev/null", "w", stdout ) == NULL )
+        {
+            _exit( 1 );
+        }
+        // slave index 1 never answers
+        execl( path, path, "-n", "2", "-L", link, "-p", "1:0:0:100", (char *)NULL );
+        fprintf( stderr, "Failed to start %s: %s\n", path, strerror( errno ) );
+        _exit( 1 );
+    }
+
+    for ( waited = 0; waited < TEST_SIM_WAIT_MS; waited += 10 )
+    {
+        struct stat st;
+
+        if ( waitpid( pid, NULL, WNOHANG ) == pid )
+        {
+            return -1;
+        }
+        if ( lstat( link, &st ) == 0 )
+        {
+            return pid;
+        }
+        usleep( 10000 );
+    }
+
+    return pid;
+}
+
+// ----------------------------------------------------------- check
+static int check
+(
+    bool       ok,
+    const char *what
+)
+{
+    printf( "%s: %s\n", ok ? "ok  " : "FAIL", what );
+    return ok ? 0 : 1;
+}
+
+// ----------------------------------------------------------- main
+int main
+(
+    int  argc,
+    char **argv
+)
+{
+    const char          *sim = ( argc > 1 ) ? argv[1] : "./server";
+    char                link[64];
+    modbusHealthStats_t before;
+    modbusHealthStats_t after;
+    uint16_t            reg;
+    pid_t               pid;
+    int                 dev;
+    int                 failed = 0;
+    int                 rc;
+    int                 err;
+
+#ifdef MODBUS_TCP
+    printf( "RTU only, the line semaphore is what is tested\n" );
+    return 0;
+#endif
+
+    snprintf( link, sizeof( link ), "/tmp/modbus_health_test_tty.%d", (int)getpid() );
+
+    pid = startSimulator( sim, link );
+    if ( pid == -1 )
+    {
+        fprintf( stderr, "Simulator %s did not come up\n", sim );
+        return 1;
+    }
+
+    sem_init( &test_sem, 0, 1 );
+    modbusHealthConfigure( 1, TEST_PROBE_MS );
+    if ( modbusSystemInit( &test_sem, 2, 0, link, 0 ) != 0 )
+    {
+        fprintf( stderr, "modbusSystemInit failed\n" );
+        kill( pid, SIGTERM );
+        return 1;
+    }
+
+    dev = modbusDeviceId( TEST_DEAD_BBU );
+
+    // one timeout trips the breaker
+    rc = modbusDeviceReadHoldingRegisters( dev, 0, 1, &reg );
+    modbusHealthGetStats( dev, &before );
+    failed += check( rc == -1 && before.state == MODBUS_HEALTH_DOWN, "dead slave is DOWN" );
+
+    // due for probes while another process holds the line, past the
+    // semaphore timeout. Whether the probe thread's probe or one of ours
+    // got admitted, it fails with EBUSY off the wire
+    sem_wait( &test_sem );
+    modbusHealthGetStats( dev, &before );
+    usleep( 2 * TEST_PROBE_MS * 1000 );
+    rc  = modbusDeviceReadHoldingRegisters( dev, 0, 1, &reg );
+    err = errno;
+    usleep( ( MAX_MODBUS_TIMEOUT * 1000 + 2 * TEST_PROBE_MS ) * 1000 );
+    modbusHealthGetStats( dev, &after );
+    failed += check( rc == -1 && ( err == EBUSY || err == MODBUS_EDOWN ), "no request gets through while the line is held" );
+    failed += check( after.cancelled > before.cancelled, "a probe failed with EBUSY and was cancelled" );
+    sem_post( &test_sem );
+
+    // a slave left PROBING is never probed again, a DOWN one is
+    modbusHealthGetStats( dev, &before );
+    usleep( 10 * TEST_PROBE_MS * 1000 );
+    modbusHealthGetStats( dev, &after );
+    failed += check( after.probes > before.probes && after.state != MODBUS_HEALTH_UP,
+                     "probing resumes once the line is free" );
+
+    kill( pid, SIGTERM );
+    waitpid( pid, NULL, 0 );
+
+    printf( "%s\n", failed ? "FAILED" : "PASSED" );
+    return failed ? 1 : 0;
+}
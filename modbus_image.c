@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_cache.h"
+#include "modbus_image.h"
+
+// --------------------------------------------------------- Static Variables
+static modbusImage_t   *image = NULL;
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;   // publisher side, one writer per block
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- unitBytes
+static int unitBytes
+(
+    int fc
+)
+{
+    return ( fc == MODBUS_FC_READ_COILS || fc == MODBUS_FC_READ_DISCRETE_INPUTS ) ? sizeof( uint8_t ) : sizeof( uint16_t );
+}
+
+// Writes land in the block read by the matching read function code
+// ----------------------------------------------------------- imageFc
+static int imageFc
+(
+    int fc
+)
+{
+    switch ( fc )
+    {
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return MODBUS_FC_READ_HOLDING_REGISTERS;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            return MODBUS_FC_READ_COILS;
+        default:
+            return fc;
+    }
+}
+
+// Seqlock write side, readers retry while seq is odd or moved
+// ----------------------------------------------------------- beginWrite
+static void beginWrite
+(
+    modbusImageBlock_t *b
+)
+{
+    __atomic_store_n( &b->seq, b->seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+// ----------------------------------------------------------- endWrite
+static void endWrite
+(
+    modbusImageBlock_t *b
+)
+{
+    __atomic_store_n( &b->seq, b->seq + 1, __ATOMIC_RELEASE );
+}
+
+// ----------------------------------------------------------- modbusImageCreate
+int modbusImageCreate
+(
+    const char *shmName
+)
+{
+    modbusImage_t *shm;
+    int           fd;
+
+    if ( shmName == NULL )
+    {
+        TLE( "shmName == NULL" );
+        return -1;
+    }
+
+    if ( image != NULL )
+    {
+        TLE( "Image already created" );
+        return -1;
+    }
+
+    fd = shm_open( shmName, O_CREAT | O_RDWR, 0644 );
+    if ( fd == -1 )
+    {
+        TLE( "shm_open %s failed, errno = %d", shmName, errno );
+        return -1;
+    }
+
+    if ( ftruncate( fd, sizeof( modbusImage_t ) ) != 0 )
+    {
+        TLE( "ftruncate %s failed, errno = %d", shmName, errno );
+        close( fd );
+        return -1;
+    }
+
+    shm = mmap( NULL, sizeof( modbusImage_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( shm == MAP_FAILED )
+    {
+        TLE( "mmap %s failed, errno = %d", shmName, errno );
+        return -1;
+    }
+
+    // a previous publisher's blocks are gone, so are readers' indexes
+    memset( shm, 0, sizeof( modbusImage_t ) );
+    shm->version = MODBUS_IMAGE_VERSION;
+    shm->size    = sizeof( modbusImage_t );
+    shm->pid     = (uint32_t)getpid();
+    __atomic_store_n( &shm->magic, MODBUS_IMAGE_MAGIC, __ATOMIC_RELEASE );
+    __atomic_store_n( &image, shm, __ATOMIC_RELEASE );
+
+    TLV( "Modbus image published to %s, %zu bytes", shmName, sizeof( modbusImage_t ) );
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusImageAddBlock
+int modbusImageAddBlock
+(
+    int id,
+    int fc,
+    int addr,
+    int count
+)
+{
+    modbusImageBlock_t *b;
+    int                n;
+
+    if ( fc != MODBUS_FC_READ_HOLDING_REGISTERS && fc != MODBUS_FC_READ_INPUT_REGISTERS &&
+         fc != MODBUS_FC_READ_COILS && fc != MODBUS_FC_READ_DISCRETE_INPUTS )
+    {
+        TLE( "Image blocks are read function codes, fc = %d", fc );
+        return -1;
+    }
+
+    if ( 0 >= count || count * unitBytes( fc ) > MODBUS_IMAGE_MAX_BYTES || 0 > addr || addr + count > 0x10000 )
+    {
+        TLE( "Bad image block, addr = %d, count = %d", addr, count );
+        return -1;
+    }
+
+    pthread_mutex_lock( &image_lock );
+
+    if ( image == NULL || image->nblocks == MODBUS_IMAGE_MAX_BLOCKS )
+    {
+        pthread_mutex_unlock( &image_lock );
+        TLE( "No image or out of blocks, max = %d", MODBUS_IMAGE_MAX_BLOCKS );
+        return -1;
+    }
+
+    n = image->nblocks;
+    b = &image->blocks[n];
+    memset( b, 0, sizeof( *b ) );
+    b->id     = id;
+    b->fc     = fc;
+    b->addr   = addr;
+    b->count  = count;
+    b->status = ENODATA;
+    __atomic_store_n( &image->nblocks, n + 1, __ATOMIC_RELEASE );
+
+    pthread_mutex_unlock( &image_lock );
+
+    TLV( "Image block %d: id = %d, fc = %d, addr = %d, count = %d", n, id, fc, addr, count );
+    return n;
+}
+
+// Reads refresh the blocks they cover completely, a failed one leaves
+// the data and records err. Writes refresh the part they overlap
+// ----------------------------------------------------------- modbusImageUpdate
+void modbusImageUpdate
+(
+    int        id,
+    int        fc,
+    int        addr,
+    int        count,
+    const void *src,
+    int        err
+)
+{
+    modbusImage_t      *img = __atomic_load_n( &image, __ATOMIC_ACQUIRE );
+    const bool         write = ( imageFc( fc ) != fc );
+    modbusImageBlock_t *b;
+    int                unit;
+    int                from;
+    int                to;
+    int                n;
+    int                i;
+
+    if ( img == NULL )
+    {
+        return;
+    }
+
+    fc   = imageFc( fc );
+    unit = unitBytes( fc );
+    n    = __atomic_load_n( &img->nblocks, __ATOMIC_ACQUIRE );
+
+    pthread_mutex_lock( &image_lock );
+    for ( i = 0; i < n; i++ )
+    {
+        b = &img->blocks[i];
+        if ( b->fc != fc || ( b->id != id && id != MODBUS_CACHE_ALL_IDS ) )
+        {
+            continue;
+        }
+
+        from = ( addr > b->addr ) ? addr : b->addr;
+        to   = ( addr + count < b->addr + b->count ) ? addr + count : b->addr + b->count;
+        if ( from >= to || ( !write && ( from != b->addr || to != b->addr + b->count ) ) )
+        {
+            continue;
+        }
+
+        if ( write && err != 0 )
+        {
+            // what the BBU holds now is unknown, it will be read again
+            continue;
+        }
+
+        beginWrite( b );
+        if ( err == 0 )
+        {
+            memcpy( &b->data[( from - b->addr ) * unit], (const uint8_t *)src + ( from - addr ) * unit, ( to - from ) * unit );
+            if ( !write )
+            {
+                b->updatedUs = modbusMonotonicUs();
+                b->updates++;
+            }
+        }
+        if ( !write )
+        {
+            b->status = err;
+        }
+        endWrite( b );
+    }
+    pthread_mutex_unlock( &image_lock );
+}
+
+// ----------------------------------------------------------- modbusImageOpen
+const modbusImage_t *modbusImageOpen
+(
+    const char *shmName
+)
+{
+    modbusImage_t *shm;
+    int           fd;
+
+    fd = shm_open( shmName, O_RDONLY, 0 );
+    if ( fd == -1 )
+    {
+        TLE( "shm_open %s failed, errno = %d", shmName, errno );
+        return NULL;
+    }
+
+    shm = mmap( NULL, sizeof( modbusImage_t ), PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( shm == MAP_FAILED )
+    {
+        TLE( "mmap %s failed, errno = %d", shmName, errno );
+        return NULL;
+    }
+
+    if ( __atomic_load_n( &shm->magic, __ATOMIC_ACQUIRE ) != MODBUS_IMAGE_MAGIC ||
+         shm->version != MODBUS_IMAGE_VERSION || shm->size != sizeof( modbusImage_t ) )
+    {
+        TLE( "%s is not a modbus image of this version", shmName );
+        munmap( shm, sizeof( modbusImage_t ) );
+        return NULL;
+    }
+
+    return shm;
+}
+
+// ----------------------------------------------------------- modbusImageFind
+int modbusImageFind
+(
+    const modbusImage_t *img,
+    int                 id,
+    int                 fc,
+    int                 addr
+)
+{
+    const int n = __atomic_load_n( &img->nblocks, __ATOMIC_ACQUIRE );
+    int       i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( img->blocks[i].id == id && img->blocks[i].fc == fc && img->blocks[i].addr == addr )
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// ----------------------------------------------------------- modbusImageRead
+int modbusImageRead
+(
+    const modbusImage_t *img,
+    int                 block,
+    void                *dest,
+    modbusImageInfo_t   *info
+)
+{
+    const modbusImageBlock_t *b;
+    modbusImageInfo_t        copy;
+    uint32_t                 seq;
+
+    if ( 0 > block || block >= (int)__atomic_load_n( &img->nblocks, __ATOMIC_ACQUIRE ) )
+    {
+        return -1;
+    }
+
+    b = &img->blocks[block];
+    do
+    {
+        // an odd seq is a write in progress, it is a memcpy long
+        while ( ( seq = __atomic_load_n( &b->seq, __ATOMIC_ACQUIRE ) ) & 1 )
+        {
+        }
+
+        copy.id        = b->id;
+        copy.fc        = b->fc;
+        copy.addr      = b->addr;
+        copy.count     = b->count;
+        copy.status    = b->status;
+        copy.updatedUs = b->updatedUs;
+        copy.updates   = b->updates;
+        if ( dest != NULL )
+        {
+            memcpy( dest, b->data, b->count * unitBytes( b->fc ) );
+        }
+
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    } while ( __atomic_load_n( &b->seq, __ATOMIC_RELAXED ) != seq );
+
+    if ( info != NULL )
+    {
+        *info = copy;
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Register image in shared memory. The process owning the bus publishes
+ * the latest values of configured register/bit blocks, every block under
+ * its own sequence lock, so other processes take consistent snapshots
+ * without a syscall, modbus_sem or the wire
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_IMAGE_MAGIC      ( 0x4d42494d )    // "MBIM"
+#define MODBUS_IMAGE_VERSION    ( 1 )
+#define MODBUS_IMAGE_SHM_NAME   "/modbus_image"
+#define MODBUS_IMAGE_MAX_BLOCKS ( 64 )
+#define MODBUS_IMAGE_MAX_BYTES  ( 2 * MODBUS_MAX_READ_REGISTERS )  // 125 registers or 250 bits
+
+// ------------------------------------------------------------------ Type Definitions
+
+// seq is odd while the publisher writes the block. id/fc/addr/count never
+// change once the block is counted in nblocks
+typedef struct{
+    uint32_t seq;
+    int32_t  id;          // as modbusDeviceId()
+    int32_t  fc;          // read function code
+    int32_t  addr;
+    int32_t  count;
+    int32_t  status;      // 0 or errno of the latest read of the block
+    uint64_t updatedUs;   // CLOCK_MONOTONIC of the latest good read, 0: never
+    uint64_t updates;
+    uint8_t  data[MODBUS_IMAGE_MAX_BYTES];   // uint16_t per register, uint8_t per bit
+} modbusImageBlock_t;
+
+typedef struct{
+    uint32_t           magic;
+    uint32_t           version;
+    uint32_t           size;
+    uint32_t           pid;
+    uint32_t           nblocks;
+    modbusImageBlock_t blocks[MODBUS_IMAGE_MAX_BLOCKS];
+} modbusImage_t;
+
+// Copy of a block header, see modbusImageRead
+typedef struct{
+    int      id;
+    int      fc;
+    int      addr;
+    int      count;
+    int      status;
+    uint64_t updatedUs;
+    uint64_t updates;
+} modbusImageInfo_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// Publisher. Creates the image in POSIX shared memory shmName (e.g.
+// MODBUS_IMAGE_SHM_NAME), from then on every completed read that covers
+// a block refreshes it, writes refresh what they overlap. Blocks can be
+// added at any time, returns the block index
+int  modbusImageCreate  ( const char *shmName );
+int  modbusImageAddBlock( int id, int fc, int addr, int count );
+
+// Readers, any process. Open maps the image read only
+const modbusImage_t *modbusImageOpen ( const char *shmName );
+int                  modbusImageFind ( const modbusImage_t *img, int id, int fc, int addr );
+// Consistent snapshot of block into dest (count units) and info, either
+// may be NULL. -1 if there is no such block
+int                  modbusImageRead ( const modbusImage_t *img, int block, void *dest, modbusImageInfo_t *info );
+
+// Used by the adaptor, id MODBUS_CACHE_ALL_IDS for a broadcast
+void modbusImageUpdate  ( int id, int fc, int addr, int count, const void *src, int err );
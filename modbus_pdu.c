@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <modbus.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_pdu.h"
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- put16
+static void put16
+(
+    uint8_t  *p,
+    int      v
+)
+{
+    p[0] = (uint8_t)( v >> 8 );
+    p[1] = (uint8_t)v;
+}
+
+// ----------------------------------------------------------- get16
+static int get16
+(
+    const uint8_t *p
+)
+{
+    return ( p[0] << 8 ) | p[1];
+}
+
+// ----------------------------------------------------------- modbusPduEncodeRequest
+int modbusPduEncodeRequest
+(
+    uint8_t    *pdu,
+    int        size,
+    int        fc,
+    int        addr,
+    int        count,
+    const void *src
+)
+{
+    const uint8_t  *bits = (const uint8_t *)src;
+    const uint16_t *regs = (const uint16_t *)src;
+    int            bytes;
+    int            i;
+
+    if ( size < 5 )
+    {
+        return -1;
+    }
+
+    pdu[0] = (uint8_t)fc;
+    put16( &pdu[1], addr );
+    put16( &pdu[3], count );
+
+    switch ( fc )
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return 5;
+
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            bytes = ( count + 7 ) / 8;
+            if ( size < 6 + bytes )
+            {
+                return -1;
+            }
+            pdu[5] = (uint8_t)bytes;
+            memset( &pdu[6], 0, bytes );
+            for ( i = 0; i < count; i++ )
+            {
+                if ( bits[i] )
+                {
+                    pdu[6 + i / 8] |= (uint8_t)( 1 << ( i % 8 ) );
+                }
+            }
+            return 6 + bytes;
+
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            bytes = 2 * count;
+            if ( size < 6 + bytes )
+            {
+                return -1;
+            }
+            pdu[5] = (uint8_t)bytes;
+            for ( i = 0; i < count; i++ )
+            {
+                put16( &pdu[6 + 2 * i], regs[i] );
+            }
+            return 6 + bytes;
+
+        default:
+            TLE( "Can't encode function code = %d", fc );
+            return -1;
+    }
+}
+
+// ----------------------------------------------------------- modbusPduDecodeResponse
+int modbusPduDecodeResponse
+(
+    const uint8_t *pdu,
+    int           len,
+    int           fc,
+    int           addr,
+    int           count,
+    void          *dest
+)
+{
+    uint8_t  *bits = (uint8_t *)dest;
+    uint16_t *regs = (uint16_t *)dest;
+    int      i;
+
+    if ( len >= 2 && pdu[0] == ( fc | 0x80 ) )
+    {
+        errno = MODBUS_ENOBASE + pdu[1];
+        return -1;
+    }
+
+    if ( len < 2 || pdu[0] != fc )
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    switch ( fc )
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            if ( pdu[1] != ( count + 7 ) / 8 || len != 2 + pdu[1] )
+            {
+                break;
+            }
+            for ( i = 0; i < count; i++ )
+            {
+                bits[i] = ( pdu[2 + i / 8] >> ( i % 8 ) ) & 1;
+            }
+            return count;
+
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            if ( pdu[1] != 2 * count || len != 2 + pdu[1] )
+            {
+                break;
+            }
+            for ( i = 0; i < count; i++ )
+            {
+                regs[i] = (uint16_t)get16( &pdu[2 + 2 * i] );
+            }
+            return count;
+
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            if ( len != 5 || get16( &pdu[1] ) != addr || get16( &pdu[3] ) != count )
+            {
+                break;
+            }
+            // what modbusWriteBits/modbusWriteHoldingRegisters return
+            return ( fc == MODBUS_FC_WRITE_MULTIPLE_COILS ) ? count : 0;
+
+        default:
+            break;
+    }
+
+    errno = EMBBADDATA;
+    return -1;
+}
+
+// ----------------------------------------------------------- modbusPduEncodeWriteRead
+int modbusPduEncodeWriteRead
+(
+    uint8_t        *pdu,
+    int            size,
+    int            readAddr,
+    int            readCount,
+    int            writeAddr,
+    int            writeCount,
+    const uint16_t *src
+)
+{
+    const int bytes = 2 * writeCount;
+    int       i;
+
+    if ( size < 10 + bytes )
+    {
+        return -1;
+    }
+
+    pdu[0] = MODBUS_FC_WRITE_AND_READ_REGISTERS;
+    put16( &pdu[1], readAddr );
+    put16( &pdu[3], readCount );
+    put16( &pdu[5], writeAddr );
+    put16( &pdu[7], writeCount );
+    pdu[9] = (uint8_t)bytes;
+    for ( i = 0; i < writeCount; i++ )
+    {
+        put16( &pdu[10 + 2 * i], src[i] );
+    }
+
+    return 10 + bytes;
+}
+
+// ----------------------------------------------------------- modbusTcpEncodeHeader
+int modbusTcpEncodeHeader
+(
+    uint8_t    *adu,
+    uint16_t   tid,
+    int        unit,
+    int        pduLen
+)
+{
+    put16( &adu[0], tid );
+    put16( &adu[2], 0 );          // protocol id
+    put16( &adu[4], pduLen + 1 ); // unit id + PDU
+    adu[6] = (uint8_t)unit;
+
+    return MODBUS_MBAP_LENGTH + pduLen;
+}
+
+// ----------------------------------------------------------- modbusTcpAduLength
+int modbusTcpAduLength
+(
+    const uint8_t *buf,
+    int           have
+)
+{
+    int len;
+
+    if ( have < MODBUS_MBAP_LENGTH )
+    {
+        return 0;
+    }
+
+    len = 6 + get16( &buf[4] );
+    if ( get16( &buf[2] ) != 0 || len < MODBUS_MBAP_LENGTH + 1 || len > MODBUS_TCP_MAX_ADU_LENGTH )
+    {
+        return -1;
+    }
+
+    return len;
+}
+
+// ----------------------------------------------------------- modbusTcpTid
+uint16_t modbusTcpTid
+(
+    const uint8_t *adu
+)
+{
+    return (uint16_t)get16( adu );
+}
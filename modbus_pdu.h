@@ -0,0 +1,41 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Modbus PDU/ADU encoding for the paths that don't go through libmodbus'
+ * blocking calls, e.g. pipelined TCP. Covers the function codes the
+ * adaptor sends, data layouts are libmodbus' (one byte per bit)
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_MBAP_LENGTH   ( 7 )
+#define MODBUS_TCP_UNIT_ID   ( 0xFF )   // libmodbus' default for TCP contexts
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// Request PDU (function code + data) into pdu, returns its length or -1
+int      modbusPduEncodeRequest ( uint8_t *pdu, int size, int fc, int addr, int count, const void *src );
+
+// Checks a response PDU against its request. Returns what the libmodbus
+// call would: count for reads, FC15 and FC23, 0 for FC16. -1 with errno set to
+// MODBUS_ENOBASE + exception code, or EMBBADDATA if it doesn't match
+int      modbusPduDecodeResponse( const uint8_t *pdu, int len, int fc, int addr, int count, void *dest );
+
+// FC23 request PDU, the write is done before the read. Decode the
+// response with fc MODBUS_FC_WRITE_AND_READ_REGISTERS and the read half
+int      modbusPduEncodeWriteRead( uint8_t *pdu, int size, int readAddr, int readCount,
+                                   int writeAddr, int writeCount, const uint16_t *src );
+
+// MBAP header in front of the pduLen bytes already at adu +
+// MODBUS_MBAP_LENGTH, returns the ADU length
+int      modbusTcpEncodeHeader  ( uint8_t *adu, uint16_t tid, int unit, int pduLen );
+
+// Length of the ADU at the start of buf, 0 if more bytes are needed to
+// tell, -1 if it isn't a Modbus TCP ADU
+int      modbusTcpAduLength     ( const uint8_t *buf, int have );
+uint16_t modbusTcpTid           ( const uint8_t *adu );
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "modbus_ring.h"
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- modbusRingInit
+void modbusRingInit
+(
+    modbusRing_t *ring
+)
+{
+    int i;
+
+    for ( i = 0; i < MODBUS_RING_SIZE; i++ )
+    {
+        ring->slots[i].seq  = i;
+        ring->slots[i].item = NULL;
+    }
+    ring->enqueuePos = 0;
+    ring->dequeuePos = 0;
+}
+
+// The consumer frees slots in order, so once the last of the n slots
+// is free for this lap all of them are. Claim them with one CAS, then
+// publish each
+// ----------------------------------------------------------- modbusRingPush
+int modbusRingPush
+(
+    modbusRing_t *ring,
+    void * const *items,
+    int          n
+)
+{
+    uint64_t pos = __atomic_load_n( &ring->enqueuePos, __ATOMIC_RELAXED );
+    uint64_t seq;
+    int64_t  diff;
+    int      i;
+
+    if ( 0 >= n || n > MODBUS_RING_SIZE )
+    {
+        errno = ( n > MODBUS_RING_SIZE ) ? EAGAIN : EINVAL;
+        return -1;
+    }
+
+    while ( 1 )
+    {
+        seq  = __atomic_load_n( &ring->slots[( pos + n - 1 ) & MODBUS_RING_MASK].seq, __ATOMIC_ACQUIRE );
+        diff = (int64_t)( seq - ( pos + n - 1 ) );
+
+        if ( diff == 0 )
+        {
+            if ( __atomic_compare_exchange_n( &ring->enqueuePos, &pos, pos + n, true,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                break;
+            }
+            // pos was reloaded by the failed CAS
+        }
+        else if ( diff < 0 )
+        {
+            // still holds an item of the previous lap
+            errno = EAGAIN;
+            return -1;
+        }
+        else
+        {
+            // another producer got there first
+            pos = __atomic_load_n( &ring->enqueuePos, __ATOMIC_RELAXED );
+        }
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        modbusRingSlot_t *slot = &ring->slots[( pos + i ) & MODBUS_RING_MASK];
+
+        slot->item = items[i];
+        __atomic_store_n( &slot->seq, pos + i + 1, __ATOMIC_RELEASE );
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusRingPop
+void *modbusRingPop
+(
+    modbusRing_t *ring
+)
+{
+    const uint64_t   pos  = ring->dequeuePos;
+    modbusRingSlot_t *slot = &ring->slots[pos & MODBUS_RING_MASK];
+    void             *item;
+
+    if ( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) != pos + 1 )
+    {
+        return NULL;
+    }
+
+    item = slot->item;
+    __atomic_store_n( &slot->seq, pos + MODBUS_RING_SIZE, __ATOMIC_RELEASE );
+    ring->dequeuePos = pos + 1;
+
+    return item;
+}
+
+// ----------------------------------------------------------- modbusRingEmpty
+bool modbusRingEmpty
+(
+    modbusRing_t *ring
+)
+{
+    const uint64_t pos = ring->dequeuePos;
+
+    return __atomic_load_n( &ring->slots[pos & MODBUS_RING_MASK].seq, __ATOMIC_ACQUIRE ) != pos + 1;
+}
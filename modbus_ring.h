@@ -0,0 +1,45 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Bounded lock-free ring of pointers, any number of producers and one
+ * consumer. Submitting never takes a lock or enters the kernel, a full
+ * ring is reported instead of waited for
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include <stdbool.h>
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_RING_SIZE ( 256 )   // power of 2
+#define MODBUS_RING_MASK ( MODBUS_RING_SIZE - 1 )
+
+// ------------------------------------------------------------------ Type Definitions
+
+// seq tells whose turn a slot is: pos when free for the producer of
+// position pos, pos + 1 once that producer published item
+typedef struct{
+    uint64_t seq;
+    void     *item;
+} modbusRingSlot_t;
+
+typedef struct{
+    uint64_t         enqueuePos __attribute__(( aligned( 64 ) ));
+    uint64_t         dequeuePos __attribute__(( aligned( 64 ) ));   // consumer only
+    modbusRingSlot_t slots[MODBUS_RING_SIZE];
+} modbusRing_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+void  modbusRingInit ( modbusRing_t *ring );
+
+// Producers. Queues items[0..n) in consecutive slots, all or nothing:
+// -1 with errno EAGAIN if they don't fit
+int   modbusRingPush ( modbusRing_t *ring, void * const *items, int n );
+
+// Consumer. NULL when empty, or while the oldest slot is claimed but not
+// yet published, its producer signals once it is
+void *modbusRingPop  ( modbusRing_t *ring );
+bool  modbusRingEmpty( modbusRing_t *ring );
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_rto.h"
+
+// --------------------------------------------------------- Type Definitions
+typedef struct{
+    uint32_t srttUs;
+    uint32_t rttvarUs;
+    uint32_t backoff;
+    uint64_t samples;
+    uint64_t timeouts;
+} rtoState_t;
+
+// ---------------------------------------------------------------- Constants
+#define RTO_MAX_BACKOFF ( 16 )
+
+// --------------------------------------------------------- Static Variables
+static rtoState_t      slaves[MODBUS_RTO_MAX_SLAVES];
+static uint32_t        floor_us = MODBUS_RTO_DEFAULT_FLOOR_US;
+static uint32_t        ceil_us  = MODBUS_RTO_DEFAULT_CEIL_US;
+static pthread_mutex_t rto_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ----------------------------------------------------------- Implementation
+
+// Caller holds rto_lock
+// ----------------------------------------------------------- computeRto
+static uint32_t computeRto
+(
+    const rtoState_t *s
+)
+{
+    uint64_t margin;
+    uint64_t rto;
+
+    // no estimate yet, be patient rather than fail a healthy slave
+    if ( s->samples == 0 )
+    {
+        return ceil_us;
+    }
+
+    // the floor is the least margin over SRTT (RFC 6298's G), a steady
+    // slave drives RTTVAR to ~0 and any scheduling hiccup would time out
+    margin = 4 * (uint64_t)s->rttvarUs;
+    if ( margin < floor_us )
+    {
+        margin = floor_us;
+    }
+
+    rto = (uint64_t)s->srttUs + margin;
+    rto <<= s->backoff;
+
+    if ( rto > ceil_us )
+    {
+        rto = ceil_us;
+    }
+
+    return (uint32_t)rto;
+}
+
+// ----------------------------------------------------------- validSlave
+static bool validSlave
+(
+    int slave
+)
+{
+    return 0 <= slave && slave < MODBUS_RTO_MAX_SLAVES;
+}
+
+// ----------------------------------------------------------- modbusRtoSetBounds
+int modbusRtoSetBounds
+(
+    uint32_t floorUs,
+    uint32_t ceilUs
+)
+{
+    pthread_mutex_lock( &rto_lock );
+
+    if ( ( floorUs ? floorUs : floor_us ) > ( ceilUs ? ceilUs : ceil_us ) )
+    {
+        pthread_mutex_unlock( &rto_lock );
+        TLE( "RTO floor above ceiling, floor = %u us, ceiling = %u us", floorUs, ceilUs );
+        return -1;
+    }
+
+    if ( floorUs != 0 )
+    {
+        floor_us = floorUs;
+    }
+    if ( ceilUs != 0 )
+    {
+        ceil_us = ceilUs;
+    }
+
+    pthread_mutex_unlock( &rto_lock );
+
+    TLV( "RTO bounds: floor = %u us, ceiling = %u us", floor_us, ceil_us );
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusRtoTimeoutUs
+uint32_t modbusRtoTimeoutUs
+(
+    int slave
+)
+{
+    uint32_t rto;
+
+    if ( !validSlave( slave ) )
+    {
+        return ceil_us;
+    }
+
+    pthread_mutex_lock( &rto_lock );
+    rto = computeRto( &slaves[slave] );
+    pthread_mutex_unlock( &rto_lock );
+
+    return rto;
+}
+
+// A response arrived rttUs after the request, RFC 6298 2.2/2.3
+// ----------------------------------------------------------- modbusRtoSample
+void modbusRtoSample
+(
+    int      slave,
+    uint32_t rttUs
+)
+{
+    rtoState_t *s;
+    uint32_t   delta;
+
+    if ( !validSlave( slave ) )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &rto_lock );
+    s = &slaves[slave];
+
+    if ( s->samples == 0 )
+    {
+        s->srttUs   = rttUs;
+        s->rttvarUs = rttUs / 2;
+    }
+    else
+    {
+        delta       = ( s->srttUs > rttUs ) ? s->srttUs - rttUs : rttUs - s->srttUs;
+        s->rttvarUs = ( 3 * s->rttvarUs + delta ) / 4;
+        s->srttUs   = ( 7 * s->srttUs + rttUs ) / 8;
+    }
+
+    s->samples++;
+    s->backoff = 0;
+    pthread_mutex_unlock( &rto_lock );
+}
+
+// No sample from a timed out request, back off instead (RFC 6298 5.5)
+// ----------------------------------------------------------- modbusRtoTimedOut
+void modbusRtoTimedOut
+(
+    int slave
+)
+{
+    rtoState_t *s;
+
+    if ( !validSlave( slave ) )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &rto_lock );
+    s = &slaves[slave];
+    s->timeouts++;
+    if ( s->backoff < RTO_MAX_BACKOFF )
+    {
+        s->backoff++;
+    }
+    pthread_mutex_unlock( &rto_lock );
+}
+
+// ----------------------------------------------------------- modbusRtoGetStats
+int modbusRtoGetStats
+(
+    int              slave,
+    modbusRtoStats_t *stats
+)
+{
+    rtoState_t *s;
+
+    if ( stats == NULL || !validSlave( slave ) )
+    {
+        TLE( "Bad RTO stats request, slave = %d", slave );
+        return -1;
+    }
+
+    pthread_mutex_lock( &rto_lock );
+    s = &slaves[slave];
+    stats->srttUs   = s->srttUs;
+    stats->rttvarUs = s->rttvarUs;
+    stats->rtoUs    = computeRto( s );
+    stats->backoff  = s->backoff;
+    stats->samples  = s->samples;
+    stats->timeouts = s->timeouts;
+    pthread_mutex_unlock( &rto_lock );
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Adaptive response timeouts, a smoothed round trip estimate per slave
+ * (SRTT/RTTVAR as in RFC 6298) sets the timeout of every transaction
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_RTO_MAX_SLAVES       ( MODBUS_MAX_SLAVE_ID + 1 )  // TCP uses the BBU index
+#define MODBUS_RTO_DEFAULT_FLOOR_US ( 2000 )       // least margin over SRTT
+#define MODBUS_RTO_DEFAULT_CEIL_US  ( 200000 )   // also used until the first sample
+
+// ------------------------------------------------------------------ Type Definitions
+typedef struct{
+    uint32_t srttUs;     // 0 until the first sample
+    uint32_t rttvarUs;
+    uint32_t rtoUs;      // current timeout, backoff included
+    uint32_t backoff;    // consecutive timeouts, each doubles rtoUs
+    uint64_t samples;
+    uint64_t timeouts;
+} modbusRtoStats_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// 0 keeps the current value. RTU: the bounds apply to the slave's
+// turnaround, the frames' time on the wire is added on top
+int      modbusRtoSetBounds( uint32_t floorUs, uint32_t ceilUs );
+int      modbusRtoGetStats ( int slave, modbusRtoStats_t *stats );
+
+// Used by the bus threads
+uint32_t modbusRtoTimeoutUs( int slave );
+void     modbusRtoSample   ( int slave, uint32_t rttUs );
+void     modbusRtoTimedOut ( int slave );
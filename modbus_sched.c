@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_sched.h"
+
+// --------------------------------------------------------- Type Definitions
+typedef struct{
+    bool                 used;
+    int                  id;
+    int                  fc;
+    int                  addr;
+    int                  count;
+    int                  busId;
+    uint64_t             periodUs;
+    uint64_t             costUs;          // estimated bus time of one poll
+    uint64_t             offsetUs;        // phase within the period
+    uint64_t             nextReleaseUs;
+    uint64_t             releasedUs;      // release time of the poll in flight
+    uint64_t             lastDoneUs;
+    bool                 inFlight;
+    void                 *dest;
+    modbusScanCallback_t cb;
+    void                 *arg;
+    modbusRequest_t      req;
+    modbusScanStats_t    stats;
+} scanGroup_t;
+
+// --------------------------------------------------------- Static Variables
+static scanGroup_t     groups[MODBUS_SCAN_MAX_GROUPS];
+static uint64_t        bus_load_ppm[MODBUS_MAX_BUSES];   // sum of cost / period
+static uint64_t        bus_phase_us[MODBUS_MAX_BUSES];   // next free slot
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  scan_cond;
+static pthread_once_t  scan_once = PTHREAD_ONCE_INIT;
+static pthread_t       scan_thread;
+static bool            scan_running = false;
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- deadlineToTimespec
+static void deadlineToTimespec
+(
+    uint64_t        us,
+    struct timespec *ts
+)
+{
+    ts->tv_sec  = us / 1000000;
+    ts->tv_nsec = ( us % 1000000 ) * 1000;
+}
+
+// scan_cond waits on CLOCK_MONOTONIC
+// ----------------------------------------------------------- scanInitOnce
+static void scanInitOnce
+(
+)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &scan_cond, &attr );
+    pthread_condattr_destroy( &attr );
+}
+
+// Runs on the bus thread
+// ----------------------------------------------------------- scanDone
+static void scanDone
+(
+    modbusRequest_t *req,
+    void            *arg
+)
+{
+    scanGroup_t    *g   = ( scanGroup_t* )arg;
+    const uint64_t now  = modbusMonotonicUs();
+    const int      rc   = req->rc;
+    uint64_t       latency;
+    uint64_t       interval;
+    uint64_t       jitter;
+
+    // before clearing inFlight, nobody writes dest until then
+    if ( g->cb != NULL )
+    {
+        g->cb( (int)( g - groups ), rc, g->dest, g->arg );
+    }
+
+    pthread_mutex_lock( &scan_lock );
+
+    g->stats.polls++;
+    if ( rc == -1 )
+    {
+        g->stats.errors++;
+    }
+
+    latency = now - g->releasedUs;
+    g->stats.lastLatencyUs = (uint32_t)latency;
+    if ( latency > g->stats.maxLatencyUs )
+    {
+        g->stats.maxLatencyUs = (uint32_t)latency;
+    }
+
+    if ( g->lastDoneUs != 0 )
+    {
+        interval = now - g->lastDoneUs;
+        jitter   = ( interval > g->periodUs ) ? interval - g->periodUs : g->periodUs - interval;
+
+        g->stats.lastJitterUs = (uint32_t)jitter;
+        if ( jitter > g->stats.maxJitterUs )
+        {
+            g->stats.maxJitterUs = (uint32_t)jitter;
+        }
+    }
+    g->lastDoneUs = now;
+    g->inFlight   = false;
+
+    pthread_mutex_unlock( &scan_lock );
+}
+
+// Caller holds scan_lock
+// ----------------------------------------------------------- releaseGroup
+static void releaseGroup
+(
+    scanGroup_t *g,
+    uint64_t    now
+)
+{
+    int rc;
+
+    if ( g->inFlight )
+    {
+        // bus could not keep up, skip this release instead of queueing
+        // behind ourselves
+        g->stats.overruns++;
+        if ( g->stats.overruns == 1 )
+        {
+            TLE( "Scan group %d overrun, id = %d, fc = %d, addr = %d, period = %llu us",
+                (int)( g - groups ), g->id, g->fc, g->addr, (unsigned long long)g->periodUs );
+        }
+    }
+    else
+    {
+        g->inFlight   = true;
+        g->releasedUs = now;
+
+        rc = modbusSubmitRead( &g->req, g->id, g->fc, g->addr, g->count, g->dest, scanDone, g );
+        if ( rc != 0 )
+        {
+            g->inFlight = false;
+            g->stats.errors++;
+        }
+    }
+
+    g->nextReleaseUs += g->periodUs;
+
+    // we fell more than a period behind, drop the missed releases
+    while ( g->nextReleaseUs <= now )
+    {
+        g->nextReleaseUs += g->periodUs;
+        g->stats.overruns++;
+    }
+}
+
+// ----------------------------------------------------------- scanThread
+static void *scanThread
+(
+    void *arg
+)
+{
+    struct timespec ts;
+    scanGroup_t     *next;
+    uint64_t        now;
+    int             i;
+
+    // polls give way to control traffic, aging keeps them coming
+    modbusSetThreadPriority( MODBUS_PRIO_BACKGROUND );
+
+    pthread_mutex_lock( &scan_lock );
+    while ( 1 )
+    {
+        next = NULL;
+        for ( i = 0; i < MODBUS_SCAN_MAX_GROUPS; i++ )
+        {
+            if ( groups[i].used && ( next == NULL || groups[i].nextReleaseUs < next->nextReleaseUs ) )
+            {
+                next = &groups[i];
+            }
+        }
+
+        if ( next == NULL )
+        {
+            pthread_cond_wait( &scan_cond, &scan_lock );
+            continue;
+        }
+
+        now = modbusMonotonicUs();
+        if ( next->nextReleaseUs > now )
+        {
+            // also woken up when a group is added
+            deadlineToTimespec( next->nextReleaseUs, &ts );
+            pthread_cond_timedwait( &scan_cond, &scan_lock, &ts );
+            continue;
+        }
+
+        releaseGroup( next, now );
+    }
+
+    pthread_mutex_unlock( &scan_lock );
+    return NULL;
+}
+
+// Registers a scan group, dest must hold count registers/bits and stays
+// owned by the scheduler. Polls of groups on the same bus are phase shifted
+// so their releases do not collide. Fails if the bus would be loaded above
+// MODBUS_SCAN_MAX_LOAD_PCT. Returns the group handle
+// ----------------------------------------------------------- modbusScanAddGroup
+int modbusScanAddGroup
+(
+    int                  id,
+    int                  fc,
+    int                  addr,
+    int                  count,
+    uint32_t             periodMs,
+    void                 *dest,
+    modbusScanCallback_t cb,
+    void                 *arg
+)
+{
+    scanGroup_t *g = NULL;
+    uint64_t    costUs;
+    uint64_t    loadPpm;
+    int         busId;
+    int         i;
+
+    if ( dest == NULL || periodMs == 0 )
+    {
+        TLE( "dest == NULL or period == 0" );
+        return -1;
+    }
+
+    if ( fc != MODBUS_FC_READ_HOLDING_REGISTERS && fc != MODBUS_FC_READ_INPUT_REGISTERS &&
+         fc != MODBUS_FC_READ_COILS && fc != MODBUS_FC_READ_DISCRETE_INPUTS )
+    {
+        TLE( "Can only scan reads, fc = %d", fc );
+        return -1;
+    }
+
+    busId = modbusGetBusId( id );
+    if ( busId < 0 )
+    {
+        return -1;
+    }
+
+    pthread_once( &scan_once, scanInitOnce );
+
+    costUs  = modbusTransactionTimeUs( id, fc, count );
+    loadPpm = ( costUs * 1000000 ) / ( (uint64_t)periodMs * 1000 );
+
+    pthread_mutex_lock( &scan_lock );
+
+    if ( bus_load_ppm[busId] + loadPpm > MODBUS_SCAN_MAX_LOAD_PCT * 10000 )
+    {
+        TLE( "Scan group overruns bus %d, load would be %llu%% (max %d%%), id = %d, addr = %d, period = %u ms",
+            busId, (unsigned long long)( ( bus_load_ppm[busId] + loadPpm ) / 10000 ),
+            MODBUS_SCAN_MAX_LOAD_PCT, id, addr, periodMs );
+        pthread_mutex_unlock( &scan_lock );
+        return -1;
+    }
+
+    for ( i = 0; i < MODBUS_SCAN_MAX_GROUPS; i++ )
+    {
+        if ( !groups[i].used )
+        {
+            g = &groups[i];
+            break;
+        }
+    }
+
+    if ( g == NULL )
+    {
+        TLE( "Out of scan groups, max = %d", MODBUS_SCAN_MAX_GROUPS );
+        pthread_mutex_unlock( &scan_lock );
+        return -1;
+    }
+
+    memset( g, 0, sizeof( *g ) );
+    g->used     = true;
+    g->id       = id;
+    g->fc       = fc;
+    g->addr     = addr;
+    g->count    = count;
+    g->busId    = busId;
+    g->periodUs = (uint64_t)periodMs * 1000;
+    g->costUs   = costUs;
+    g->dest     = dest;
+    g->cb       = cb;
+    g->arg      = arg;
+
+    // time slice: each group gets the next free slot of its bus
+    g->offsetUs          = bus_phase_us[busId] % g->periodUs;
+    bus_phase_us[busId] += costUs;
+    bus_load_ppm[busId] += loadPpm;
+
+    g->nextReleaseUs = modbusMonotonicUs() + g->offsetUs;
+
+    TLV( "Scan group %d: id = %d, fc = %d, addr = %d, count = %d, period = %u ms, offset = %llu us, bus %d load = %llu ppm",
+        i, id, fc, addr, count, periodMs, (unsigned long long)g->offsetUs, busId,
+        (unsigned long long)bus_load_ppm[busId] );
+
+    pthread_cond_signal( &scan_cond );
+    pthread_mutex_unlock( &scan_lock );
+
+    return i;
+}
+
+// ----------------------------------------------------------- modbusScanStart
+int modbusScanStart
+(
+)
+{
+    uint64_t now;
+    int      rc;
+    int      i;
+
+    pthread_once( &scan_once, scanInitOnce );
+
+    pthread_mutex_lock( &scan_lock );
+    if ( scan_running )
+    {
+        pthread_mutex_unlock( &scan_lock );
+        TLE( "Scan scheduler already running" );
+        return -1;
+    }
+
+    // groups registered before start keep their phase relative to now
+    now = modbusMonotonicUs();
+    for ( i = 0; i < MODBUS_SCAN_MAX_GROUPS; i++ )
+    {
+        groups[i].nextReleaseUs = now + groups[i].offsetUs;
+    }
+
+    rc = pthread_create( &scan_thread, NULL, scanThread, NULL );
+    if ( rc != 0 )
+    {
+        pthread_mutex_unlock( &scan_lock );
+        TLE( "Failed to create scan thread, rc = %d", rc );
+        return -1;
+    }
+
+    scan_running = true;
+    pthread_mutex_unlock( &scan_lock );
+
+    return 0;
+}
+
+// ----------------------------------------------------------- modbusScanGetStats
+int modbusScanGetStats
+(
+    int               group,
+    modbusScanStats_t *stats
+)
+{
+    if ( 0 > group || group >= MODBUS_SCAN_MAX_GROUPS || stats == NULL )
+    {
+        TLE( "Bad scan group = %d", group );
+        return -1;
+    }
+
+    pthread_mutex_lock( &scan_lock );
+    if ( !groups[group].used )
+    {
+        pthread_mutex_unlock( &scan_lock );
+        return -1;
+    }
+
+    *stats = groups[group].stats;
+    pthread_mutex_unlock( &scan_lock );
+
+    return 0;
+}
+
+// Scheduled load of a bus in percent
+// ----------------------------------------------------------- modbusScanGetLoad
+int modbusScanGetLoad
+(
+    int busId
+)
+{
+    int load;
+
+    if ( 0 > busId || busId >= MODBUS_MAX_BUSES )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock( &scan_lock );
+    load = (int)( bus_load_ppm[busId] / 10000 );
+    pthread_mutex_unlock( &scan_lock );
+
+    return load;
+}
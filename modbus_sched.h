@@ -0,0 +1,40 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Periodic poll scheduler, polls registered scan groups
+ * (BBU id, function code, address range, period) through
+ * the asynchronous adaptor API
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_SCAN_MAX_GROUPS   ( 64 )
+#define MODBUS_SCAN_MAX_LOAD_PCT ( 80 )  // leave room for unscheduled traffic
+
+// ------------------------------------------------------------------ Type Definitions
+
+// Called from the bus thread after every poll of a group, must not block
+typedef void ( *modbusScanCallback_t )( int group, int rc, void *dest, void *arg );
+
+typedef struct{
+    uint32_t polls;
+    uint32_t errors;
+    uint32_t overruns;       // releases skipped, previous poll still pending
+    uint32_t lastLatencyUs;  // release -> completion
+    uint32_t maxLatencyUs;
+    uint32_t lastJitterUs;   // |completion interval - period|
+    uint32_t maxJitterUs;
+} modbusScanStats_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+int modbusScanAddGroup( int id, int fc, int addr, int count, uint32_t periodMs, void *dest,
+                        modbusScanCallback_t cb, void *arg );
+int modbusScanStart   ( );
+int modbusScanGetStats( int group, modbusScanStats_t *stats );
+int modbusScanGetLoad ( int busId );
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+// termios2/BOTHER, must not be mixed with <termios.h> in one unit
+#include <asm/termbits.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_serial.h"
+
+// ---------------------------------------------------------------- Constants
+// the rates _modbus_rtu_connect() knows on every Linux build
+static const int standard_bauds[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- modbusSerialIsStandardBaud
+bool modbusSerialIsStandardBaud
+(
+    int baud
+)
+{
+    unsigned i;
+
+    for ( i = 0; i < sizeof( standard_bauds ) / sizeof( standard_bauds[0] ); i++ )
+    {
+        if ( standard_bauds[i] == baud )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------- modbusSerialSetCustomBaud
+int modbusSerialSetCustomBaud
+(
+    int fd,
+    int baud
+)
+{
+    struct termios2 tio;
+
+    if ( ioctl( fd, TCGETS2, &tio ) != 0 )
+    {
+        TLE( "TCGETS2 failed, fd = %d, errno = %d", fd, errno );
+        return -1;
+    }
+
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag |= BOTHER;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+
+    if ( ioctl( fd, TCSETS2, &tio ) != 0 )
+    {
+        TLE( "TCSETS2 failed, fd = %d, baud = %d, errno = %d", fd, baud, errno );
+        return -1;
+    }
+
+    TLV( "Custom baud rate %d set on fd = %d", baud, fd );
+    return 0;
+}
@@ -0,0 +1,21 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Serial line helpers for RTU, line rates libmodbus has no termios
+ * constant for
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdbool.h>
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// True if libmodbus maps baud to a termios Bxxx constant itself
+bool modbusSerialIsStandardBaud( int baud );
+
+// Sets an arbitrary line rate on an open tty, libmodbus falls back to
+// 9600 for rates it does not know. Returns 0 or -1 with errno set
+int  modbusSerialSetCustomBaud ( int fd, int baud );
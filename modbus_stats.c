@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_stats.h"
+
+// --------------------------------------------------------- Static Variables
+// megabytes with a set per slave id, zero initialized to stay out of
+// the binary, the header is filled by modbusStatsGet
+static modbusStatsBlock_t local_block;
+static modbusStatsBlock_t *blk = &local_block;
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- histBucket
+static int histBucket
+(
+    uint64_t us
+)
+{
+    int msb;
+
+    if ( us < ( 1 << MODBUS_HIST_SUB_BITS ) )
+    {
+        return (int)us;
+    }
+
+    msb = 63 - __builtin_clzll( us );
+    if ( msb > 31 )
+    {
+        return MODBUS_HIST_BUCKETS - 1;
+    }
+
+    return ( ( msb - MODBUS_HIST_SUB_BITS + 1 ) << MODBUS_HIST_SUB_BITS ) +
+           (int)( ( us >> ( msb - MODBUS_HIST_SUB_BITS ) ) & ( ( 1 << MODBUS_HIST_SUB_BITS ) - 1 ) );
+}
+
+// Largest value that lands in bucket
+// ----------------------------------------------------------- histBucketMaxUs
+static uint64_t histBucketMaxUs
+(
+    int bucket
+)
+{
+    const int sub = bucket & ( ( 1 << MODBUS_HIST_SUB_BITS ) - 1 );
+    const int msb = ( bucket >> MODBUS_HIST_SUB_BITS ) + MODBUS_HIST_SUB_BITS - 1;
+
+    if ( bucket < ( 1 << MODBUS_HIST_SUB_BITS ) )
+    {
+        return bucket;
+    }
+
+    return ( ( (uint64_t)( ( 1 << MODBUS_HIST_SUB_BITS ) + sub + 1 ) ) << ( msb - MODBUS_HIST_SUB_BITS ) ) - 1;
+}
+
+// ----------------------------------------------------------- modbusHistAdd
+void modbusHistAdd
+(
+    modbusHist_t *h,
+    uint64_t     us
+)
+{
+    uint64_t max = __atomic_load_n( &h->maxUs, __ATOMIC_RELAXED );
+
+    __atomic_fetch_add( &h->buckets[histBucket( us )], 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &h->count, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &h->sumUs, us, __ATOMIC_RELAXED );
+
+    while ( us > max &&
+            !__atomic_compare_exchange_n( &h->maxUs, &max, us, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    {
+    }
+}
+
+// ----------------------------------------------------------- modbusStatsFcSlot
+int modbusStatsFcSlot
+(
+    int fc
+)
+{
+    switch ( fc )
+    {
+        case MODBUS_FC_READ_COILS:               return 0;
+        case MODBUS_FC_READ_DISCRETE_INPUTS:     return 1;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:   return 2;
+        case MODBUS_FC_READ_INPUT_REGISTERS:     return 3;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:     return 4;
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: return 5;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS: return 6;
+        default:                                 return MODBUS_STATS_FC_SLOTS - 1;
+    }
+}
+
+// ----------------------------------------------------------- modbusStatsSlaveSlot
+int modbusStatsSlaveSlot
+(
+    int slave
+)
+{
+    if ( 0 <= slave && slave < MODBUS_STATS_SLAVE_SLOTS - 1 )
+    {
+        return slave;
+    }
+
+    return MODBUS_STATS_SLAVE_SLOTS - 1;
+}
+
+// ----------------------------------------------------------- modbusStatsRecord
+void modbusStatsRecord
+(
+    int              fc,
+    int              slave,
+    modbusHistKind_t kind,
+    uint64_t         us
+)
+{
+    modbusStatsBlock_t *b = __atomic_load_n( &blk, __ATOMIC_ACQUIRE );
+
+    modbusHistAdd( &b->byFc[modbusStatsFcSlot( fc )].hist[kind], us );
+    modbusHistAdd( &b->bySlave[modbusStatsSlaveSlot( slave )].hist[kind], us );
+}
+
+// err is errno of a failed transaction, 0 on success
+// ----------------------------------------------------------- modbusStatsRecordFrame
+void modbusStatsRecordFrame
+(
+    int      busId,
+    int      fc,
+    int      slave,
+    uint64_t wireUs,
+    int      txBytes,
+    int      rxBytes,
+    int      err
+)
+{
+    modbusStatsBlock_t *b = __atomic_load_n( &blk, __ATOMIC_ACQUIRE );
+    modbusStatsSet_t   *set[2];
+    int                i;
+
+    set[0] = &b->byFc[modbusStatsFcSlot( fc )];
+    set[1] = &b->bySlave[modbusStatsSlaveSlot( slave )];
+
+    for ( i = 0; i < 2; i++ )
+    {
+        __atomic_fetch_add( &set[i]->frames, 1, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &set[i]->txBytes, txBytes, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &set[i]->rxBytes, rxBytes, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &set[i]->busyUs, wireUs, __ATOMIC_RELAXED );
+
+        if ( err != 0 )
+        {
+            __atomic_fetch_add( &set[i]->errors, 1, __ATOMIC_RELAXED );
+        }
+        if ( err == ETIMEDOUT )
+        {
+            __atomic_fetch_add( &set[i]->timeouts, 1, __ATOMIC_RELAXED );
+        }
+        if ( err == EMBBADCRC )
+        {
+            __atomic_fetch_add( &set[i]->crcErrors, 1, __ATOMIC_RELAXED );
+        }
+
+        modbusHistAdd( &set[i]->hist[MODBUS_HIST_WIRE], wireUs );
+    }
+
+    if ( 0 <= busId && busId < MODBUS_MAX_BUSES )
+    {
+        __atomic_fetch_add( &b->busBusyUs[busId], wireUs, __ATOMIC_RELAXED );
+    }
+}
+
+// ----------------------------------------------------------- modbusStatsGet
+const modbusStatsBlock_t *modbusStatsGet
+(
+)
+{
+    modbusStatsBlock_t *b = __atomic_load_n( &blk, __ATOMIC_ACQUIRE );
+
+    if ( b->startUs == 0 )
+    {
+        b->magic   = MODBUS_STATS_MAGIC;
+        b->version = MODBUS_STATS_VERSION;
+        b->size    = sizeof( modbusStatsBlock_t );
+        b->startUs = modbusMonotonicUs();
+    }
+
+    return b;
+}
+
+// p in [0, 1], e.g. 0.999. Returns the upper bound of the bucket
+// ----------------------------------------------------------- modbusHistPercentileUs
+uint64_t modbusHistPercentileUs
+(
+    const modbusHist_t *h,
+    double             p
+)
+{
+    const uint64_t count = __atomic_load_n( &h->count, __ATOMIC_RELAXED );
+    uint64_t       rank;
+    uint64_t       seen = 0;
+    int            i;
+
+    if ( count == 0 )
+    {
+        return 0;
+    }
+
+    rank = (uint64_t)( p * count + 0.5 );
+    if ( rank == 0 )
+    {
+        rank = 1;
+    }
+
+    for ( i = 0; i < MODBUS_HIST_BUCKETS; i++ )
+    {
+        seen += __atomic_load_n( &h->buckets[i], __ATOMIC_RELAXED );
+        if ( seen >= rank )
+        {
+            const uint64_t maxUs = __atomic_load_n( &h->maxUs, __ATOMIC_RELAXED );
+            const uint64_t upper = histBucketMaxUs( i );
+            return ( upper < maxUs ) ? upper : maxUs;
+        }
+    }
+
+    return __atomic_load_n( &h->maxUs, __ATOMIC_RELAXED );
+}
+
+// Share of the time since start the bus spent in transactions
+// ----------------------------------------------------------- modbusStatsDutyPpm
+uint32_t modbusStatsDutyPpm
+(
+    int busId
+)
+{
+    const modbusStatsBlock_t *b = modbusStatsGet();
+    const uint64_t           elapsed = modbusMonotonicUs() - b->startUs;
+
+    if ( 0 > busId || busId >= MODBUS_MAX_BUSES || elapsed == 0 )
+    {
+        return 0;
+    }
+
+    return (uint32_t)( ( __atomic_load_n( &b->busBusyUs[busId], __ATOMIC_RELAXED ) * 1000000 ) / elapsed );
+}
+
+// ----------------------------------------------------------- modbusStatsExport
+int modbusStatsExport
+(
+    const char *shmName
+)
+{
+    modbusStatsBlock_t *shm;
+    int                fd;
+
+    if ( shmName == NULL )
+    {
+        TLE( "shmName == NULL" );
+        return -1;
+    }
+
+    if ( blk != &local_block )
+    {
+        TLE( "Stats already exported" );
+        return -1;
+    }
+
+    fd = shm_open( shmName, O_CREAT | O_RDWR, 0644 );
+    if ( fd == -1 )
+    {
+        TLE( "shm_open %s failed, errno = %d", shmName, errno );
+        return -1;
+    }
+
+    if ( ftruncate( fd, sizeof( modbusStatsBlock_t ) ) != 0 )
+    {
+        TLE( "ftruncate %s failed, errno = %d", shmName, errno );
+        close( fd );
+        return -1;
+    }
+
+    shm = mmap( NULL, sizeof( modbusStatsBlock_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( shm == MAP_FAILED )
+    {
+        TLE( "mmap %s failed, errno = %d", shmName, errno );
+        return -1;
+    }
+
+    modbusStatsGet();
+    memcpy( shm, &local_block, sizeof( modbusStatsBlock_t ) );
+    shm->pid = (uint32_t)getpid();
+    __atomic_store_n( &blk, shm, __ATOMIC_RELEASE );
+
+    TLV( "Modbus stats exported to %s, %zu bytes", shmName, sizeof( modbusStatsBlock_t ) );
+    return 0;
+}
+
+// A request with a deadline that was dropped unsent, or finished late
+// ----------------------------------------------------------- modbusStatsRecordMissed
+void modbusStatsRecordMissed
+(
+    int  fc,
+    int  slave,
+    bool dropped
+)
+{
+    modbusStatsBlock_t *b = __atomic_load_n( &blk, __ATOMIC_ACQUIRE );
+
+    if ( dropped )
+    {
+        __atomic_fetch_add( &b->byFc[modbusStatsFcSlot( fc )].dropped, 1, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &b->bySlave[modbusStatsSlaveSlot( slave )].dropped, 1, __ATOMIC_RELAXED );
+    }
+    else
+    {
+        __atomic_fetch_add( &b->byFc[modbusStatsFcSlot( fc )].late, 1, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &b->bySlave[modbusStatsSlaveSlot( slave )].late, 1, __ATOMIC_RELAXED );
+    }
+}
@@ -0,0 +1,87 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Bus instrumentation, lock free latency histograms and wire counters
+ * per function code and per slave. The block can live in shared memory
+ * so a separate tool reads it without going near modbus_sem
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_STATS_MAGIC       ( 0x4d425354 )    // "MBST"
+#define MODBUS_STATS_VERSION     ( 3 )
+#define MODBUS_STATS_SHM_NAME    "/modbus_stats"
+
+// Log-linear buckets of microseconds: exact below 8, then 8 buckets per
+// power of two (12.5% resolution) up to 2^32 us
+#define MODBUS_HIST_SUB_BITS     ( 3 )
+#define MODBUS_HIST_BUCKETS      ( ( 32 - MODBUS_HIST_SUB_BITS + 1 ) << MODBUS_HIST_SUB_BITS )
+
+#define MODBUS_STATS_FC_SLOTS    ( 8 )                          // the seven we send + other
+#define MODBUS_STATS_SLAVE_SLOTS ( MODBUS_MAX_SLAVE_ID + 2 )    // ids 0..247 (TCP units 1..247) + other
+
+// ------------------------------------------------------------------ Type Definitions
+typedef enum{
+    MODBUS_HIST_QUEUE = 0,   // submitted -> picked up by the bus thread
+    MODBUS_HIST_SEM,         // waiting for modbus_sem (RTU)
+    MODBUS_HIST_WIRE,        // request sent -> response parsed
+    MODBUS_HIST_TOTAL,       // submitted -> completed, per caller
+    MODBUS_HIST_COUNT
+} modbusHistKind_t;
+
+typedef struct{
+    uint64_t count;
+    uint64_t sumUs;
+    uint64_t maxUs;
+    uint64_t buckets[MODBUS_HIST_BUCKETS];
+} modbusHist_t;
+
+typedef struct{
+    uint64_t     frames;       // transactions on the wire
+    uint64_t     errors;
+    uint64_t     timeouts;
+    uint64_t     crcErrors;
+    uint64_t     txBytes;      // ADU bytes
+    uint64_t     rxBytes;
+    uint64_t     busyUs;       // wire time
+    uint64_t     dropped;      // past their deadline in the queue, never sent
+    uint64_t     late;         // completed after their deadline
+    modbusHist_t hist[MODBUS_HIST_COUNT];
+} modbusStatsSet_t;
+
+// Every field is only ever updated with atomic adds, readers see torn
+// totals at worst, never torn values
+typedef struct{
+    uint32_t         magic;
+    uint32_t         version;
+    uint32_t         size;
+    uint32_t         pid;
+    uint64_t         startUs;                           // CLOCK_MONOTONIC
+    uint64_t         busBusyUs[MODBUS_MAX_BUSES];
+    modbusStatsSet_t byFc[MODBUS_STATS_FC_SLOTS];
+    modbusStatsSet_t bySlave[MODBUS_STATS_SLAVE_SLOTS];
+} modbusStatsBlock_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// Moves the block to POSIX shared memory name (e.g. MODBUS_STATS_SHM_NAME),
+// call before modbusSystemInit. Counts so far are carried over
+int                       modbusStatsExport     ( const char *shmName );
+const modbusStatsBlock_t *modbusStatsGet        ( );
+int                       modbusStatsFcSlot     ( int fc );
+int                       modbusStatsSlaveSlot  ( int slave );
+void                      modbusHistAdd         ( modbusHist_t *h, uint64_t us );
+uint64_t                  modbusHistPercentileUs( const modbusHist_t *h, double p );
+uint32_t                  modbusStatsDutyPpm    ( int busId );
+
+// Used by the bus threads
+void modbusStatsRecord     ( int fc, int slave, modbusHistKind_t kind, uint64_t us );
+void modbusStatsRecordFrame( int busId, int fc, int slave, uint64_t wireUs, int txBytes, int rxBytes, int err );
+void modbusStatsRecordMissed( int fc, int slave, bool dropped );
@@ -0,0 +1,577 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "tracelog.h"
+#include "debug.h"
+#include "modbus_adaptor.h"
+#include "modbus_wcomb.h"
+
+// --------------------------------------------------------- Type Definitions
+typedef struct{
+    int             id;
+    int             addr;
+    int             count;
+    uint64_t        deadlineUs;
+    uint64_t        flushAtUs;     // 0 == nothing to flush
+    pthread_mutex_t flushLock;     // one flush at a time, held across the wire
+    uint16_t        *pending;      // what the application wants
+    uint16_t        *acked;        // what the BBU acknowledged
+    uint16_t        *sending;      // snapshot of pending for the flush in progress
+    uint8_t         *known;        // acked[] is valid
+    uint8_t         *dirty;        // pending[] differs from acked[]
+    modbusWcStats_t stats;
+} wcRange_t;
+
+typedef struct{
+    int addr;    // relative to the range
+    int count;
+} wcSpan_t;
+
+// ---------------------------------------------------------------- Constants
+#define WC_MAX_FRAMES ( 32 )   // per flush, the rest goes with the next one
+
+// --------------------------------------------------------- Static Variables
+static wcRange_t       ranges[MODBUS_WC_MAX_RANGES];
+static int             num_ranges = 0;      // ranges are never removed, written under wc_lock
+static pthread_mutex_t wc_lock = PTHREAD_MUTEX_INITIALIZER;   // guards all range state
+static pthread_cond_t  wc_cond;
+static pthread_once_t  wc_once = PTHREAD_ONCE_INIT;
+static pthread_t       wc_thread;
+
+// ----------------------------------------------------------- Forward Declarations
+static void *wcFlushThread( void *arg );
+
+// ----------------------------------------------------------- Implementation
+
+// ----------------------------------------------------------- wcInitOnce
+static void wcInitOnce
+(
+)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &wc_cond, &attr );
+    pthread_condattr_destroy( &attr );
+
+    if ( pthread_create( &wc_thread, NULL, wcFlushThread, NULL ) != 0 )
+    {
+        TLE( "Failed to create write combine flush thread" );
+        ABORT_ALWAYS();
+    }
+}
+
+// Dirty registers grouped into frames. A clean hole between two dirty
+// spans is written again (with its acknowledged value) when that is
+// cheaper than another frame. Caller holds wc_lock
+// ----------------------------------------------------------- planSpans
+static int planSpans
+(
+    wcRange_t *r,
+    wcSpan_t  *spans,
+    int       max
+)
+{
+    const uint32_t frameCostUs = modbusTransactionTimeUs( r->id, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, 0 );
+    const uint32_t regCostNs   = (uint32_t)( ( (uint64_t)( modbusTransactionTimeUs( r->id, MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+                                     MODBUS_MAX_WRITE_REGISTERS ) - frameCostUs ) * 1000 ) / MODBUS_MAX_WRITE_REGISTERS );
+    wcSpan_t       *cur = NULL;
+    int            n    = 0;
+    int            end;
+    int            i;
+    int            j;
+    bool           fill;
+
+    for ( i = 0; i < r->count; i++ )
+    {
+        if ( !r->dirty[i] )
+        {
+            continue;
+        }
+
+        if ( cur != NULL )
+        {
+            end = cur->addr + cur->count;
+
+            // hole must be known to be rewritten as is
+            fill = ( i - end ) * (uint64_t)regCostNs < (uint64_t)frameCostUs * 1000 &&
+                   i + 1 - cur->addr <= MODBUS_MAX_WRITE_REGISTERS;
+            for ( j = end; fill && j < i; j++ )
+            {
+                fill = r->known[j];
+            }
+
+            if ( fill )
+            {
+                cur->count = i + 1 - cur->addr;
+                continue;
+            }
+        }
+
+        if ( n == max )
+        {
+            // rest goes with the next flush
+            break;
+        }
+
+        cur        = &spans[n++];
+        cur->addr  = i;
+        cur->count = 1;
+    }
+
+    return n;
+}
+
+// Sends all dirty registers of r, blocking. Caller holds r->flushLock
+// ----------------------------------------------------------- flushRange
+static int flushRange
+(
+    wcRange_t *r
+)
+{
+    wcSpan_t        spans[WC_MAX_FRAMES];
+    int             result[WC_MAX_FRAMES];
+    modbusRequest_t req;
+    int             ret = 0;
+    int             nspans;
+    int             i;
+    int             j;
+
+    pthread_mutex_lock( &wc_lock );
+    nspans = planSpans( r, spans, WC_MAX_FRAMES );
+    memcpy( r->sending, r->pending, r->count * sizeof( uint16_t ) );
+    for ( i = 0; i < nspans; i++ )
+    {
+        // holes carry the acknowledged value, not a pending change
+        for ( j = spans[i].addr; j < spans[i].addr + spans[i].count; j++ )
+        {
+            if ( !r->dirty[j] )
+            {
+                r->sending[j] = r->acked[j];
+            }
+        }
+    }
+    r->flushAtUs = 0;
+    pthread_mutex_unlock( &wc_lock );
+
+    for ( i = 0; i < nspans; i++ )
+    {
+        result[i] = modbusSubmitWrite( &req, r->id, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, r->addr + spans[i].addr,
+                                       spans[i].count, &r->sending[spans[i].addr], NULL, NULL );
+        if ( result[i] == 0 )
+        {
+            result[i] = modbusWaitRequest( &req );
+        }
+    }
+
+    pthread_mutex_lock( &wc_lock );
+    for ( i = 0; i < nspans; i++ )
+    {
+        r->stats.frames++;
+
+        if ( result[i] == -1 )
+        {
+            r->stats.errors++;
+            ret = -1;
+            continue;
+        }
+
+        r->stats.regsSent += spans[i].count;
+        for ( j = spans[i].addr; j < spans[i].addr + spans[i].count; j++ )
+        {
+            r->acked[j] = r->sending[j];
+            r->known[j] = 1;
+            // may have changed again while we were on the wire
+            r->dirty[j] = ( r->pending[j] != r->acked[j] );
+        }
+    }
+
+    // anything left (failed frames, new changes) goes with the next
+    // deadline, without one the next write retries
+    for ( i = 0; r->deadlineUs != 0 && i < r->count; i++ )
+    {
+        if ( r->dirty[i] )
+        {
+            r->flushAtUs = modbusMonotonicUs() + r->deadlineUs;
+            pthread_cond_signal( &wc_cond );
+            break;
+        }
+    }
+    pthread_mutex_unlock( &wc_lock );
+
+    return ret;
+}
+
+// ----------------------------------------------------------- wcFlushThread
+static void *wcFlushThread
+(
+    void *arg
+)
+{
+    struct timespec ts;
+    wcRange_t       *next;
+    uint64_t        now;
+    int             i;
+
+    pthread_mutex_lock( &wc_lock );
+    while ( 1 )
+    {
+        next = NULL;
+        for ( i = 0; i < num_ranges; i++ )
+        {
+            if ( ranges[i].flushAtUs != 0 && ( next == NULL || ranges[i].flushAtUs < next->flushAtUs ) )
+            {
+                next = &ranges[i];
+            }
+        }
+
+        if ( next == NULL )
+        {
+            pthread_cond_wait( &wc_cond, &wc_lock );
+            continue;
+        }
+
+        now = modbusMonotonicUs();
+        if ( next->flushAtUs > now )
+        {
+            ts.tv_sec  = next->flushAtUs / 1000000;
+            ts.tv_nsec = ( next->flushAtUs % 1000000 ) * 1000;
+            pthread_cond_timedwait( &wc_cond, &wc_lock, &ts );
+            continue;
+        }
+
+        pthread_mutex_unlock( &wc_lock );
+        pthread_mutex_lock( &next->flushLock );
+        flushRange( next );
+        pthread_mutex_unlock( &next->flushLock );
+        pthread_mutex_lock( &wc_lock );
+    }
+
+    pthread_mutex_unlock( &wc_lock );
+    return NULL;
+}
+
+// ----------------------------------------------------------- modbusWcAddRange
+int modbusWcAddRange
+(
+    int      id,
+    int      addr,
+    int      count,
+    uint32_t deadlineMs
+)
+{
+    wcRange_t *r;
+    int       handle;
+
+    if ( 0 >= count || 0 > addr || addr + count > 0x10000 )
+    {
+        TLE( "Bad write combine range, addr = %d, count = %d", addr, count );
+        return -1;
+    }
+
+    if ( modbusGetBusId( id ) < 0 )
+    {
+        return -1;
+    }
+
+    pthread_once( &wc_once, wcInitOnce );
+
+    pthread_mutex_lock( &wc_lock );
+
+    if ( num_ranges == MODBUS_WC_MAX_RANGES )
+    {
+        pthread_mutex_unlock( &wc_lock );
+        TLE( "Out of write combine ranges, max = %d", MODBUS_WC_MAX_RANGES );
+        return -1;
+    }
+
+    r = &ranges[num_ranges];
+    memset( r, 0, sizeof( *r ) );
+
+    r->id         = id;
+    r->addr       = addr;
+    r->count      = count;
+    r->deadlineUs = (uint64_t)deadlineMs * 1000;
+    r->pending    = calloc( count, sizeof( uint16_t ) );
+    r->acked      = calloc( count, sizeof( uint16_t ) );
+    r->sending    = calloc( count, sizeof( uint16_t ) );
+    r->known      = calloc( count, sizeof( uint8_t ) );
+    r->dirty      = calloc( count, sizeof( uint8_t ) );
+
+    if ( r->pending == NULL || r->acked == NULL || r->sending == NULL || r->known == NULL || r->dirty == NULL )
+    {
+        free( r->pending );
+        free( r->acked );
+        free( r->sending );
+        free( r->known );
+        free( r->dirty );
+        pthread_mutex_unlock( &wc_lock );
+        TLE( "Failed to allocate write combine range, count = %d", count );
+        return -1;
+    }
+
+    pthread_mutex_init( &r->flushLock, NULL );
+
+    handle = num_ranges;
+    __atomic_store_n( &num_ranges, num_ranges + 1, __ATOMIC_RELEASE );
+
+    pthread_mutex_unlock( &wc_lock );
+
+    TLV( "Write combine range %d: id = %d, addr = %d, count = %d, deadline = %u ms", handle, id, addr, count, deadlineMs );
+    return handle;
+}
+
+// ----------------------------------------------------------- modbusWcWrite
+bool modbusWcWrite
+(
+    int            id,
+    int            addr,
+    int            count,
+    const uint16_t *src,
+    int            *rc
+)
+{
+    wcRange_t *r = NULL;
+    bool      changed = false;
+    int       i;
+    int       j;
+
+    if ( __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        return false;
+    }
+
+    pthread_mutex_lock( &wc_lock );
+    for ( i = 0; i < num_ranges; i++ )
+    {
+        if ( ranges[i].id == id && addr >= ranges[i].addr && addr + count <= ranges[i].addr + ranges[i].count )
+        {
+            r = &ranges[i];
+            break;
+        }
+    }
+
+    if ( r == NULL )
+    {
+        pthread_mutex_unlock( &wc_lock );
+        return false;
+    }
+
+    r->stats.writes++;
+    r->stats.regsWritten += count;
+
+    for ( i = 0; i < count; i++ )
+    {
+        j = addr - r->addr + i;
+
+        r->pending[j] = src[i];
+        if ( r->known[j] && r->pending[j] == r->acked[j] )
+        {
+            r->stats.regsSuppressed++;
+            r->dirty[j] = 0;
+        }
+        else
+        {
+            r->dirty[j] = 1;
+            changed     = true;
+        }
+    }
+
+    if ( changed && r->deadlineUs != 0 && r->flushAtUs == 0 )
+    {
+        r->flushAtUs = modbusMonotonicUs() + r->deadlineUs;
+        pthread_cond_signal( &wc_cond );
+    }
+    pthread_mutex_unlock( &wc_lock );
+
+    *rc = 0;
+    if ( changed && r->deadlineUs == 0 )
+    {
+        pthread_mutex_lock( &r->flushLock );
+        *rc = flushRange( r );
+        pthread_mutex_unlock( &r->flushLock );
+    }
+
+    return true;
+}
+
+// Flushes every range of id now, MODBUS_WC_ALL_IDS for all of them
+// ----------------------------------------------------------- modbusWcFlush
+int modbusWcFlush
+(
+    int id
+)
+{
+    const int n = __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE );
+    int       ret = 0;
+    int       i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( id != MODBUS_WC_ALL_IDS && ranges[i].id != id )
+        {
+            continue;
+        }
+
+        pthread_mutex_lock( &ranges[i].flushLock );
+        if ( flushRange( &ranges[i] ) != 0 )
+        {
+            ret = -1;
+        }
+        pthread_mutex_unlock( &ranges[i].flushLock );
+    }
+
+    return ret;
+}
+
+// ----------------------------------------------------------- overlaps
+static bool overlaps
+(
+    const wcRange_t *r,
+    int             id,
+    int             addr,
+    int             count
+)
+{
+    return r->id == id && addr < r->addr + r->count && r->addr < addr + count;
+}
+
+// Flushes the ranges of id overlapping [addr, addr + count) that have
+// changes pending, nothing to do is the common case
+// ----------------------------------------------------------- modbusWcFlushOverlap
+int modbusWcFlushOverlap
+(
+    int id,
+    int addr,
+    int count
+)
+{
+    const int n = __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE );
+    bool      dirty;
+    int       ret = 0;
+    int       i;
+    int       j;
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( !overlaps( &ranges[i], id, addr, count ) )
+        {
+            continue;
+        }
+
+        pthread_mutex_lock( &wc_lock );
+        for ( j = 0, dirty = false; j < ranges[i].count && !dirty; j++ )
+        {
+            dirty = ranges[i].dirty[j];
+        }
+        pthread_mutex_unlock( &wc_lock );
+
+        if ( !dirty )
+        {
+            continue;
+        }
+
+        pthread_mutex_lock( &ranges[i].flushLock );
+        if ( flushRange( &ranges[i] ) != 0 )
+        {
+            ret = -1;
+        }
+        pthread_mutex_unlock( &ranges[i].flushLock );
+    }
+
+    return ret;
+}
+
+// A direct write went past the combiner. What it wrote is what the BBU
+// holds now, a failed one leaves those registers unknown
+// ----------------------------------------------------------- modbusWcWritten
+void modbusWcWritten
+(
+    int            id,
+    int            addr,
+    int            count,
+    const uint16_t *src,
+    bool           ok
+)
+{
+    wcRange_t *r;
+    int       i;
+    int       j;
+
+    if ( __atomic_load_n( &num_ranges, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &wc_lock );
+    for ( i = 0; i < num_ranges; i++ )
+    {
+        r = &ranges[i];
+        if ( !overlaps( r, id, addr, count ) )
+        {
+            continue;
+        }
+
+        for ( j = ( addr > r->addr ) ? addr - r->addr : 0; j < r->count && r->addr + j < addr + count; j++ )
+        {
+            r->pending[j] = src[r->addr + j - addr];
+            r->acked[j]   = r->pending[j];
+            r->known[j]   = ok;
+            r->dirty[j]   = 0;
+        }
+    }
+    pthread_mutex_unlock( &wc_lock );
+}
+
+// Forget what the BBU acknowledged, e.g. after it was power cycled, the
+// next write of every register goes on the wire again
+// ----------------------------------------------------------- modbusWcInvalidate
+void modbusWcInvalidate
+(
+    int id
+)
+{
+    int i;
+
+    pthread_mutex_lock( &wc_lock );
+    for ( i = 0; i < num_ranges; i++ )
+    {
+        if ( id == MODBUS_WC_ALL_IDS || ranges[i].id == id )
+        {
+            memset( ranges[i].known, 0, ranges[i].count );
+        }
+    }
+    pthread_mutex_unlock( &wc_lock );
+}
+
+// ----------------------------------------------------------- modbusWcGetStats
+int modbusWcGetStats
+(
+    int             range,
+    modbusWcStats_t *stats
+)
+{
+    if ( stats == NULL )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock( &wc_lock );
+    if ( 0 > range || range >= num_ranges )
+    {
+        pthread_mutex_unlock( &wc_lock );
+        TLE( "Bad write combine range = %d", range );
+        return -1;
+    }
+
+    *stats = ranges[range].stats;
+    pthread_mutex_unlock( &wc_lock );
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * Write combining for holding registers, writes into a configured
+ * range are diffed against the last acknowledged values and only the
+ * changed registers go on the wire, merged into as few FC16 frames as
+ * the gap-cost model allows
+ */
+
+#pragma once
+
+// ------------------------------------------------------------------ Includes
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define MODBUS_WC_MAX_RANGES ( 32 )
+#define MODBUS_WC_ALL_IDS    ( -1 )
+
+// ------------------------------------------------------------------ Type Definitions
+typedef struct{
+    uint64_t writes;         // adaptor writes absorbed
+    uint64_t regsWritten;    // registers handed to the combiner
+    uint64_t regsSuppressed; // unchanged, never sent
+    uint64_t frames;         // FC16 frames sent
+    uint64_t regsSent;       // including clean registers read through
+    uint64_t errors;         // failed frames, retried on the next deadline
+} modbusWcStats_t;
+
+// ------------------------------------------------------------------ Function Prototypes
+
+// Holding registers [addr, addr + count) of id are write combined. Writes
+// are flushed deadlineMs after the first unflushed change, 0 flushes
+// before the adaptor returns. Returns the range handle
+int  modbusWcAddRange  ( int id, int addr, int count, uint32_t deadlineMs );
+int  modbusWcFlush     ( int id );
+void modbusWcInvalidate( int id );
+int  modbusWcGetStats  ( int range, modbusWcStats_t *stats );
+
+// Used by modbusWriteHoldingRegistersAdaptor, true if the write was
+// taken by a range, *rc is then the adaptor's return code
+bool modbusWcWrite     ( int id, int addr, int count, const uint16_t *src, int *rc );
+
+// Used around holding register traffic the combiner doesn't take. A
+// read or a direct write of [addr, addr + count) first flushes the
+// ranges it overlaps, so older combined changes neither overwrite a
+// newer direct write nor hide from a read. Written records a direct
+// write's outcome in the ranges it overlaps
+int  modbusWcFlushOverlap( int id, int addr, int count );
+void modbusWcWritten     ( int id, int addr, int count, const uint16_t *src, bool ok );
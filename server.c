@@ -1,62 +1,1028 @@
-#include <modbus.h>
+/**
+ * Copyright 2020 by PlanB eStorage Ltd.
+ * All right reserved
+ *
+ * BBU simulator for load testing. Serves up to MAX_BBUM2_COUNT slaves,
+ * either on one RTU line or on MODBUS_TCP_PORT + i for TCP, each with its
+ * own register map and response latency/jitter profile.
+ *
+ * RTU runs over a local pty pair by default, point the adaptor's stty at
+ * the printed slave path (or the -L link). libmodbus only serves one
+ * slave id per context, so frames are received here and handed to the
+ * addressed slave's context with modbus_reply().
+ *
+ * Slaves are numbered like setModbusContext(): 0..n-1, the RTU slave id
+ * is index + 1.
+ *
+ * -e serves every slave on one TCP port, addressed by unit id (index + 1),
+ * to many concurrent masters: a pool of workers, each with its own epoll
+ * set and SO_REUSEPORT listener. Requests are parsed in place in
+ * preallocated per connection buffers, nothing is logged per request
+ */
 
-#include <string.h> 
-#include <stdlib.h> 
-#include <errno.h>  
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <modbus.h>
+
+#include "modbus_adaptor.h"
+
+// ------------------------------------------------------------------ Definitions
+#define SIM_DEFAULT_REGISTERS   ( 1024 )
+#define SIM_DEFAULT_BITS        ( 256 )
+#define SIM_FRAME_GAP_MS        ( 100 )   // a partial frame older than this is noise
+#define SIM_MAX_WORKERS         ( 64 )
+#define SIM_DEFAULT_CONNECTIONS ( 1024 )  // per worker
+#define SIM_EPOLL_EVENTS        ( 64 )
+#define SIM_MBAP_LENGTH         ( 7 )
+#define SIM_MAX_SLAVES          ( MODBUS_TCP_MAX_UNITS )  // -e, unit ids 1..n
+
+// ------------------------------------------------------------------ Type Definitions
+typedef struct{
+    uint32_t latencyUs;   // turnaround before the reply
+    uint32_t jitterUs;    // + uniform [0, jitterUs]
+    uint32_t dropPct;     // requests left unanswered, 100 == dead unit
+} simProfile_t;
+
+typedef struct{
+    int              index;
+    modbus_t         *ctx;
+    modbus_mapping_t *map;
+    simProfile_t     profile;
+    unsigned int     seed;
+    uint64_t         requests;
+    uint64_t         dropped;
+    pthread_mutex_t  lock;        // -e: map + counters, workers share slaves
+} simSlave_t;
+
+// -e, one per accepted master, never freed
+typedef struct simConn{
+    int             fd;
+    int             have;
+    uint8_t         buf[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+    struct simConn  *nextFree;
+} simConn_t;
+
+typedef struct{
+    int       index;
+    int       epfd;
+    int       listenFd;
+    modbus_t  *ctx;          // only used to reply, socket set per request
+    simConn_t *conns;
+    simConn_t *freeList;
+    uint64_t  requests;      // read by the stats printer, relaxed
+    uint64_t  errors;
+    uint64_t  accepted;
+    uint64_t  rejected;
+} simWorker_t;
+
+// ------------------------------------------------------------------ Static Variables
+static simSlave_t   slaves[SIM_MAX_SLAVES];
+static int          num_slaves = MAX_BBUM2_COUNT;
+static int          first_id   = 1;       // RTU: slave ids first_id..first_id + num_slaves - 1
+static int          baud       = 0;       // RTU: emulate the line's char time, 0 = off
+static bool         debug      = false;
+static const char   *link_path = NULL;
+static simWorker_t  workers[SIM_MAX_WORKERS];
+
+// ------------------------------------------------------------------ Implementation
+
+// ----------------------------------------------------------- usage
+static void usage
+(
+    const char *prog
+)
+{
+    fprintf( stderr,
+        "usage: %s [options]\n"
+        "  -t             TCP, slave i listens on %d + i (default RTU over a pty)\n"
+        "  -a ip          TCP listen address (default 127.0.0.1)\n"
+        "  -s tty         RTU on an existing tty instead of a pty\n"
+        "  -L path        RTU, symlink path to the pty slave\n"
+        "  -B baud        RTU, emulate the character time of baud (default off)\n"
+        "  -f id          RTU, id of the first slave (default 1), one line of several\n"
+        "  -n slaves      number of slaves (default and max %d, -e max %d)\n"
+        "  -r count       holding registers per slave (default %d)\n"
+        "  -i count       input registers per slave (default %d)\n"
+        "  -c count       coils per slave (default %d)\n"
+        "  -d count       discrete inputs per slave (default %d)\n"
+        "  -l us          response latency of every slave\n"
+        "  -j us          response jitter of every slave\n"
+        "  -p i:lat:jit[:drop%%]  profile of slave i, repeatable\n"
+        "  -e             TCP, all slaves on one port by unit id, epoll workers\n"
+        "  -P port        -e listen port (default %d)\n"
+        "  -w workers     -e worker threads (default: online CPUs)\n"
+        "  -m conns       -e connections per worker (default %d)\n"
+        "  -v seconds     -e print counters every seconds (default off)\n"
+        "  -D             libmodbus debug output\n"
+        "latency/jitter are not applied in -e mode, drop is\n",
+        prog, MODBUS_TCP_PORT, MAX_BBUM2_COUNT, SIM_MAX_SLAVES, SIM_DEFAULT_REGISTERS, SIM_DEFAULT_REGISTERS,
+        SIM_DEFAULT_BITS, SIM_DEFAULT_BITS, MODBUS_TCP_PORT, SIM_DEFAULT_CONNECTIONS );
+    exit( 1 );
+}
+
+// ----------------------------------------------------------- onSignal
+static void onSignal
+(
+    int sig
+)
+{
+    if ( link_path != NULL )
+    {
+        unlink( link_path );
+    }
+    _exit( 0 );
+}
+
+// ----------------------------------------------------------- crc16
+static uint16_t crc16
+(
+    const uint8_t *buf,
+    int           len
+)
+{
+    uint16_t crc = 0xFFFF;
+    int      i;
+    int      j;
+
+    for ( i = 0; i < len; i++ )
+    {
+        crc ^= buf[i];
+        for ( j = 0; j < 8; j++ )
+        {
+            crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+// Length of the RTU request starting at buf, 0 if more bytes are needed
+// to tell, -1 for function codes we don't serve
+// ----------------------------------------------------------- rtuRequestLength
+static int rtuRequestLength
+(
+    const uint8_t *buf,
+    int           have
+)
+{
+    if ( have < 2 )
+    {
+        return 0;
+    }
+
+    switch ( buf[1] )
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            return 8;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return ( have < 7 ) ? 0 : 9 + buf[6];
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return ( have < 11 ) ? 0 : 13 + buf[10];
+        default:
+            return -1;
+    }
+}
+
+// Size of the normal response to req, used to emulate the line
+// ----------------------------------------------------------- rtuResponseLength
+static int rtuResponseLength
+(
+    const uint8_t *req
+)
+{
+    const int count = ( req[4] << 8 ) | req[5];
+
+    switch ( req[1] )
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return 5 + ( count + 7 ) / 8;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return 5 + 2 * count;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return 5 + 2 * count;
+        default:
+            return 8;
+    }
+}
+
+// ----------------------------------------------------------- sleepUs
+static void sleepUs
+(
+    uint64_t us
+)
+{
+    struct timespec ts;
+
+    if ( us == 0 )
+    {
+        return;
+    }
+
+    ts.tv_sec  = us / 1000000;
+    ts.tv_nsec = ( us % 1000000 ) * 1000;
+    while ( nanosleep( &ts, &ts ) != 0 && errno == EINTR )
+    {
+    }
+}
+
+// Applies the slave's profile, false if this request goes unanswered
+// ----------------------------------------------------------- simulateTurnaround
+static bool simulateTurnaround
+(
+    simSlave_t *s,
+    uint64_t   wireUs
+)
+{
+    uint64_t delayUs = wireUs + s->profile.latencyUs;
 
+    s->requests++;
 
+    if ( s->profile.dropPct != 0 && (uint32_t)( rand_r( &s->seed ) % 100 ) < s->profile.dropPct )
+    {
+        s->dropped++;
+        return false;
+    }
 
-int main() 
+    if ( s->profile.jitterUs != 0 )
+    {
+        delayUs += (uint32_t)rand_r( &s->seed ) % ( s->profile.jitterUs + 1 );
+    }
+
+    sleepUs( delayUs );
+    return true;
+}
+
+// ----------------------------------------------------------- newSlave
+static int newSlave
+(
+    simSlave_t *s,
+    int        index,
+    int        registers,
+    int        inputRegisters,
+    int        coils,
+    int        inputs
+)
+{
+    int i;
+
+    s->index = index;
+    s->seed  = (unsigned int)( time( NULL ) ^ ( index * 2654435761u ) );
+    pthread_mutex_init( &s->lock, NULL );
+    s->map   = modbus_mapping_new( coils, inputs, registers, inputRegisters );
+    if ( s->map == NULL )
+    {
+        fprintf( stderr, "Failed to allocate the mapping of slave %d: %s\n", index, modbus_strerror( errno ) );
+        return -1;
+    }
+
+    // recognizable content: register a of slave i reads i << 12 | a
+    for ( i = 0; i < registers; i++ )
+    {
+        s->map->tab_registers[i] = (uint16_t)( ( index << 12 ) | ( i & 0x0FFF ) );
+    }
+    for ( i = 0; i < inputRegisters; i++ )
+    {
+        s->map->tab_input_registers[i] = (uint16_t)( ( index << 12 ) | ( i & 0x0FFF ) );
+    }
+    for ( i = 0; i < inputs; i++ )
+    {
+        s->map->tab_input_bits[i] = ( i + index ) & 1;
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------- openPty
+static int openPty
+(
+    char   *name,
+    size_t len
+)
+{
+    struct termios tio;
+    int            master;
+    int            slave;
+
+    master = posix_openpt( O_RDWR | O_NOCTTY );
+    if ( master == -1 || grantpt( master ) != 0 || unlockpt( master ) != 0 ||
+         ptsname_r( master, name, len ) != 0 )
+    {
+        fprintf( stderr, "Failed to create the pty: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    // raw from the start and kept open, the master would see EIO
+    // whenever no client has the slave side open
+    slave = open( name, O_RDWR | O_NOCTTY );
+    if ( slave == -1 || tcgetattr( slave, &tio ) != 0 )
+    {
+        fprintf( stderr, "Failed to open %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+
+    cfmakeraw( &tio );
+    tcsetattr( slave, TCSANOW, &tio );
+    tcgetattr( master, &tio );
+    cfmakeraw( &tio );
+    tcsetattr( master, TCSANOW, &tio );
+
+    return master;
+}
+
+// Handles one complete, CRC checked request frame
+// ----------------------------------------------------------- serveRtuFrame
+static void serveRtuFrame
+(
+    const uint8_t *frame,
+    int           len,
+    int           fd,
+    int           nullFd
+)
+{
+    const int charUs = ( baud != 0 ) ? ( MODBUS_RTU_BITS_PER_CHAR * 1000000 ) / baud : 0;
+    const int id     = frame[0];
+    simSlave_t *s;
+    int        i;
+
+    if ( id == MODBUS_BROADCAST_ID_RTU )
+    {
+        sleepUs( (uint64_t)len * charUs );
+
+        // every slave applies it, nobody answers. Whatever libmodbus
+        // would send goes to /dev/null
+        for ( i = 0; i < num_slaves; i++ )
+        {
+            modbus_set_socket( slaves[i].ctx, nullFd );
+            modbus_reply( slaves[i].ctx, frame, len, slaves[i].map );
+            modbus_set_socket( slaves[i].ctx, fd );
+        }
+        return;
+    }
+
+    if ( id < first_id || id >= first_id + num_slaves )
+    {
+        // not ours, nobody answers
+        return;
+    }
+
+    s = &slaves[id - first_id];
+    if ( !simulateTurnaround( s, (uint64_t)( len + rtuResponseLength( frame ) ) * charUs ) )
+    {
+        return;
+    }
+
+    if ( modbus_reply( s->ctx, frame, len, s->map ) == -1 )
+    {
+        fprintf( stderr, "Reply of slave %d failed: %s\n", s->index, modbus_strerror( errno ) );
+    }
+}
+
+// Splits the byte stream into frames by function code. A CRC error or an
+// unknown function code drops everything up to the next quiet period
+// ----------------------------------------------------------- runRtu
+static int runRtu
+(
+    const char *stty
+)
 {
-		//Prepare a Modbus mapping with 30 holding registers
-	//(plus no output coil, one input coil and two input registers)
-	//This will also automatically set the value of each register to 0
-	modbus_mapping_t *mapping = modbus_mapping_new(0, 1, 30, 2);
-	if (!mapping) {
-			fprintf(stderr, "Failed to allocate the mapping: %s\n", modbus_strerror(errno));
-			exit(1);
-	}
+    uint8_t       buf[4 * MODBUS_RTU_MAX_ADU_LENGTH];
+    char          name[128];
+    struct pollfd pfd;
+    int           have = 0;
+    int           nullFd;
+    int           fd;
+    int           len;
+    int           rc;
+    int           i;
+
+    if ( stty == NULL )
+    {
+        fd = openPty( name, sizeof( name ) );
+        if ( fd == -1 )
+        {
+            return -1;
+        }
+
+        if ( link_path != NULL )
+        {
+            unlink( link_path );
+            if ( symlink( name, link_path ) != 0 )
+            {
+                fprintf( stderr, "Failed to link %s -> %s: %s\n", link_path, name, strerror( errno ) );
+                return -1;
+            }
+        }
+        stty = name;
+    }
+    else
+    {
+        fd = open( stty, O_RDWR | O_NOCTTY );
+        if ( fd == -1 )
+        {
+            fprintf( stderr, "Failed to open %s: %s\n", stty, strerror( errno ) );
+            return -1;
+        }
+    }
+
+    nullFd = open( "/dev/null", O_WRONLY );
 
+    for ( i = 0; i < num_slaves; i++ )
+    {
+        // only used for modbus_reply(), never connected
+        slaves[i].ctx = modbus_new_rtu( stty, ( baud != 0 ) ? baud : MODBUS_RTU_DEFAULT_BAUD, 'N', 8, 1 );
+        if ( slaves[i].ctx == NULL )
+        {
+            fprintf( stderr, "Failed to create the context: %s\n", modbus_strerror( errno ) );
+            return -1;
+        }
+        modbus_set_slave( slaves[i].ctx, first_id + i );
+        modbus_set_socket( slaves[i].ctx, fd );
+        modbus_set_debug( slaves[i].ctx, debug );
+    }
 
-	//Example: set register 12 to integer value 623
-  mapping->tab_registers[0] = 69;
-  mapping->tab_registers[1] = 8008;
+    printf( "RTU: %d slaves (ids %d..%d) on %s%s%s\n", num_slaves, first_id, first_id + num_slaves - 1, stty,
+        link_path ? ", linked from " : "", link_path ? link_path : "" );
+    fflush( stdout );
 
+    pfd.fd     = fd;
+    pfd.events = POLLIN;
 
-	modbus_t *ctx = modbus_new_rtu("/dev/ttyS101", 9600, 'N', 8, 1);
-	if (!ctx) {
-			fprintf(stderr, "Failed to create the context: %s\n", modbus_strerror(errno));
-			exit(1);
-	}
+    while ( 1 )
+    {
+        rc = poll( &pfd, 1, ( have != 0 ) ? SIM_FRAME_GAP_MS : -1 );
+        if ( rc == -1 && errno == EINTR )
+        {
+            continue;
+        }
+
+        if ( rc == 0 )
+        {
+            fprintf( stderr, "Dropping %d bytes of a partial frame\n", have );
+            have = 0;
+            continue;
+        }
+
+        rc = read( fd, buf + have, sizeof( buf ) - have );
+        if ( rc <= 0 )
+        {
+            if ( rc == -1 && ( errno == EAGAIN || errno == EINTR || errno == EIO ) )
+            {
+                continue;
+            }
+            fprintf( stderr, "Read failed: %s\n", strerror( errno ) );
+            return -1;
+        }
+        have += rc;
+
+        while ( have > 0 )
+        {
+            len = rtuRequestLength( buf, have );
+            if ( len == 0 || len > have )
+            {
+                break;
+            }
+
+            if ( len == -1 || crc16( buf, len - 2 ) != ( buf[len - 2] | ( buf[len - 1] << 8 ) ) )
+            {
+                fprintf( stderr, "Bad frame, fc = 0x%02x, dropping %d bytes\n", buf[1], have );
+                have = 0;
+                break;
+            }
+
+            serveRtuFrame( buf, len, fd, nullFd );
+
+            have -= len;
+            memmove( buf, buf + len, have );
+        }
+
+        if ( have == sizeof( buf ) )
+        {
+            have = 0;
+        }
+    }
+
+    return 0;
+}
+
+// One listener per slave, a single client at a time like the BBU
+// ----------------------------------------------------------- tcpThread
+static void *tcpThread
+(
+    void *arg
+)
+{
+    simSlave_t *s = (simSlave_t *)arg;
+    uint8_t    req[MODBUS_TCP_MAX_ADU_LENGTH];
+    int        listenFd;
+    int        fd;
+    int        len;
+
+    listenFd = modbus_tcp_listen( s->ctx, 1 );
+    if ( listenFd == -1 )
+    {
+        fprintf( stderr, "Slave %d failed to listen: %s\n", s->index, modbus_strerror( errno ) );
+        return NULL;
+    }
+
+    while ( 1 )
+    {
+        fd = modbus_tcp_accept( s->ctx, &listenFd );
+        if ( fd == -1 )
+        {
+            continue;
+        }
+
+        while ( 1 )
+        {
+            len = modbus_receive( s->ctx, req );
+            if ( len == -1 )
+            {
+                break;
+            }
+
+            if ( len == 0 || !simulateTurnaround( s, 0 ) )
+            {
+                continue;
+            }
+
+            if ( modbus_reply( s->ctx, req, len, s->map ) == -1 )
+            {
+                break;
+            }
+        }
+
+        close( fd );
+    }
+
+    return NULL;
+}
+
+// ----------------------------------------------------------- runTcp
+static int runTcp
+(
+    const char *ip
+)
+{
+    pthread_t thread;
+    int       i;
+
+    for ( i = 0; i < num_slaves; i++ )
+    {
+        slaves[i].ctx = modbus_new_tcp( ip, MODBUS_TCP_PORT + i );
+        if ( slaves[i].ctx == NULL )
+        {
+            fprintf( stderr, "Failed to create the context: %s\n", modbus_strerror( errno ) );
+            return -1;
+        }
+        modbus_set_debug( slaves[i].ctx, debug );
+
+        if ( pthread_create( &thread, NULL, tcpThread, &slaves[i] ) != 0 )
+        {
+            fprintf( stderr, "Failed to start slave %d\n", i );
+            return -1;
+        }
+    }
+
+    printf( "TCP: %d slaves on %s:%d..%d\n", num_slaves, ip, MODBUS_TCP_PORT, MODBUS_TCP_PORT + num_slaves - 1 );
+    fflush( stdout );
+
+    pause();
+    return 0;
+}
+
+// ----------------------------------------------------------- closeConn
+static void closeConn
+(
+    simWorker_t *w,
+    simConn_t   *c
+)
+{
+    epoll_ctl( w->epfd, EPOLL_CTL_DEL, c->fd, NULL );
+    close( c->fd );
+
+    c->fd       = -1;
+    c->have     = 0;
+    c->nextFree = w->freeList;
+    w->freeList = c;
+}
+
+// ----------------------------------------------------------- acceptConns
+static void acceptConns
+(
+    simWorker_t *w
+)
+{
+    struct epoll_event ev;
+    simConn_t          *c;
+    int                one = 1;
+    int                fd;
+
+    while ( ( fd = accept4( w->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) != -1 )
+    {
+        c = w->freeList;
+        if ( c == NULL )
+        {
+            // full, the master retries against another worker
+            close( fd );
+            w->rejected++;
+            continue;
+        }
+        w->freeList = c->nextFree;
+
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
+        c->fd       = fd;
+        c->have     = 0;
+        ev.events   = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        if ( epoll_ctl( w->epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+        {
+            c->nextFree = w->freeList;
+            w->freeList = c;
+            close( fd );
+            continue;
+        }
+
+        w->accepted++;
+    }
+}
+
+// Replies to every complete ADU in c->buf, false if the connection has
+// to go (bad framing or the master stopped reading)
+// ----------------------------------------------------------- serveConn
+static bool serveConn
+(
+    simWorker_t *w,
+    simConn_t   *c
+)
+{
+    const uint8_t *req = c->buf;
+    simSlave_t    *s;
+    bool          drop;
+    int           unit;
+    int           len;
+    int           rc;
+
+    while ( c->have - ( req - c->buf ) >= SIM_MBAP_LENGTH )
+    {
+        len = 6 + ( ( req[4] << 8 ) | req[5] );
+        if ( req[2] != 0 || req[3] != 0 || len < SIM_MBAP_LENGTH + 1 || len > MODBUS_TCP_MAX_ADU_LENGTH )
+        {
+            w->errors++;
+            return false;
+        }
+
+        if ( c->have - ( req - c->buf ) < len )
+        {
+            break;
+        }
+
+        w->requests++;
+        modbus_set_socket( w->ctx, c->fd );
+
+        unit = req[6];
+        if ( 1 <= unit && unit <= num_slaves )
+        {
+            s = &slaves[unit - 1];
+
+            pthread_mutex_lock( &s->lock );
+            s->requests++;
+            drop = ( s->profile.dropPct != 0 && (uint32_t)( rand_r( &s->seed ) % 100 ) < s->profile.dropPct );
+            if ( drop )
+            {
+                s->dropped++;
+                rc = 0;
+            }
+            else
+            {
+                rc = modbus_reply( w->ctx, req, len, s->map );
+            }
+            pthread_mutex_unlock( &s->lock );
+        }
+        else
+        {
+            rc = modbus_reply_exception( w->ctx, req, MODBUS_EXCEPTION_GATEWAY_TARGET );
+        }
+
+        if ( rc == -1 )
+        {
+            w->errors++;
+            return false;
+        }
+
+        req += len;
+    }
+
+    // keep the partial ADU at the front
+    c->have -= req - c->buf;
+    if ( c->have != 0 && req != c->buf )
+    {
+        memmove( c->buf, req, c->have );
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------- epollWorker
+static void *epollWorker
+(
+    void *arg
+)
+{
+    simWorker_t        *w = (simWorker_t *)arg;
+    struct epoll_event events[SIM_EPOLL_EVENTS];
+    simConn_t          *c;
+    int                n;
+    int                rc;
+    int                i;
+
+    while ( 1 )
+    {
+        n = epoll_wait( w->epfd, events, SIM_EPOLL_EVENTS, -1 );
+        if ( n == -1 )
+        {
+            continue;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            c = (simConn_t *)events[i].data.ptr;
+            if ( c == NULL )
+            {
+                acceptConns( w );
+                continue;
+            }
+
+            // drain, the ADUs may span reads or several may come in one
+            while ( 1 )
+            {
+                rc = read( c->fd, c->buf + c->have, sizeof( c->buf ) - c->have );
+                if ( rc > 0 )
+                {
+                    c->have += rc;
+                    if ( !serveConn( w, c ) )
+                    {
+                        closeConn( w, c );
+                        break;
+                    }
+                    continue;
+                }
+
+                if ( rc == 0 || ( errno != EAGAIN && errno != EINTR ) )
+                {
+                    closeConn( w, c );
+                }
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// ----------------------------------------------------------- listenReusePort
+static int listenReusePort
+(
+    const char *ip,
+    int        port
+)
+{
+    struct sockaddr_in addr;
+    int                one = 1;
+    int                fd;
+
+    fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 )
+    {
+        return -1;
+    }
+
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+    setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof( one ) );
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons( port );
+    addr.sin_addr.s_addr = inet_addr( ip );
+
+    if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 || listen( fd, SOMAXCONN ) != 0 )
+    {
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+// ----------------------------------------------------------- runEpoll
+static int runEpoll
+(
+    const char *ip,
+    int        port,
+    int        nworkers,
+    int        maxConns,
+    int        statsSec
+)
+{
+    struct epoll_event ev;
+    pthread_t          thread;
+    simWorker_t        *w;
+    uint64_t           requests;
+    uint64_t           errors;
+    uint64_t           accepted;
+    uint64_t           rejected;
+    int                i;
+    int                j;
+
+    for ( i = 0; i < nworkers; i++ )
+    {
+        w = &workers[i];
+        w->index    = i;
+        w->epfd     = epoll_create1( EPOLL_CLOEXEC );
+        w->listenFd = listenReusePort( ip, port );
+        w->ctx      = modbus_new_tcp( ip, port );
+        w->conns    = calloc( maxConns, sizeof( simConn_t ) );
+
+        if ( w->epfd == -1 || w->listenFd == -1 || w->ctx == NULL || w->conns == NULL )
+        {
+            fprintf( stderr, "Failed to set up worker %d on %s:%d: %s\n", i, ip, port, strerror( errno ) );
+            return -1;
+        }
+        modbus_set_debug( w->ctx, debug );
+
+        for ( j = maxConns - 1; j >= 0; j-- )
+        {
+            w->conns[j].fd       = -1;
+            w->conns[j].nextFree = w->freeList;
+            w->freeList          = &w->conns[j];
+        }
+
+        ev.events   = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->listenFd, &ev );
+
+        if ( pthread_create( &thread, NULL, epollWorker, w ) != 0 )
+        {
+            fprintf( stderr, "Failed to start worker %d\n", i );
+            return -1;
+        }
+    }
+
+    printf( "TCP: %d slaves (unit ids 1..%d) on %s:%d, %d workers x %d connections\n",
+        num_slaves, num_slaves, ip, port, nworkers, maxConns );
+    fflush( stdout );
+
+    while ( 1 )
+    {
+        if ( statsSec == 0 )
+        {
+            pause();
+            continue;
+        }
+
+        sleep( statsSec );
+
+        requests = errors = accepted = rejected = 0;
+        for ( i = 0; i < nworkers; i++ )
+        {
+            requests += __atomic_load_n( &workers[i].requests, __ATOMIC_RELAXED );
+            errors   += __atomic_load_n( &workers[i].errors, __ATOMIC_RELAXED );
+            accepted += __atomic_load_n( &workers[i].accepted, __ATOMIC_RELAXED );
+            rejected += __atomic_load_n( &workers[i].rejected, __ATOMIC_RELAXED );
+        }
+        fprintf( stderr, "requests %llu, errors %llu, connections %llu, rejected %llu\n",
+            (unsigned long long)requests, (unsigned long long)errors,
+            (unsigned long long)accepted, (unsigned long long)rejected );
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------- main
+int main
+(
+    int  argc,
+    char **argv
+)
+{
+    simProfile_t def        = { 0, 0, 0 };
+    const char   *ip        = "127.0.0.1";
+    const char   *stty      = NULL;
+    const char   *prof[MAX_BBUM2_COUNT];
+    bool         tcp        = false;
+    bool         gateway    = false;
+    int          port       = MODBUS_TCP_PORT;
+    int          nworkers   = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    int          maxConns   = SIM_DEFAULT_CONNECTIONS;
+    int          statsSec   = 0;
+    int          registers  = SIM_DEFAULT_REGISTERS;
+    int          inputRegs  = SIM_DEFAULT_REGISTERS;
+    int          coils      = SIM_DEFAULT_BITS;
+    int          inputs     = SIM_DEFAULT_BITS;
+    int          nprof      = 0;
+    int          opt;
+    int          i;
 
-	//Set the Modbus address of this slave (to 3)
-	modbus_set_slave(ctx, 1);
+    while ( ( opt = getopt( argc, argv, "ta:s:L:B:f:n:r:i:c:d:l:j:p:eP:w:m:v:D" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 't': tcp        = true;                   break;
+            case 'a': ip         = optarg;                 break;
+            case 's': stty       = optarg;                 break;
+            case 'L': link_path  = optarg;                 break;
+            case 'B': baud       = atoi( optarg );         break;
+            case 'f': first_id   = atoi( optarg );         break;
+            case 'n': num_slaves = atoi( optarg );         break;
+            case 'r': registers  = atoi( optarg );         break;
+            case 'i': inputRegs  = atoi( optarg );         break;
+            case 'c': coils      = atoi( optarg );         break;
+            case 'd': inputs     = atoi( optarg );         break;
+            case 'l': def.latencyUs = strtoul( optarg, NULL, 0 ); break;
+            case 'j': def.jitterUs  = strtoul( optarg, NULL, 0 ); break;
+            case 'e': gateway    = true;                   break;
+            case 'P': port       = atoi( optarg );         break;
+            case 'w': nworkers   = atoi( optarg );         break;
+            case 'm': maxConns   = atoi( optarg );         break;
+            case 'v': statsSec   = atoi( optarg );         break;
+            case 'D': debug      = true;                   break;
+            case 'p':
+                if ( nprof == MAX_BBUM2_COUNT )
+                {
+                    usage( argv[0] );
+                }
+                prof[nprof++] = optarg;
+                break;
+            default:
+                usage( argv[0] );
+        }
+    }
 
+    if ( 0 >= num_slaves || num_slaves > ( gateway ? SIM_MAX_SLAVES : MAX_BBUM2_COUNT ) || 0 > baud ||
+         1 > first_id || first_id + num_slaves - 1 > MODBUS_MAX_SLAVE_ID ||
+         0 > registers || registers > 0x10000 || 0 > inputRegs || inputRegs > 0x10000 ||
+         0 > coils || coils > 0x10000 || 0 > inputs || inputs > 0x10000 ||
+         0 >= nworkers || nworkers > SIM_MAX_WORKERS || 0 >= maxConns || 0 > statsSec )
+    {
+        usage( argv[0] );
+    }
 
-	if (modbus_connect(ctx) == -1) {
-			fprintf(stderr, "Unable to connect: %s\n", modbus_strerror(errno));
-			modbus_free(ctx);
-			exit(1);
-	}
+    for ( i = 0; i < num_slaves; i++ )
+    {
+        if ( newSlave( &slaves[i], i, registers, inputRegs, coils, inputs ) != 0 )
+        {
+            return 1;
+        }
+        slaves[i].profile = def;
+    }
 
+    for ( i = 0; i < nprof; i++ )
+    {
+        simProfile_t p = { 0, 0, 0 };
+        int          index;
 
-  modbus_set_debug(ctx, 1);
+        if ( sscanf( prof[i], "%d:%u:%u:%u", &index, &p.latencyUs, &p.jitterUs, &p.dropPct ) < 3 ||
+             0 > index || index >= num_slaves || p.dropPct > 100 )
+        {
+            fprintf( stderr, "Bad profile %s\n", prof[i] );
+            usage( argv[0] );
+        }
+        slaves[index].profile = p;
+    }
 
-	uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];// request buffer
-	int len;// length of the request/response
+    signal( SIGINT, onSignal );
+    signal( SIGTERM, onSignal );
+    signal( SIGPIPE, SIG_IGN );
 
-	while(1) {
-			len = modbus_receive(ctx, req);
-     	printf("got an indication! \n");
-      
-      if(len == 0){
-        printf("got a message not to me!\n");
-        continue;
-      }
+    if ( gateway )
+    {
+        return ( runEpoll( ip, port, nworkers, maxConns, statsSec ) == 0 ) ? 0 : 1;
+    }
 
-			len = modbus_reply(ctx, req, len, mapping);
-			if (len == -1) break;
-	}
-	printf("Exit the loop: %s\n", modbus_strerror(errno));
+    return ( ( tcp ? runTcp( ip ) : runRtu( stty ) ) == 0 ) ? 0 : 1;
 }